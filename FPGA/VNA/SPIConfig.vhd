@@ -89,6 +89,9 @@ architecture Behavioral of SPICommands is
 	signal spi_buf_in : std_logic_vector(15 downto 0);
 	signal spi_complete : std_logic;
 	signal word_cnt : integer range 0 to 19;
+	-- data word within the configuration of the current sweep point
+	signal config_word_cnt : integer range 0 to 5;
+	signal sweep_address : unsigned(12 downto 0);
 	type SPI_states is (Invalid, WriteSweepConfig, ReadResult, WriteRegister, ReadTest);
 	signal state : SPI_states;
 	signal selected_register : integer range 0 to 15;
@@ -121,6 +124,7 @@ begin
 									'0';
 
 	SWEEP_WRITE(0) <= sweep_config_write;
+	SWEEP_ADDRESS <= std_logic_vector(sweep_address);
 
 	process(CLK, RESET)
 	begin
@@ -147,6 +151,8 @@ begin
 			else
 				if sweep_config_write = '1' then
 					sweep_config_write <= '0';
+					-- further configuration words in the same transfer belong to the next point
+					sweep_address <= sweep_address + 1;
 				end if;
 				if NEW_SAMPLING_DATA = '1' then
 					unread_sampling_data <= '1';
@@ -160,13 +166,16 @@ begin
 					RESET_MINMAX <= '0';
 					SWEEP_RESUME <= '0';
 				elsif spi_complete = '1' then
-					word_cnt <= word_cnt + 1;
+					if word_cnt < 19 then
+						word_cnt <= word_cnt + 1;
+					end if;
 					if word_cnt = 0 then
 						-- initial word determines action
 						case spi_buf_out(15 downto 13) is
 							when "000" => state <= WriteSweepConfig;
 											-- also extract the point number
-											SWEEP_ADDRESS <= spi_buf_out(12 downto 0);
+											sweep_address <= unsigned(spi_buf_out(12 downto 0));
+											config_word_cnt <= 0;
 							when "001" => state <= Invalid;
 											SWEEP_RESUME <= '1';
 							when "010" => state <= ReadTest;
@@ -218,13 +227,15 @@ begin
 							end case;
 							selected_register <= selected_register + 1;
 						elsif state = WriteSweepConfig then
-							if word_cnt = 6 then
+							if config_word_cnt = 5 then
 								-- Sweep config data is complete pass on
 								SWEEP_DATA <= sweepconfig_buffer & spi_buf_out;
 								sweep_config_write <= '1';
+								config_word_cnt <= 0;
 							else
 								-- shift next word into buffer
 								sweepconfig_buffer <= sweepconfig_buffer(63 downto 0) & spi_buf_out;
+								config_word_cnt <= config_word_cnt + 1;
 							end if;
 						elsif state = ReadResult then
 							-- pass on next word of latched result
@@ -186,7 +186,12 @@ begin
 						if SAMPLING_BUSY = '0' then
 							if EXCITE_PORT2 = '1' then
 								state <= SettlingPort2;
+							elsif point_cnt < unsigned(NPOINTS) then
+								-- port 2 not excited, this point is complete
+								point_cnt <= point_cnt + 1;
+								state <= TriggerSetup;
 							else
+								point_cnt <= (others => '0');
 								state <= Done;
 							end if;
 							settling_cnt <= unsigned(SETTLING_TIME);
@@ -1,4 +1,5 @@
 HEADERS += \
+    ../../../Software/VNA_embedded/Application/Communication/FrameBuffer.hpp \
     ../../../Software/VNA_embedded/Application/Communication/Protocol.hpp \
     Calibration/calibration.h \
     Calibration/calibrationtracedialog.h \
@@ -12,6 +13,7 @@ HEADERS += \
     Device/device.h \
     Device/devicelog.h \
     Device/manualcontroldialog.h \
+    Device/timingdialog.h \
     Menu/menu.h \
     Menu/menuaction.h \
     Menu/menubool.h \
@@ -40,6 +42,7 @@ HEADERS += \
     vna.h
 
 SOURCES += \
+    ../../../Software/VNA_embedded/Application/Communication/FrameBuffer.cpp \
     ../../../Software/VNA_embedded/Application/Communication/Protocol.cpp \
     Calibration/calibration.cpp \
     Calibration/calibrationtracedialog.cpp \
@@ -53,6 +56,7 @@ SOURCES += \
     Device/device.cpp \
     Device/devicelog.cpp \
     Device/manualcontroldialog.cpp \
+    Device/timingdialog.cpp \
     Menu/menu.cpp \
     Menu/menuaction.cpp \
     Menu/menubool.cpp \
@@ -96,6 +100,7 @@ FORMS += \
     CustomWidgets/touchstoneimport.ui \
     Device/devicelog.ui \
     Device/manualcontroldialog.ui \
+    Device/timingdialog.ui \
     Tools/impedancematchdialog.ui \
     Traces/bodeplotaxisdialog.ui \
     Traces/markerwidget.ui \
@@ -250,6 +250,18 @@ void Calibration::correctMeasurement(Protocol::Datapoint &d)
     // find correct entry
     auto p = getCalibrationPoint(d);
 
+    // Parameters that were not measured are replaced by their value for a perfectly matched DUT. With only one
+    // direction available, the error terms of that direction still give a one-port (reflection) and enhanced
+    // response (transmission) correction
+    if(!(d.valid & Protocol::ParameterForward)) {
+        S11m = p.fe00;
+        S21m = p.fe30;
+    }
+    if(!(d.valid & Protocol::ParameterReverse)) {
+        S22m = p.re33;
+        S12m = p.re03;
+    }
+
     // equations from page 20 of http://www2.electron.frba.utn.edu.ar/~jcecconi/Bibliografia/04%20-%20Param_S_y_VNA/Network_Analyzer_Error_Models_and_Calibration_Methods.pdf
     auto denom = (1.0 + (S11m - p.fe00) / p.fe10e01 * p.fe11) * (1.0 + (S22m - p.re33) / p.re23e32 * p.re22)
             - (S21m - p.fe30) / p.fe10e32 * (S12m - p.re03) / p.re23e01 * p.fe22 * p.re11;
@@ -268,6 +280,13 @@ void Calibration::correctMeasurement(Protocol::Datapoint &d)
     d.imag_S21 = S21.imag();
     d.real_S22 = S22.real();
     d.imag_S22 = S22.imag();
+    // keep parameters that were not measured at zero
+    if(!(d.valid & Protocol::ParameterForward)) {
+        d.real_S11 = d.imag_S11 = d.real_S21 = d.imag_S21 = 0;
+    }
+    if(!(d.valid & Protocol::ParameterReverse)) {
+        d.real_S22 = d.imag_S22 = d.real_S12 = d.imag_S12 = 0;
+    }
 }
 
 Calibration::InterpolationType Calibration::getInterpolation(Protocol::SweepSettings settings)
@@ -530,6 +549,7 @@ istream& operator >>(istream &in, Calibration &c)
                 in >> points;
                 for(unsigned int i=0;i<points;i++) {
                     Protocol::Datapoint p;
+                    p.valid = Protocol::ParameterAll;
                     in >> p.pointNum >> p.frequency;
                     in >> p.imag_S11 >> p.real_S11 >> p.imag_S21 >> p.real_S21 >> p.imag_S12 >> p.real_S12 >> p.imag_S22 >> p.real_S22;
                     c.measurements[m].datapoints.push_back(p);
@@ -5,6 +5,10 @@
 #include <QString>
 #include <QMessageBox>
 #include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <complex>
 
 using namespace std;
 
@@ -13,6 +17,8 @@ Device::Device(QString serial)
     qDebug() << "Starting device connection...";
 
     m_handle = nullptr;
+    rawPoint = {};
+    nextSeq = 0;
     libusb_init(&m_context);
 
     SearchDevices([=](libusb_device_handle *handle, QString found_serial) -> bool {
@@ -62,6 +68,11 @@ Device::Device(QString serial)
     connect(dataBuffer, &USBInBuffer::DataReceived, this, &Device::ReceivedData, Qt::DirectConnection);
     connect(dataBuffer, &USBInBuffer::TransferError, this, &Device::ConnectionLost);
     connect(logBuffer, &USBInBuffer::DataReceived, this, &Device::ReceivedLog, Qt::DirectConnection);
+
+    // the device might still expect sequence numbers from a previous connection
+    Protocol::PacketInfo p;
+    p.type = Protocol::PacketType::SequenceReset;
+    SendCommand(p);
 }
 
 Device::~Device()
@@ -85,48 +96,130 @@ Device::~Device()
 bool Device::Configure(Protocol::SweepSettings settings)
 {
     if(m_connected) {
-        unsigned char buffer[128];
+        auto plan = make_shared<FrequencyPlan>();
+        plan->settings = settings;
         Protocol::PacketInfo p;
         p.type = Protocol::PacketType::SweepSettings;
         p.settings = settings;
-        unsigned int length = Protocol::EncodePacket(p, buffer, sizeof(buffer));
-        if(!length) {
-            qCritical() << "Failed to encode packet";
-            return false;
-        }
-        int actual_length;
-        auto ret = libusb_bulk_transfer(m_handle, EP_Data_Out_Addr, buffer, length, &actual_length, 0);
-        if(ret < 0) {
-            qCritical() << "Error sending data: "
-                                    << libusb_strerror((libusb_error) ret);
+        return SendCommand(p, plan);
+    } else {
+        return false;
+    }
+}
+
+bool Device::ConfigureSegments(const std::vector<Protocol::SweepSegment> &segments, Protocol::DatapointFormat format,
+                               uint8_t parameters)
+{
+    if(!m_connected || segments.empty() || segments.size() > Protocol::MaxSweepSegments) {
+        return false;
+    }
+    auto plan = make_shared<FrequencyPlan>();
+    plan->settings = {};
+    plan->segments = segments;
+    // upload in chunks, the device starts the sweep after the last one
+    Protocol::PacketInfo p;
+    p.type = Protocol::PacketType::SegmentedSweep;
+    p.segments.totalSegments = segments.size();
+    p.segments.format = format;
+    p.segments.parameters = parameters;
+    for(unsigned int i=0;i<segments.size();i+=Protocol::SweepSegmentsPerChunk) {
+        p.segments.startIndex = i;
+        p.segments.count = min(segments.size() - i, (size_t) Protocol::SweepSegmentsPerChunk);
+        copy(segments.begin() + i, segments.begin() + i + p.segments.count, p.segments.segments);
+        bool last = i + p.segments.count >= segments.size();
+        if(!SendCommand(p, last ? plan : nullptr)) {
             return false;
         }
-        return true;
+    }
+    return true;
+}
+
+bool Device::RebuildVCOMaps()
+{
+    if(m_connected) {
+        Protocol::PacketInfo p;
+        p.type = Protocol::PacketType::RebuildVCOMaps;
+        return SendCommand(p);
+    } else {
+        return false;
+    }
+}
+
+bool Device::RequestTiming(bool clear)
+{
+    if(m_connected) {
+        Protocol::PacketInfo p;
+        p.type = Protocol::PacketType::TimingRequest;
+        p.timingRequest.clear = clear ? 1 : 0;
+        return SendCommand(p);
     } else {
         return false;
     }
 }
 
+bool Device::SetAveraging(uint16_t sweeps)
+{
+    if(m_connected) {
+        Protocol::PacketInfo p;
+        p.type = Protocol::PacketType::Averaging;
+        p.averaging.sweeps = sweeps;
+        return SendCommand(p);
+    } else {
+        return false;
+    }
+}
+
+bool Device::SetDeviceInfoInterval(uint16_t ms)
+{
+    if(m_connected) {
+        Protocol::PacketInfo p;
+        p.type = Protocol::PacketType::DeviceInfoInterval;
+        p.deviceInfo.interval = ms;
+        return SendCommand(p);
+    } else {
+        return false;
+    }
+}
+
+bool Device::UpdateFirmware(const QByteArray &image)
+{
+    if(!m_connected || image.size() == 0) {
+        return false;
+    }
+    // the device only accepts complete chunks, pad with the erased flash value
+    auto data = image;
+    auto remainder = data.size() % Protocol::FirmwareChunkSize;
+    if(remainder) {
+        data.append(QByteArray(Protocol::FirmwareChunkSize - remainder, (char) 0xFF));
+    }
+    Protocol::PacketInfo p;
+    p.type = Protocol::PacketType::FirmwareStart;
+    p.firmwareStart.size = data.size();
+    if(!SendCommand(p)) {
+        return false;
+    }
+    // the chunks are pipelined by the command window, the device programs one while receiving the next
+    p.type = Protocol::PacketType::FirmwarePacket;
+    for(uint32_t address = 0;address < (uint32_t) data.size();address += Protocol::FirmwareChunkSize) {
+        p.firmware.address = address;
+        memcpy(p.firmware.data, data.constData() + address, Protocol::FirmwareChunkSize);
+        if(!SendCommand(p)) {
+            return false;
+        }
+    }
+    p.type = Protocol::PacketType::FirmwareVerify;
+    p.firmwareVerify.size = data.size();
+    p.firmwareVerify.crc = Protocol::CRC32(0, data.constData(), data.size());
+    return SendCommand(p);
+}
+
 bool Device::SetManual(Protocol::ManualControl manual)
 {
     if(m_connected) {
-        unsigned char buffer[128];
         Protocol::PacketInfo p;
         p.type = Protocol::PacketType::ManualControl;
         p.manual = manual;
-        unsigned int length = Protocol::EncodePacket(p, buffer, sizeof(buffer));
-        if(!length) {
-            qCritical() << "Failed to encode packet";
-            return false;
-        }
-        int actual_length;
-        auto ret = libusb_bulk_transfer(m_handle, EP_Data_Out_Addr, buffer, length, &actual_length, 0);
-        if(ret < 0) {
-            qCritical() << "Error sending data: "
-                                    << libusb_strerror((libusb_error) ret);
-            return false;
-        }
-        return true;
+        return SendCommand(p);
     } else {
         return false;
     }
@@ -153,7 +246,11 @@ void Device::USBHandleThread()
 {
     qInfo() << "Receive thread started" << flush;
     while (m_connected) {
-        libusb_handle_events(m_context);
+        // wake up regularly to check for unanswered commands
+        timeval tv = {0, 100000};
+        libusb_handle_events_timeout(m_context, &tv);
+        lock_guard<mutex> lock(commandMutex);
+        CheckCommandTimeout();
     }
     qDebug() << "Disconnected, receive thread exiting";
 }
@@ -245,6 +342,24 @@ QString Device::getLastDeviceInfoString()
                 ret.append(" (External available)");
             }
         }
+        if(lastInfo.droppedPoints > 0) {
+            ret.append(" Dropped points: "+QString::number(lastInfo.droppedPoints));
+        }
+        if(lastInfo.droppedPackets > 0) {
+            ret.append(" Dropped USB packets: "+QString::number(lastInfo.droppedPackets));
+        }
+        auto &r = lastInfo.recoveries;
+        if(r.restarts || r.reconfigurations || r.reinitializations) {
+            ret.append(" Sweep recoveries (restart/upload/init): "+QString::number(r.restarts)+"/"
+                       +QString::number(r.reconfigurations)+"/"+QString::number(r.reinitializations));
+        }
+        if(lastInfo.averaging.sweeps > 0) {
+            ret.append(" Averaging: "+QString::number(lastInfo.averaging.completed)+"/"
+                       +QString::number(lastInfo.averaging.sweeps));
+        }
+        auto &b = lastInfo.boot;
+        ret.append(" Boot (clocks/FPGA/init/total): "+QString::number(b.clocks)+"/"+QString::number(b.configuration)+"/"
+                   +QString::number(b.initialization)+"/"+QString::number(b.total)+"ms");
     }
     return ret;
 }
@@ -252,12 +367,28 @@ QString Device::getLastDeviceInfoString()
 void Device::ReceivedData()
 {
     Protocol::PacketInfo packet;
-    uint16_t handled_len;
-    do {
-        handled_len = Protocol::DecodeBuffer(dataBuffer->getBuffer(), dataBuffer->getReceived(), &packet);
-        dataBuffer->removeBytes(handled_len);
+    auto &buffer = dataBuffer->getBuffer();
+    FrameBuffer::Frame frame;
+    while(buffer.nextFrame(frame)) {
+        // decode in place, no data is moved within the receive buffer
+        Protocol::DecodeFrame(frame.data, &packet);
+        buffer.release(frame);
         if(packet.type == Protocol::PacketType::Datapoint) {
             emit DatapointReceived(packet.datapoint);
+        } else if(packet.type == Protocol::PacketType::DatapointBatch) {
+            // unpack block of points, pointNum has already been set by the decoder
+            for(unsigned int i=0;i<packet.batch.count;i++) {
+                auto &d = packet.batch.points[i];
+                if(packet.batch.format != Protocol::DatapointFormat::Full) {
+                    // frequency not transmitted, reconstruct from sweep settings
+                    d.frequency = PointFrequency(d.pointNum);
+                }
+                emit DatapointReceived(d);
+            }
+        } else if(packet.type == Protocol::PacketType::RawDatapointBatch) {
+            for(unsigned int i=0;i<packet.raw.count;i++) {
+                HandleRawMeasurement(packet.raw.measurements[i]);
+            }
         } else if(packet.type == Protocol::PacketType::Status) {
             qDebug() << "Got status";
             emit ManualStatusReceived(packet.status);
@@ -265,23 +396,72 @@ void Device::ReceivedData()
             lastInfo = packet.info;
             lastInfoValid = true;
             emit DeviceInfoUpdated();
+        } else if(packet.type == Protocol::PacketType::TimingHistogram) {
+            emit TimingReceived(packet.timing);
+        } else if(packet.type == Protocol::PacketType::Ack
+                  || packet.type == Protocol::PacketType::Nack
+                  || packet.type == Protocol::PacketType::Retransmit) {
+            lock_guard<mutex> lock(commandMutex);
+            HandleResponse(packet);
         }
-    } while (handled_len > 0);
+    }
 }
 
-void Device::ReceivedLog()
+uint64_t Device::PointFrequency(uint16_t pointNum) const
 {
-    uint16_t handled_len;
-    do {
-        handled_len = 0;
-        auto firstLinebreak = (uint8_t*) memchr(logBuffer->getBuffer(), '\n', logBuffer->getReceived());
-        if(firstLinebreak) {
-            handled_len = firstLinebreak - logBuffer->getBuffer();
-            auto line = QString::fromLatin1((const char*) logBuffer->getBuffer(), handled_len - 1);
-            emit LogLineReceived(line);
-            logBuffer->removeBytes(handled_len + 1);
+    if(!frequencyPlan) {
+        return 0;
+    }
+    if(frequencyPlan->segments.empty()) {
+        return Protocol::PointFrequency(frequencyPlan->settings, pointNum);
+    }
+    for(auto &s : frequencyPlan->segments) {
+        if(pointNum < s.points) {
+            return Protocol::PointFrequency(s, pointNum);
         }
-    } while(handled_len > 0);
+        pointNum -= s.points;
+    }
+    // beyond the last segment
+    return 0;
+}
+
+void Device::HandleRawMeasurement(const Protocol::RawMeasurement &m)
+{
+    emit RawMeasurementReceived(m);
+    if(m.port == 1 || m.pointNum != rawPoint.pointNum) {
+        // first measurement of a point (the previous one is discarded if incomplete)
+        rawPoint = {};
+        rawPoint.pointNum = m.pointNum;
+    }
+    // all accumulators of a measurement contain the same number of samples, it cancels out
+    auto ref = complex<double>(m.RefI, m.RefQ);
+    auto port1 = complex<double>(m.P1I, m.P1Q) / ref;
+    auto port2 = complex<double>(m.P2I, m.P2Q) / ref;
+    if(m.port == 1) {
+        rawPoint.real_S11 = port1.real();
+        rawPoint.imag_S11 = port1.imag();
+        rawPoint.real_S21 = port2.real();
+        rawPoint.imag_S21 = port2.imag();
+        rawPoint.valid |= Protocol::ParameterForward;
+    } else {
+        rawPoint.real_S12 = port1.real();
+        rawPoint.imag_S12 = port1.imag();
+        rawPoint.real_S22 = port2.real();
+        rawPoint.imag_S22 = port2.imag();
+        rawPoint.valid |= Protocol::ParameterReverse;
+    }
+    if(m.last) {
+        rawPoint.frequency = PointFrequency(m.pointNum);
+        emit DatapointReceived(rawPoint);
+    }
+}
+
+void Device::ReceivedLog()
+{
+    auto &buffer = logBuffer->getBuffer();
+    QByteArray data(buffer.getUsed(), 0);
+    buffer.read((uint8_t*) data.data(), data.size());
+    emit LogDataReceived(data);
 }
 
 QString Device::serial() const
@@ -289,14 +469,179 @@ QString Device::serial() const
     return m_serial;
 }
 
+bool Device::SendCommand(Protocol::PacketInfo packet, std::shared_ptr<const FrequencyPlan> plan)
+{
+    lock_guard<mutex> lock(commandMutex);
+    packet.seq = nextSeq;
+    Command c;
+    c.seq = nextSeq;
+    c.type = packet.type;
+    c.plan = plan;
+    c.frame.resize(Protocol::MaxFrameSize);
+    auto length = Protocol::EncodePacket(packet, c.frame.data(), c.frame.size());
+    if(!length) {
+        qCritical() << "Failed to encode packet";
+        return false;
+    }
+    c.frame.resize(length);
+    c.transmitted = false;
+    c.timeouts = 0;
+    nextSeq++;
+    commands.push_back(c);
+    // send right away if the window is not full, otherwise as soon as the device answered earlier commands
+    TransmitCommands();
+    return true;
+}
+
+void Device::TransmitCommands()
+{
+    auto inFlight = std::min(commands.size(), (size_t) Protocol::CommandWindow);
+    for(unsigned int i=0;i<inFlight;i++) {
+        auto &c = commands[i];
+        if(!c.transmitted) {
+            c.transmitted = Transmit(c.frame);
+            c.sent = chrono::steady_clock::now();
+        }
+    }
+}
+
+void Device::RetransmitCommands(uint8_t fromSeq)
+{
+    auto inFlight = std::min(commands.size(), (size_t) Protocol::CommandWindow);
+    auto it = std::find_if(commands.begin(), commands.begin() + inFlight, [&](const Command &c) {
+        return c.transmitted && c.seq == fromSeq;
+    });
+    if(it == commands.begin() + inFlight) {
+        // not in flight (anymore), nothing to resend
+        return;
+    }
+    // the device discards everything after a missing command, resend all of them in order
+    for(;it != commands.begin() + inFlight;it++) {
+        it->transmitted = false;
+    }
+    TransmitCommands();
+}
+
+void Device::HandleResponse(const Protocol::PacketInfo &response)
+{
+    auto inFlight = std::min(commands.size(), (size_t) Protocol::CommandWindow);
+    switch(response.type) {
+    case Protocol::PacketType::Ack:
+    case Protocol::PacketType::Nack: {
+        auto it = std::find_if(commands.begin(), commands.begin() + inFlight, [&](const Command &c) {
+            return c.transmitted && c.seq == response.seq;
+        });
+        if(it == commands.begin() + inFlight) {
+            // duplicate response to a retransmission
+            return;
+        }
+        // Responses are cumulative, all commands up to this one have been executed. Their individual results are
+        // included, the responses to some of them might have been lost
+        for(auto c = commands.begin();c != it + 1;c++) {
+            uint8_t distance = response.seq - c->seq;
+            bool accepted = !(response.response.rejected & (1 << distance));
+            if(!accepted) {
+                qWarning() << "Device rejected command" << c->seq;
+            }
+            if(c->plan && accepted) {
+                // the device sends the response after all points of the previous sweep
+                frequencyPlan = c->plan;
+            }
+            if(c->type == Protocol::PacketType::FirmwareVerify) {
+                emit FirmwareVerified(accepted);
+            }
+        }
+        commands.erase(commands.begin(), it + 1);
+        if(!commands.empty() && commands.front().transmitted) {
+            // the device might have been busy with the answered commands, the timeout of the next one starts now
+            commands.front().sent = chrono::steady_clock::now();
+        }
+        TransmitCommands();
+    }
+        break;
+    case Protocol::PacketType::Retransmit:
+        qDebug() << "Device requested retransmission starting at command" << response.seq;
+        RetransmitCommands(response.seq);
+        break;
+    default:
+        break;
+    }
+}
+
+int Device::CommandTimeout(Protocol::PacketType type)
+{
+    switch(type) {
+    case Protocol::PacketType::ClearFlash:
+        // chip erase
+        return 30000;
+    case Protocol::PacketType::RebuildVCOMaps:
+        // reinitializes the device, including the VCO map builds of both synthesizers
+        return 10000;
+    case Protocol::PacketType::FirmwarePacket:
+        // the first chunk of a 64kB block erases it
+        return 3000;
+    default:
+        return CommandTimeoutMs;
+    }
+}
+
+void Device::CheckCommandTimeout()
+{
+    if(commands.empty()) {
+        return;
+    }
+    auto &oldest = commands.front();
+    if(!oldest.transmitted) {
+        // previous submission failed, try again
+        TransmitCommands();
+        return;
+    }
+    auto timeout = chrono::milliseconds(CommandTimeout(oldest.type) << min(oldest.timeouts, 3U));
+    if(chrono::steady_clock::now() - oldest.sent > timeout) {
+        // Either the command or its response got lost. Only the oldest command is resent: the device answers it
+        // with its latest (cumulative) response or executes it if it never arrived. In the latter case, the device
+        // requests the following commands again by itself
+        if(!oldest.timeouts) {
+            qWarning() << "Command" << oldest.seq << "timed out, resending";
+        }
+        oldest.timeouts++;
+        oldest.transmitted = Transmit(oldest.frame);
+        oldest.sent = chrono::steady_clock::now();
+    }
+}
+
+bool Device::Transmit(const std::vector<unsigned char> &frame)
+{
+    // the transfer gets its own copy of the frame, libusb frees both once the transfer is complete
+    auto buffer = (unsigned char*) malloc(frame.size());
+    memcpy(buffer, frame.data(), frame.size());
+    auto transfer = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(transfer, m_handle, EP_Data_Out_Addr, buffer, frame.size(), TransmitComplete, nullptr, CommandTimeoutMs);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+    auto ret = libusb_submit_transfer(transfer);
+    if(ret < 0) {
+        qCritical() << "Error sending data: "
+                                << libusb_strerror((libusb_error) ret);
+        libusb_free_transfer(transfer);
+        return false;
+    }
+    return true;
+}
+
+void Device::TransmitComplete(libusb_transfer *transfer)
+{
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        // the command will be resent after the timeout
+        qWarning() << "Failed to send command, transfer status" << transfer->status;
+    }
+}
+
 USBInBuffer::USBInBuffer(libusb_device_handle *handle, unsigned char endpoint, int buffer_size) :
-    buffer_size(buffer_size),
-    received_size(0),
-    inCallback(false)
+    memory(new unsigned char[FrameBuffer::RequiredMemory(buffer_size)]),
+    buffer(memory, buffer_size)
 {
-    buffer = new unsigned char[buffer_size];
     transfer = libusb_alloc_transfer(0);
-    libusb_fill_bulk_transfer(transfer, handle, endpoint, buffer, 64, CallbackTrampoline, this, 100);
+    libusb_fill_bulk_transfer(transfer, handle, endpoint, transferBuffer, TransferSize, CallbackTrampoline, this, 100);
     libusb_submit_transfer(transfer);
 }
 
@@ -311,36 +656,32 @@ USBInBuffer::~USBInBuffer()
         cv.wait(lck);
         qDebug() << "Cancellation complete";
     }
-    delete buffer;
-}
-
-void USBInBuffer::removeBytes(int handled_bytes)
-{
-    if(!inCallback) {
-        throw runtime_error("Removing of bytes is only allowed from within receive callback");
-    }
-    if(handled_bytes >= received_size) {
-        received_size = 0;
-    } else {
-        // not removing all bytes, have to move remaining data to the beginning of the buffer
-        memmove(buffer, &buffer[handled_bytes], received_size - handled_bytes);
-        received_size -= handled_bytes;
-    }
+    delete[] memory;
 }
 
-int USBInBuffer::getReceived() const
+FrameBuffer &USBInBuffer::getBuffer()
 {
-    return received_size;
+    return buffer;
 }
 
 void USBInBuffer::Callback(libusb_transfer *transfer)
 {
     switch(transfer->status) {
-    case LIBUSB_TRANSFER_COMPLETED:
-        received_size += transfer->actual_length;
-        inCallback = true;
-        emit DataReceived();
-        inCallback = false;
+    case LIBUSB_TRANSFER_COMPLETED: {
+        auto data = transferBuffer;
+        uint16_t remaining = transfer->actual_length;
+        while(remaining > 0) {
+            auto added = buffer.write(data, remaining);
+            data += added;
+            remaining -= added;
+            emit DataReceived();
+            if(remaining > 0 && buffer.getFree() == 0) {
+                // receiver was unable to handle any of the data, drop the oldest bytes to make room
+                qWarning() << "USB receive buffer full, discarding" << remaining << "bytes";
+                buffer.skip(remaining);
+            }
+        }
+    }
         break;
     case LIBUSB_TRANSFER_ERROR:
     case LIBUSB_TRANSFER_NO_DEVICE:
@@ -364,7 +705,6 @@ void USBInBuffer::Callback(libusb_transfer *transfer)
         break;
     }
     // Resubmit the transfer
-    transfer->buffer = &buffer[received_size];
     libusb_submit_transfer(transfer);
 }
 
@@ -373,9 +713,3 @@ void USBInBuffer::CallbackTrampoline(libusb_transfer *transfer)
     auto usb = (USBInBuffer*) transfer->user_data;
     usb->Callback(transfer);
 }
-
-uint8_t *USBInBuffer::getBuffer() const
-{
-    return buffer;
-}
-
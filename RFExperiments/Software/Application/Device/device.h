@@ -2,15 +2,22 @@
 #define DEVICE_H
 
 #include "../../../Software/VNA_embedded/Application/Communication/Protocol.hpp"
+#include "../../../Software/VNA_embedded/Application/Communication/FrameBuffer.hpp"
 #include <functional>
 #include <libusb-1.0/libusb.h>
 #include <thread>
 #include <QObject>
 #include <condition_variable>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <memory>
 
 Q_DECLARE_METATYPE(Protocol::Datapoint);
 Q_DECLARE_METATYPE(Protocol::ManualStatus);
 Q_DECLARE_METATYPE(Protocol::DeviceInfo);
+Q_DECLARE_METATYPE(Protocol::TimingHistogram);
 
 class USBInBuffer : public QObject {
     Q_OBJECT;
@@ -18,22 +25,21 @@ public:
     USBInBuffer(libusb_device_handle *handle, unsigned char endpoint, int buffer_size);
     ~USBInBuffer();
 
-    void removeBytes(int handled_bytes);
-    int getReceived() const;
-    uint8_t *getBuffer() const;
+    // Received data, only access from within the DataReceived signal
+    FrameBuffer &getBuffer();
 
 signals:
     void DataReceived();
     void TransferError();
 
 private:
+    static constexpr int TransferSize = 64;
     void Callback(libusb_transfer *transfer);
     static void LIBUSB_CALL CallbackTrampoline(libusb_transfer *transfer);
     libusb_transfer *transfer;
-    unsigned char *buffer;
-    int buffer_size;
-    int received_size;
-    bool inCallback;
+    unsigned char transferBuffer[TransferSize];
+    unsigned char *memory;
+    FrameBuffer buffer;
     std::condition_variable cv;
 };
 
@@ -46,7 +52,21 @@ public:
     Device(QString serial = QString());
     ~Device();
     bool Configure(Protocol::SweepSettings settings);
+    // Sweeps all segments in order, the pointNum of the received datapoints counts across the segments
+    bool ConfigureSegments(const std::vector<Protocol::SweepSegment> &segments, Protocol::DatapointFormat format,
+                           uint8_t parameters = Protocol::ParameterAll);
     bool SetManual(Protocol::ManualControl manual);
+    // Discards the stored VCO maps of the synthesizers and builds them again (takes a few seconds)
+    bool RebuildVCOMaps();
+    // The device answers with one TimingReceived per stage. If clear is set, the statistics restart afterwards
+    bool RequestTiming(bool clear);
+    // Averages the given number of sweeps on the device (0 disables averaging), see Protocol::AveragingSettings
+    bool SetAveraging(uint16_t sweeps);
+    // Minimum time between two DeviceInfoUpdated while sweeping, see Protocol::DeviceInfoSettings
+    bool SetDeviceInfoInterval(uint16_t ms);
+    // Streams the image (see AssembleFirmware.py) into the flash of the device, FirmwareVerified reports the result.
+    // The update itself is not triggered
+    bool UpdateFirmware(const QByteArray &image);
     // Returns serial numbers of all connected devices
     static std::vector<QString> GetDevices();
     QString serial() const;
@@ -55,10 +75,16 @@ public:
 
 signals:
     void DatapointReceived(Protocol::Datapoint);
+    // unprocessed receiver accumulators of a sweep with DatapointFormat::Raw, DatapointReceived is emitted
+    // for these sweeps as well
+    void RawMeasurementReceived(Protocol::RawMeasurement);
     void ManualStatusReceived(Protocol::ManualStatus);
     void DeviceInfoUpdated();
     void ConnectionLost();
-    void LogLineReceived(QString line);
+    // binary log stream, decoded by DeviceLog
+    void LogDataReceived(QByteArray data);
+    void TimingReceived(Protocol::TimingHistogram);
+    void FirmwareVerified(bool success);
 private slots:
     void ReceivedData();
     void ReceivedLog();
@@ -71,6 +97,37 @@ private:
     static constexpr int EP_Log_In_Addr = 0x82;
 
     void USBHandleThread();
+    // Commands are pipelined (see Protocol::CommandWindow). They are queued here with their sequence number and
+    // removed when the device responds. Commands that are neither answered nor requested again are resent after
+    // a timeout.
+    static constexpr int CommandTimeoutMs = 500;
+    // Timeout of the oldest unanswered command, counted from when it became the oldest one. Commands that block the
+    // device for a long time (flash erase, VCO map builds) get more time. Doubled after every retransmission
+    static int CommandTimeout(Protocol::PacketType type);
+    // Frequencies of a configured sweep, required to reconstruct the frequency of compact datapoints
+    using FrequencyPlan = struct {
+        Protocol::SweepSettings settings;
+        // only used if not empty, otherwise settings applies
+        std::vector<Protocol::SweepSegment> segments;
+    };
+    using Command = struct {
+        uint8_t seq;
+        Protocol::PacketType type;
+        // takes effect when the device acknowledges the command
+        std::shared_ptr<const FrequencyPlan> plan;
+        std::vector<unsigned char> frame;
+        bool transmitted;
+        std::chrono::steady_clock::time_point sent;
+        unsigned int timeouts;
+    };
+    bool SendCommand(Protocol::PacketInfo packet, std::shared_ptr<const FrequencyPlan> plan = nullptr);
+    // following functions have to be called with commandMutex locked
+    void TransmitCommands();
+    void RetransmitCommands(uint8_t fromSeq);
+    void HandleResponse(const Protocol::PacketInfo &response);
+    void CheckCommandTimeout();
+    bool Transmit(const std::vector<unsigned char> &frame);
+    static void LIBUSB_CALL TransmitComplete(libusb_transfer *transfer);
     // foundCallback is called for every device that is found. If it returns true the search continues, otherwise it is aborted.
     // When the search is aborted the last found device is still opened
     static void SearchDevices(std::function<bool(libusb_device_handle *handle, QString serial)> foundCallback, libusb_context *context);
@@ -86,6 +143,17 @@ private:
     std::thread *m_receiveThread;
     Protocol::DeviceInfo lastInfo;
     bool lastInfoValid;
+    // Plan of the sweep the device is running. Only accessed by the receive thread: it is replaced when the configuring
+    // command is acknowledged, points of the previous sweep that are received before keep their frequencies
+    std::shared_ptr<const FrequencyPlan> frequencyPlan;
+    uint64_t PointFrequency(uint16_t pointNum) const;
+    // S-parameters are calculated here for sweeps with DatapointFormat::Raw
+    void HandleRawMeasurement(const Protocol::RawMeasurement &m);
+    Protocol::Datapoint rawPoint;
+
+    std::deque<Command> commands;
+    std::mutex commandMutex;
+    uint8_t nextSeq;
 };
 
 #endif // DEVICE_H
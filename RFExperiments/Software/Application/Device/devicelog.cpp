@@ -3,9 +3,16 @@
 #include <QScrollBar>
 #include <QFileDialog>
 #include <fstream>
+#include <cstring>
 
 using namespace std;
 
+// Frame format of the binary log, has to match Log.h of the firmware
+static constexpr uint8_t FrameSync = 0xA5;
+static constexpr uint8_t FrameSite = 0x01;
+static constexpr uint8_t FrameEntry = 0x02;
+static constexpr uint8_t FrameLost = 0x03;
+
 DeviceLog::DeviceLog(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::DeviceLog)
@@ -43,6 +50,143 @@ void DeviceLog::addLine(QString line)
     }
 }
 
+void DeviceLog::addData(QByteArray data)
+{
+    pending.append(data);
+    auto u8 = [this](int pos) -> uint8_t {
+        return pending[pos];
+    };
+    auto u16 = [&](int pos) -> uint16_t {
+        return u8(pos) | u8(pos + 1) << 8;
+    };
+    auto u32 = [&](int pos) -> uint32_t {
+        return u16(pos) | (uint32_t) u16(pos + 2) << 16;
+    };
+    while(pending.size() >= 2) {
+        if(u8(0) != FrameSync) {
+            // lost synchronization, skip to the next frame
+            int next = pending.indexOf((char) FrameSync, 1);
+            pending.remove(0, next > 0 ? next : pending.size());
+            continue;
+        }
+        int length;
+        switch(u8(1)) {
+        case FrameSite:
+            if(pending.size() < 5) {
+                return;
+            }
+            length = 5 + u8(4);
+            if(pending.size() < length) {
+                return;
+            } else {
+                // "module\0level\0fmt"
+                auto parts = pending.mid(5, u8(4)).split('\0');
+                Site site;
+                site.module = QString::fromLatin1(parts.value(0));
+                site.level = QString::fromLatin1(parts.value(1));
+                site.fmt = parts.value(2);
+                sites[u16(2)] = site;
+            }
+            break;
+        case FrameEntry:
+            if(pending.size() < 9) {
+                return;
+            }
+            length = 9 + 4 * u8(4);
+            if(pending.size() < length) {
+                return;
+            } else {
+                vector<uint32_t> args;
+                for(int i=0;i<u8(4);i++) {
+                    args.push_back(u32(9 + 4 * i));
+                }
+                auto timestamp = QString("%1").arg(u32(5), 5, 10, QChar('0'));
+                auto it = sites.find(u16(2));
+                if(it == sites.end()) {
+                    addLine(timestamp + " [   Log,ERR]: Unknown log site " + QString::number(u16(2)));
+                } else {
+                    auto &site = it->second;
+                    addLine(timestamp + " [" + QString("%1").arg(site.module.left(6), 6) + "," + site.level + "]: "
+                            + formatArguments(site.fmt, args));
+                }
+            }
+            break;
+        case FrameLost:
+            length = 4;
+            if(pending.size() < length) {
+                return;
+            }
+            addLine("----- [   Log,WRN]: " + QString::number(u16(2)) + " log entries lost");
+            break;
+        default:
+            // not a valid frame, look for the next one
+            length = 1;
+            break;
+        }
+        pending.remove(0, length);
+    }
+}
+
+void DeviceLog::resetDecoder()
+{
+    sites.clear();
+    pending.clear();
+}
+
+QString DeviceLog::formatArguments(const QByteArray &fmt, const std::vector<uint32_t> &args)
+{
+    QString result;
+    unsigned int arg = 0;
+    for(int i=0;i<fmt.size();i++) {
+        if(fmt[i] != '%') {
+            result.append(QChar::fromLatin1(fmt[i]));
+            continue;
+        }
+        if(i + 1 < fmt.size() && fmt[i+1] == '%') {
+            result.append('%');
+            i++;
+            continue;
+        }
+        // collect flags, width and precision. Length modifiers are dropped, all arguments are 32 bit words
+        QByteArray spec = "%";
+        i++;
+        while(i < fmt.size() && strchr("-+ #0123456789.", fmt[i])) {
+            spec.append(fmt[i++]);
+        }
+        while(i < fmt.size() && strchr("hlLqjzt", fmt[i])) {
+            i++;
+        }
+        if(i >= fmt.size()) {
+            break;
+        }
+        char conversion = fmt[i];
+        uint32_t value = arg < args.size() ? args[arg] : 0;
+        arg++;
+        char buf[64];
+        switch(conversion) {
+        case 'd':
+        case 'i':
+            spec.append(conversion);
+            snprintf(buf, sizeof(buf), spec.constData(), (int32_t) value);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            spec.append(conversion);
+            snprintf(buf, sizeof(buf), spec.constData(), value);
+            break;
+        default:
+            // strings and floating point values are not transferred
+            snprintf(buf, sizeof(buf), "<%%%c>", conversion);
+            break;
+        }
+        result.append(QString::fromLatin1(buf));
+    }
+    return result;
+}
+
 void DeviceLog::clear()
 {
     ui->text->clear();
@@ -2,6 +2,8 @@
 #define DEVICELOG_H
 
 #include <QWidget>
+#include <map>
+#include <vector>
 
 namespace Ui {
 class DeviceLog;
@@ -17,13 +19,27 @@ public:
 
 public slots:
     void addLine(QString line);
+    // Binary log stream of the device (see Log.h of the firmware for the format)
+    void addData(QByteArray data);
+    // Forgets the log sites and incomplete data of the previous device
+    void resetDecoder();
     void clear();
 
 private slots:
     void on_bToFile_clicked();
 
 private:
+    // Formats the printf style format string with the raw 32 bit arguments of the device
+    static QString formatArguments(const QByteArray &fmt, const std::vector<uint32_t> &args);
     Ui::DeviceLog *ui;
+
+    using Site = struct {
+        QString module;
+        QString level;
+        QByteArray fmt;
+    };
+    std::map<uint16_t, Site> sites;
+    QByteArray pending;
 };
 
 #endif // DEVICELOG_H
@@ -0,0 +1,102 @@
+#include "timingdialog.h"
+#include "ui_timingdialog.h"
+#include "unit.h"
+#include <QHeaderView>
+
+TimingDialog::TimingDialog(Device &dev, QWidget *parent) :
+    QDialog(parent),
+    ui(new Ui::TimingDialog),
+    dev(dev)
+{
+    ui->setupUi(this);
+    setAttribute(Qt::WA_DeleteOnClose);
+
+    constexpr int stages = (int) Protocol::TimingStage::Last;
+    ui->summary->setColumnCount(5);
+    ui->summary->setRowCount(stages);
+    ui->summary->setHorizontalHeaderLabels({"Count", "Min", "Mean", "Max", "Total"});
+    ui->histogram->setColumnCount(stages);
+    ui->histogram->setRowCount(Protocol::TimingBins);
+    QStringList stageNames;
+    for(int i=0;i<stages;i++) {
+        stageNames.append(StageName((Protocol::TimingStage) i));
+    }
+    ui->summary->setVerticalHeaderLabels(stageNames);
+    ui->histogram->setHorizontalHeaderLabels(stageNames);
+    // bin n contains durations in [2^(n-1), 2^n) us, the last one everything above
+    QStringList binNames;
+    binNames.append("< 1us");
+    for(int i=1;i<Protocol::TimingBins;i++) {
+        auto lower = Unit::ToString((1ULL << (i - 1)) * 1e-6, "s", "um ", 3);
+        if(i < Protocol::TimingBins - 1) {
+            binNames.append(lower + " - " + Unit::ToString((1ULL << i) * 1e-6, "s", "um ", 3));
+        } else {
+            binNames.append(">= " + lower);
+        }
+    }
+    ui->histogram->setVerticalHeaderLabels(binNames);
+    ui->summary->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+    ui->histogram->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+
+    qRegisterMetaType<Protocol::TimingHistogram>("TimingHistogram");
+    connect(&dev, &Device::TimingReceived, this, &TimingDialog::NewHistogram);
+    connect(ui->bUpdate, &QPushButton::clicked, [=]() {
+        this->dev.RequestTiming(false);
+    });
+    connect(ui->bClear, &QPushButton::clicked, [=]() {
+        this->dev.RequestTiming(true);
+    });
+    dev.RequestTiming(false);
+}
+
+TimingDialog::~TimingDialog()
+{
+    delete ui;
+}
+
+void TimingDialog::NewHistogram(Protocol::TimingHistogram h)
+{
+    int stage = (int) h.stage;
+    if(stage >= (int) Protocol::TimingStage::Last) {
+        // unknown stage (newer firmware)
+        return;
+    }
+    auto duration = [](double us) -> QString {
+        return Unit::ToString(us * 1e-6, "s", "um ", 4);
+    };
+    ui->summary->setItem(stage, 0, new QTableWidgetItem(QString::number(h.count)));
+    if(h.count > 0) {
+        ui->summary->setItem(stage, 1, new QTableWidgetItem(duration(h.min_us)));
+        ui->summary->setItem(stage, 2, new QTableWidgetItem(duration((double) h.sum_us / h.count)));
+        ui->summary->setItem(stage, 3, new QTableWidgetItem(duration(h.max_us)));
+        ui->summary->setItem(stage, 4, new QTableWidgetItem(duration(h.sum_us)));
+    } else {
+        for(int i=1;i<5;i++) {
+            ui->summary->setItem(stage, i, new QTableWidgetItem("-"));
+        }
+    }
+    for(int i=0;i<Protocol::TimingBins;i++) {
+        QString text;
+        if(h.bins[i] > 0) {
+            text = QString::number(h.bins[i]);
+            if(h.count > 0) {
+                text += " (" + QString::number(100.0 * h.bins[i] / h.count, 'f', 1) + "%)";
+            }
+        }
+        ui->histogram->setItem(i, stage, new QTableWidgetItem(text));
+    }
+}
+
+QString TimingDialog::StageName(Protocol::TimingStage stage)
+{
+    switch(stage) {
+    case Protocol::TimingStage::Acquisition: return "Acquisition";
+    case Protocol::TimingStage::Readout: return "Readout";
+    case Protocol::TimingStage::Processing: return "Processing";
+    case Protocol::TimingStage::Halt: return "Halt";
+    case Protocol::TimingStage::Point: return "Point";
+    case Protocol::TimingStage::Sweep: return "Sweep";
+    case Protocol::TimingStage::Transmit: return "Transmit";
+    default: return "Unknown";
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef TIMINGDIALOG_H
+#define TIMINGDIALOG_H
+
+#include <QDialog>
+#include "device.h"
+
+namespace Ui {
+class TimingDialog;
+}
+
+// Shows the timing statistics of the sweep stages, as measured by the device
+class TimingDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    explicit TimingDialog(Device &dev, QWidget *parent = nullptr);
+    ~TimingDialog();
+
+public slots:
+    void NewHistogram(Protocol::TimingHistogram h);
+
+private:
+    static QString StageName(Protocol::TimingStage stage);
+    Ui::TimingDialog *ui;
+    Device &dev;
+};
+
+#endif // TIMINGDIALOG_H
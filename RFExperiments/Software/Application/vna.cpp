@@ -27,6 +27,7 @@
 #include "unit.h"
 #include "CustomWidgets/toggleswitch.h"
 #include "Device/manualcontroldialog.h"
+#include "Device/timingdialog.h"
 #include "Traces/tracemodel.h"
 #include "Traces/tracewidget.h"
 #include "Traces/tracesmithchart.h"
@@ -53,6 +54,7 @@ VNA::VNA(QWidget *parent)
 
     settings = defaultSweep;
     averages = 1;
+    deviceAveraging = false;
     calValid = false;
     calMeasuring = false;
     device = nullptr;
@@ -75,6 +77,19 @@ VNA::VNA(QWidget *parent)
     connect(ui->actionDisconnect, &QAction::triggered, this, &VNA::DisconnectDevice);
     connect(ui->actionQuit, &QAction::triggered, this, &VNA::close);
     connect(ui->actionManual_Control, &QAction::triggered, this, &VNA::StartManualControl);
+    connect(ui->actionRebuild_VCO_Maps, &QAction::triggered, [=](){
+        if(device) {
+            device->RebuildVCOMaps();
+        }
+    });
+    connect(ui->actionTiming_Statistics, &QAction::triggered, [=](){
+        if(device) {
+            auto dialog = new TimingDialog(*device, this);
+            // the dialog refers to the device, close it when disconnecting
+            connect(device, &QObject::destroyed, dialog, &QDialog::close);
+            dialog->show();
+        }
+    });
     connect(ui->actionImpedance_Matching, &QAction::triggered, this, &VNA::StartImpedanceMatching);
     connect(ui->actionEdit_Calibration_Kit, &QAction::triggered, [=](){
         cal.getCalibrationKit().edit();
@@ -202,6 +217,16 @@ VNA::VNA(QWidget *parent)
     tS22->fromLivedata(Trace::LivedataType::Overwrite, Trace::LiveParameter::S22);
     traceModel.addTrace(tS22);
 
+    // only request the S-parameters that are displayed
+    for(auto t : traceModel.getTraces()) {
+        connect(t, &Trace::typeChanged, this, &VNA::UpdateRequiredParameters);
+    }
+    connect(&traceModel, &TraceModel::traceAdded, [=](Trace *t) {
+        connect(t, &Trace::typeChanged, this, &VNA::UpdateRequiredParameters);
+        UpdateRequiredParameters();
+    });
+    connect(&traceModel, &TraceModel::traceRemoved, this, &VNA::UpdateRequiredParameters);
+
     auto tracesmith1 = new TraceSmithChart(traceModel);
     tracesmith1->enableTrace(tS11, true);
     auto tracesmith2 = new TraceSmithChart(traceModel);
@@ -516,7 +541,7 @@ void VNA::closeEvent(QCloseEvent *event)
 
 void VNA::NewDatapoint(Protocol::Datapoint d)
 {
-    if(calMeasuring) {
+    if(calMeasuring && d.valid == Protocol::ParameterAll) {
         if(!calWaitFirst || d.pointNum == 0) {
             calWaitFirst = false;
             cal.addMeasurement(calMeasurement, d);
@@ -533,6 +558,8 @@ void VNA::NewDatapoint(Protocol::Datapoint d)
                 if(cal.calculationPossible(Calibration::Type::FullSOLT)) {
                     mCalFullSOLT->setEnabled(true);
                 }
+                // return to the S-parameters required by the traces
+                UpdateRequiredParameters();
             }
             calDialog.setValue(d.pointNum + 1);
         }
@@ -556,7 +583,12 @@ void VNA::UpdateStatusPanel()
     lSpan.setText(Unit::ToString(settings.f_stop - settings.f_start, "Hz", " kMG", 4));
     lPoints.setText(QString::number(settings.points));
     lBandwidth.setText(Unit::ToString(settings.if_bandwidth, "Hz", " k", 2));
-    lAverages.setText(QString::number(average.getLevel()) + "/" + QString::number(averages));
+    if(deviceAveraging) {
+        auto completed = device ? device->getLastInfo().averaging.completed : 0;
+        lAverages.setText(QString::number(completed) + "/" + QString::number(averages) + " (device)");
+    } else {
+        lAverages.setText(QString::number(average.getLevel()) + "/" + QString::number(averages));
+    }
     if(calValid) {
         switch(cal.getInterpolation(settings)) {
         case Calibration::InterpolationType::Extrapolate:
@@ -580,15 +612,58 @@ void VNA::UpdateStatusPanel()
 
 void VNA::SettingsChanged()
 {
-    if(device) {
-        device->Configure(settings);
-    }
+    settings.parameters = RequiredParameters();
+    ConfigureDevice();
     average.reset();
     traceModel.clearVNAData();
     UpdateStatusPanel();
     TracePlot::UpdateSpan(settings.f_start, settings.f_stop);
 }
 
+void VNA::ConfigureDevice()
+{
+    // averaging on the device is only possible if the sweep fits into its memory, the host averages otherwise
+    deviceAveraging = averages > 1 && averages <= Protocol::MaxAverages
+            && settings.points <= Protocol::AveragingPoints(settings.format, settings.parameters);
+    average.setAverages(deviceAveraging ? 1 : averages);
+    if(device) {
+        device->SetAveraging(deviceAveraging ? averages : 0);
+        device->Configure(settings);
+    }
+}
+
+uint8_t VNA::RequiredParameters()
+{
+    if(calMeasuring) {
+        // calibration measurements need all parameters
+        return Protocol::ParameterAll;
+    }
+    uint8_t parameters = 0;
+    for(auto t : traceModel.getTraces()) {
+        if(!t->isLive()) {
+            continue;
+        }
+        switch(t->liveParameter()) {
+        case Trace::LiveParameter::S11: parameters |= Protocol::ParameterS11; break;
+        case Trace::LiveParameter::S12: parameters |= Protocol::ParameterS12; break;
+        case Trace::LiveParameter::S21: parameters |= Protocol::ParameterS21; break;
+        case Trace::LiveParameter::S22: parameters |= Protocol::ParameterS22; break;
+        }
+    }
+    if(!parameters) {
+        // no live traces, keep measuring everything
+        parameters = Protocol::ParameterAll;
+    }
+    return parameters;
+}
+
+void VNA::UpdateRequiredParameters()
+{
+    if(RequiredParameters() != settings.parameters) {
+        SettingsChanged();
+    }
+}
+
 void VNA::ConnectToDevice(QString serial)
 {
     if(device) {
@@ -600,15 +675,21 @@ void VNA::ConnectToDevice(QString serial)
         lConnectionStatus.setText("Connected to " + device->serial());
         qInfo() << "Connected to " << device->serial();
         lDeviceInfo.setText(device->getLastDeviceInfoString());
-        device->Configure(settings);
+        ConfigureDevice();
         connect(device, &Device::DatapointReceived, this, &VNA::NewDatapoint);
-        connect(device, &Device::LogLineReceived, &deviceLog, &DeviceLog::addLine);
+        deviceLog.resetDecoder();
+        connect(device, &Device::LogDataReceived, &deviceLog, &DeviceLog::addData);
         connect(device, &Device::ConnectionLost, this, &VNA::DeviceConnectionLost);
         connect(device, &Device::DeviceInfoUpdated, [this]() {
            lDeviceInfo.setText(device->getLastDeviceInfoString());
+           if(deviceAveraging) {
+               UpdateStatusPanel();
+           }
         });
         ui->actionDisconnect->setEnabled(true);
         ui->actionManual_Control->setEnabled(true);
+        ui->actionRebuild_VCO_Maps->setEnabled(true);
+        ui->actionTiming_Statistics->setEnabled(true);
         ui->menuDefault_Calibration->setEnabled(true);
         // Check if default calibration exists and attempt to load it
         QSettings settings;
@@ -639,6 +720,8 @@ void VNA::DisconnectDevice()
     }
     ui->actionDisconnect->setEnabled(false);
     ui->actionManual_Control->setEnabled(false);
+    ui->actionRebuild_VCO_Maps->setEnabled(false);
+    ui->actionTiming_Statistics->setEnabled(false);
     ui->menuDefault_Calibration->setEnabled(false);
     if(deviceActionGroup->checkedAction()) {
         deviceActionGroup->checkedAction()->setChecked(false);
@@ -984,7 +1067,6 @@ void VNA::SetIFBandwidth(double bandwidth)
 void VNA::SetAveraging(unsigned int averages)
 {
     this->averages = averages;
-    average.setAverages(averages);
     emit averagingChanged(averages);
     SettingsChanged();
 }
@@ -1027,13 +1109,13 @@ void VNA::ApplyCalibration(Calibration::Type type)
 
 void VNA::StartCalibrationMeasurement(Calibration::Measurement m)
 {
-    // Trigger sweep to start from beginning
-    SettingsChanged();
     calMeasurement = m;
     // Delete any already captured data of this measurement
     cal.clearMeasurement(m);
     calWaitFirst = true;
     calMeasuring = true;
+    // Trigger sweep to start from beginning (with all S-parameters)
+    SettingsChanged();
     QString text = "Measuring \"";
     text.append(Calibration::MeasurementToString(m));
     text.append("\" parameters.");
@@ -1049,6 +1131,7 @@ void VNA::StartCalibrationMeasurement(Calibration::Measurement m)
         // the user aborted the calibration measurement
         calMeasuring = false;
         cal.clearMeasurement(calMeasurement);
+        UpdateRequiredParameters();
     });
 }
 
@@ -35,6 +35,8 @@ private:
         .points = 501,
         .if_bandwidth = 1000,
         .cdbm_excitation = 0,
+        .format = Protocol::DatapointFormat::Float,
+        .parameters = Protocol::ParameterAll,
     };
 private slots:
     void NewDatapoint(Protocol::Datapoint d);
@@ -67,6 +69,10 @@ signals:
 private:
     void UpdateStatusPanel();
     void SettingsChanged();
+    // Sends the sweep settings and the averaging to the device
+    void ConfigureDevice();
+    uint8_t RequiredParameters();
+    void UpdateRequiredParameters();
     void DeviceConnectionLost();
     void CreateToolbars();
     void ConstrainAndUpdateFrequencies();
@@ -81,6 +87,8 @@ private:
     QActionGroup *deviceActionGroup;
     Protocol::SweepSettings settings;
     unsigned int averages;
+    // the sweeps are averaged by the device, only the averages are transmitted
+    bool deviceAveraging;
     TraceModel traceModel;
     TraceMarkerModel *markerModel;
     Averaging average;
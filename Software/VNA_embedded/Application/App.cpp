@@ -10,22 +10,40 @@
 #include <cstring>
 #include "USB/usb.h"
 #include "Flash.hpp"
+#include "SPSCQueue.hpp"
+#include "Timing.hpp"
+#include "Averaging.hpp"
 #include "FreeRTOS.h"
 #include "task.h"
+#include "queue.h"
 
 #define LOG_LEVEL	LOG_LEVEL_INFO
 #define LOG_MODULE	"App"
 #include "Log.h"
 
 static Protocol::Datapoint result;
-static Protocol::SweepSettings settings;
+// Filled by the sweep interrupt, emptied by the App task. Absorbs points that arrive while the task is still busy
+static SPSCQueue<Protocol::Datapoint, 32> datapoints;
+// Same for sweeps with DatapointFormat::Raw, each point consists of one measurement per excited port
+static Protocol::RawMeasurement measurement;
+static SPSCQueue<Protocol::RawMeasurement, 16> measurements;
 
 static FPGA::SamplingResult statusResult;
 static Protocol::ManualControl manual;
 
 static Protocol::PacketInfo packet;
+// DatapointBatch or RawDatapointBatch, depending on the format of the sweep
+static Protocol::PacketInfo batch;
+// Number of times the sweep watchdog had to use each recovery level
+static decltype(Protocol::DeviceInfo::recoveries) recoveries;
+static decltype(Protocol::DeviceInfo::boot) boot;
 static TaskHandle_t handle;
 
+// Commands from the host, sized for the maximum number of commands in flight
+static StaticQueue_t commandQueueState;
+static uint8_t commandQueueStorage[Protocol::CommandWindow * sizeof(Protocol::PacketInfo)];
+static QueueHandle_t commandQueue;
+
 // TODO set proper values
 //#define HW_REVISION			'A'
 #define FW_MAJOR			0
@@ -35,6 +53,8 @@ static TaskHandle_t handle;
 // has MCU controllable flash chip, firmware update supported
 #define HAS_FLASH
 #include "Firmware.hpp"
+#include "FirmwareUpload.hpp"
+#include "VCOMapStorage.hpp"
 extern SPI_HandleTypeDef hspi1;
 static Flash flash = Flash(&hspi1, FLASH_CS_GPIO_Port, FLASH_CS_Pin);
 #endif
@@ -44,7 +64,14 @@ static Flash flash = Flash(&hspi1, FLASH_CS_GPIO_Port, FLASH_CS_Pin);
 #define FLAG_STATUSRESULT	0x04
 
 static void VNACallback(Protocol::Datapoint res) {
-	result = res;
+	// if the queue is full, the point is lost and counted (reported in DeviceInfo)
+	datapoints.push(res);
+	BaseType_t woken = false;
+	xTaskNotifyFromISR(handle, FLAG_DATAPOINT, eSetBits, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+static void VNARawCallback(const Protocol::RawMeasurement &m) {
+	measurements.push(m);
 	BaseType_t woken = false;
 	xTaskNotifyFromISR(handle, FLAG_DATAPOINT, eSetBits, &woken);
 	portYIELD_FROM_ISR(woken);
@@ -55,22 +82,158 @@ static void VNAStatusCallback(FPGA::SamplingResult res) {
 	xTaskNotifyFromISR(handle, FLAG_STATUSRESULT, eSetBits, &woken);
 	portYIELD_FROM_ISR(woken);
 }
-static void USBPacketReceived(Protocol::PacketInfo p) {
-	packet = p;
+static void USBPacketReceived(const Protocol::PacketInfo &p) {
+	if(!Protocol::HasSequenceNumber(p.type)) {
+		// not a command
+		return;
+	}
 	BaseType_t woken = false;
+	// If the queue is full anyway, the command is dropped. The resulting gap in the
+	// sequence numbers makes the host retransmit it
+	xQueueSendFromISR(commandQueue, &p, &woken);
 	xTaskNotifyFromISR(handle, FLAG_USB_PACKET, eSetBits, &woken);
 	portYIELD_FROM_ISR(woken);
 }
 
+// Minimum time between DeviceInfo updates while sweeping (in ms), set by the host. Gathering the information
+// requires a pause between two sweeps, all other sweeps are started again right after the last point
+static uint16_t deviceInfoInterval = Protocol::DefaultDeviceInfoInterval;
+
+// Only the gathering requires the pause, the packet is sent once the next sweep is running
+static void GatherDeviceInfo(Protocol::PacketInfo &packet) {
+	packet.type = Protocol::PacketType::DeviceInfo;
+	packet.info.FPGA_configured = 1;
+	packet.info.FW_major = FW_MAJOR;
+	packet.info.FW_minor = FW_MINOR;
+	packet.info.HW_Revision = HW_REVISION;
+	packet.info.droppedPoints = datapoints.getOverflows() + measurements.getOverflows();
+	usb_tx_statistics_t usbStats;
+	usb_get_tx_statistics(&usbStats);
+	packet.info.droppedPackets = usbStats.dropped;
+	packet.info.usbQueueHighWater = usbStats.high_water;
+	packet.info.recoveries = recoveries;
+	packet.info.boot = boot;
+	Averaging::fillDeviceInfo(&packet.info);
+	VNA::fillDeviceInfo(&packet.info);
+}
+
+// Keeps the VCO maps in the flash up to date, skips building them at the next start
+static void StoreVCOMaps() {
+#ifdef HAS_FLASH
+	VNA::VCOMaps maps;
+	if(VNA::GetVCOMaps(&maps)) {
+		VCOMapStorage::Update(&flash, maps);
+	}
+#endif
+}
+
+// Discards the points that have not been sent yet
+static void DiscardPoints() {
+	datapoints.clear();
+	measurements.clear();
+	batch.batch.count = 0;
+	batch.raw.count = 0;
+	Averaging::Restart();
+}
+
+// Format of the sweep that is being configured, only applied by PrepareNewSweep once the sweep is valid
+static Protocol::DatapointFormat newFormat;
+
+// Returns the callback for the raw measurements if the host requested them
+static VNA::RawCallback RawCallbackFor(Protocol::DatapointFormat format) {
+	return format == Protocol::DatapointFormat::Raw ? VNARawCallback : nullptr;
+}
+
+// Called by the VNA when the previous sweep has stopped: discards its points and selects the transmission
+// format for the new one
+static void PrepareNewSweep() {
+	DiscardPoints();
+	auto format = newFormat;
+	if(format == Protocol::DatapointFormat::Raw) {
+		batch.type = Protocol::PacketType::RawDatapointBatch;
+		return;
+	}
+	if(format > Protocol::DatapointFormat::Scaled16) {
+		// unknown format requested, fall back to complete datapoints
+		format = Protocol::DatapointFormat::Full;
+	}
+	batch.type = Protocol::PacketType::DatapointBatch;
+	batch.batch.format = format;
+}
+
+static void FlushBatch() {
+	uint8_t &count = batch.type == Protocol::PacketType::RawDatapointBatch ? batch.raw.count : batch.batch.count;
+	if(count > 0) {
+		uint32_t start = Timing::Now();
+		Communication::Send(batch);
+		Timing::Since(Timing::Stage::Transmit, start);
+		count = 0;
+	}
+}
+
+static void SendTiming(bool clear) {
+	Protocol::PacketInfo p;
+	p.type = Protocol::PacketType::TimingHistogram;
+	for(uint8_t i=0;i<(int) Timing::Stage::Last;i++) {
+		Timing::Get((Timing::Stage) i, &p.timing);
+		Communication::Send(p);
+	}
+	if(clear) {
+		Timing::Clear();
+	}
+}
+
+static void AddToBatch(const Protocol::Datapoint &d) {
+	if(batch.batch.count > 0
+			&& (batch.batch.startIndex + batch.batch.count != d.pointNum || batch.batch.valid != d.valid)) {
+		// point does not continue the current block (missed point or new sweep), send pending points first
+		FlushBatch();
+	}
+	if(batch.batch.count == 0) {
+		batch.batch.startIndex = d.pointNum;
+		batch.batch.valid = d.valid;
+	}
+	batch.batch.points[batch.batch.count++] = d;
+	if(batch.batch.count >= Protocol::DatapointBatchSize
+			|| d.pointNum == VNA::GetSweepPoints() - 1) {
+		// block full or end of sweep
+		FlushBatch();
+	}
+}
+
+static void AddToRawBatch(const Protocol::RawMeasurement &m) {
+	batch.raw.measurements[batch.raw.count++] = m;
+	if(batch.raw.count >= Protocol::RawDatapointBatchSize
+			|| (m.last && m.pointNum == VNA::GetSweepPoints() - 1)) {
+		FlushBatch();
+	}
+}
+
 void App_Start() {
 	handle = xTaskGetCurrentTaskHandle();
+	batch.type = Protocol::PacketType::DatapointBatch;
+	batch.batch.count = 0;
+	batch.batch.format = Protocol::DatapointFormat::Full;
+	batch.batch.valid = Protocol::ParameterAll;
+	commandQueue = xQueueCreateStatic(Protocol::CommandWindow, sizeof(Protocol::PacketInfo),
+			commandQueueStorage, &commandQueueState);
 	usb_init(communication_usb_input);
 	Log_Init();
+	Timing::Init();
 	Communication::SetCallback(USBPacketReceived);
 	// Pass on logging output to USB
 	Log_SetRedirect(usb_log);
 	LOG_INFO("Start");
+#if HW_REVISION == 'A'
+	// Allow USB enumeration, it completes while the device initializes. Commands are queued until the loop is entered
+	USB_EN_GPIO_Port->BSRR = USB_EN_Pin;
+#endif
 	Exti::Init();
+	uint32_t stageStart = HAL_GetTick();
+	// the PLLs lock while the FPGA is configured
+	VNA::InitClocks();
+	boot.clocks = HAL_GetTick() - stageStart;
+	stageStart = HAL_GetTick();
 #ifdef HAS_FLASH
 	if(!flash.isPresent()) {
 		LOG_CRIT("Failed to detect onboard FLASH");
@@ -85,47 +248,88 @@ void App_Start() {
 	} else {
 		LOG_CRIT("Invalid bitstream/firmware, not configuring FPGA");
 	}
+	boot.configuration = HAL_GetTick() - stageStart;
+	VNA::VCOMaps maps;
+	if(VCOMapStorage::Load(&flash, &maps)) {
+		VNA::SetVCOMaps(maps);
+	}
 #else
-	// The FPGA configures itself from the flash, allow time for this
-	vTaskDelay(2000);
+	// The FPGA configures itself from the flash, it responds as soon as it is done
+	FPGA::WaitForConfiguration(2000);
+	boot.configuration = HAL_GetTick() - stageStart;
 #endif
+	stageStart = HAL_GetTick();
 	if (!VNA::Init()) {
 		LOG_CRIT("Initialization failed, unable to start");
+	} else {
+		StoreVCOMaps();
 	}
-
-#if HW_REVISION == 'A'
-	// Allow USB enumeration
-	USB_EN_GPIO_Port->BSRR = USB_EN_Pin;
-#endif
+	boot.initialization = HAL_GetTick() - stageStart;
+	// the tick counts from reset
+	boot.total = HAL_GetTick();
+	LOG_INFO("Ready after %lums", HAL_GetTick());
 
 	uint32_t lastNewPoint = HAL_GetTick();
 	bool sweepActive = false;
-	Protocol::ReferenceSettings reference;
+	Protocol::ReferenceSettings reference = {};
+	// reference settings changed during a sweep, switching is deferred to the end of the sweep
+	bool referencePending = false;
+	uint32_t lastDeviceInfo = HAL_GetTick();
+	// escalates with every watchdog timeout until points arrive again
+	uint8_t recoveryLevel = 0;
+	uint16_t lastPointNum = 0;
+
+	// Called for the last point of every sweep
+	auto sweepComplete = [&]() {
+		Protocol::PacketInfo info;
+		bool infoDue = deviceInfoInterval && HAL_GetTick() - lastDeviceInfo >= deviceInfoInterval;
+		if(referencePending || infoDue) {
+			// Requires SPI mode changes and clock reconfiguration, only possible between sweeps.
+			// ADC limits are collected over all sweeps since the last update (reset by VNA::fillDeviceInfo)
+			VNA::Ref::applySettings(reference);
+			referencePending = false;
+			GatherDeviceInfo(info);
+			lastDeviceInfo = HAL_GetTick();
+			infoDue = true;
+		}
+		// Start next sweep, the remaining points are sent while it is running
+		FPGA::StartSweep();
+		if(infoDue) {
+			Communication::Send(info);
+		}
+	};
 
 	while (1) {
 		uint32_t notification;
-		if(xTaskNotifyWait(0x00, UINT32_MAX, &notification, 100) == pdPASS) {
+		// pass on log entries from interrupts
+		Log_Flush();
+		// a response that did not fit into the USB transmit queue is retried as soon as there is space again
+		bool responsesSent = Communication::SendPendingResponse();
+		if(xTaskNotifyWait(0x00, UINT32_MAX, &notification, responsesSent ? 100 : 2) == pdPASS) {
 			// something happened
 			if(notification & FLAG_DATAPOINT) {
-				Protocol::PacketInfo packet;
-				packet.type = Protocol::PacketType::Datapoint;
-				packet.datapoint = result;
-				Communication::Send(packet);
-				lastNewPoint = HAL_GetTick();
-				if(result.pointNum == settings.points - 1) {
-					// end of sweep
-					VNA::Ref::applySettings(reference);
-					// Compile info packet
-					packet.type = Protocol::PacketType::DeviceInfo;
-					packet.info.FPGA_configured = 1;
-					packet.info.FW_major = FW_MAJOR;
-					packet.info.FW_minor = FW_MINOR;
-					packet.info.HW_Revision = HW_REVISION;
-					VNA::fillDeviceInfo(&packet.info);
-					Communication::Send(packet);
-					FPGA::ResetADCLimits();
-					// Start next sweep
-					FPGA::StartSweep();
+				// notifications do not queue up, handle all points that arrived since the last wakeup
+				while(datapoints.pop(result)) {
+					lastNewPoint = HAL_GetTick();
+					lastPointNum = result.pointNum;
+					recoveryLevel = 0;
+					if(result.pointNum == VNA::GetSweepPoints() - 1) {
+						sweepComplete();
+					}
+					if(Averaging::Add(result)) {
+						AddToBatch(result);
+					}
+				}
+				while(measurements.pop(measurement)) {
+					lastNewPoint = HAL_GetTick();
+					lastPointNum = measurement.pointNum;
+					recoveryLevel = 0;
+					if(measurement.last && measurement.pointNum == VNA::GetSweepPoints() - 1) {
+						sweepComplete();
+					}
+					if(Averaging::Add(measurement)) {
+						AddToRawBatch(measurement);
+					}
 				}
 			}
 			if(notification & FLAG_STATUSRESULT) {
@@ -159,84 +363,193 @@ void App_Start() {
 				FPGA::StartSweep();
 			}
 			if(notification & FLAG_USB_PACKET) {
-				switch(packet.type) {
-				case Protocol::PacketType::SweepSettings:
-					LOG_INFO("New settings received");
-					settings = packet.settings;
-					VNA::ConfigureSweep(settings, VNACallback);
-					sweepActive = true;
-					lastNewPoint = HAL_GetTick();
-					Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					break;
-				case Protocol::PacketType::ManualControl:
-					sweepActive = false;
-					manual = packet.manual;
-					VNA::ConfigureManual(manual, VNAStatusCallback);
-					Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					break;
-				case Protocol::PacketType::Reference:
-					reference = packet.reference;
-					if(!sweepActive) {
-						// can update right now
-						VNA::Ref::applySettings(reference);
+				// handle all commands, the host may send several without waiting for the responses
+				while(xQueueReceive(commandQueue, &packet, 0) == pdPASS) {
+					if(!Communication::AcceptCommand(packet)) {
+						// retransmission or out of sequence
+						continue;
 					}
-					Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					break;
-				case Protocol::PacketType::Generator:
-					sweepActive = false;
-					LOG_INFO("Updating generator setting");
-					VNA::ConfigureGenerator(packet.generator);
-					Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					break;
-#ifdef HAS_FLASH
-				case Protocol::PacketType::ClearFlash:
-					FPGA::AbortSweep();
-					sweepActive = false;
-					LOG_DEBUG("Erasing FLASH in preparation for firmware update...");
-					if(flash.eraseChip()) {
-						LOG_DEBUG("...FLASH erased")
-						Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					} else {
-						LOG_ERR("Failed to erase FLASH");
-						Communication::SendWithoutPayload(Protocol::PacketType::Nack);
+					switch(packet.type) {
+					case Protocol::PacketType::SweepSettings:
+						LOG_INFO("New settings received");
+						newFormat = packet.settings.format;
+						if(VNA::ConfigureSweep(packet.settings, VNACallback, RawCallbackFor(newFormat), PrepareNewSweep)) {
+							Averaging::Start(VNA::GetSweepPoints(), packet.settings.format, packet.settings.parameters);
+							sweepActive = true;
+							lastNewPoint = HAL_GetTick();
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::SegmentedSweep: {
+						auto &s = packet.segments;
+						if(!VNA::AddSweepSegments(s)) {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+							break;
+						}
+						if(s.startIndex + s.count == s.totalSegments) {
+							// got all segments
+							LOG_INFO("New segmented sweep received");
+							newFormat = s.format;
+							if(!VNA::ConfigureSegmentedSweep(VNACallback, RawCallbackFor(newFormat), PrepareNewSweep)) {
+								Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+								break;
+							}
+							Averaging::Start(VNA::GetSweepPoints(), s.format, s.parameters);
+							sweepActive = true;
+							lastNewPoint = HAL_GetTick();
+						}
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
 					}
-					break;
-				case Protocol::PacketType::FirmwarePacket:
-					LOG_INFO("Writing firmware packet at address %u", packet.firmware.address);
-					flash.write(packet.firmware.address, sizeof(packet.firmware.data), packet.firmware.data);
-					Communication::SendWithoutPayload(Protocol::PacketType::Ack);
-					break;
-				case Protocol::PacketType::PerformFirmwareUpdate: {
-					auto fw_info = Firmware::GetFlashContentInfo(&flash);
-					if(fw_info.valid) {
-						Protocol::PacketInfo p;
-						p.type = Protocol::PacketType::Ack;
-						Communication::Send(p);
-						// Some delay to allow communication to finish
-						vTaskDelay(1000);
-						Firmware::PerformUpdate(&flash);
-						// should never get here
-						Communication::SendWithoutPayload(Protocol::PacketType::Nack);
+						break;
+					case Protocol::PacketType::ManualControl:
+						sweepActive = false;
+						manual = packet.manual;
+						VNA::ConfigureManual(manual, VNAStatusCallback);
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						break;
+					case Protocol::PacketType::Reference:
+						reference = packet.reference;
+						if(!sweepActive) {
+							// can update right now
+							VNA::Ref::applySettings(reference);
+						} else {
+							referencePending = true;
+						}
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						break;
+					case Protocol::PacketType::RebuildVCOMaps:
+						LOG_INFO("Rebuilding VCO maps");
+						FPGA::AbortSweep();
+						DiscardPoints();
+						VNA::ClearVCOMaps();
+						if(VNA::Init()) {
+							StoreVCOMaps();
+							VNA::Ref::applySettings(reference);
+							if(sweepActive) {
+								VNA::ReloadSweep();
+								lastNewPoint = HAL_GetTick();
+							}
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							sweepActive = false;
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::Averaging:
+						// the first averaged block starts with the next sweep
+						Averaging::SetSweeps(packet.averaging.sweeps);
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						break;
+					case Protocol::PacketType::DeviceInfoInterval:
+						// takes effect at the end of the current sweep
+						deviceInfoInterval = packet.deviceInfo.interval;
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						break;
+					case Protocol::PacketType::TimingRequest:
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						SendTiming(packet.timingRequest.clear);
+						break;
+					case Protocol::PacketType::Generator:
+						sweepActive = false;
+						LOG_INFO("Updating generator setting");
+						VNA::ConfigureGenerator(packet.generator);
+						Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						break;
+#ifdef HAS_FLASH
+					case Protocol::PacketType::ClearFlash:
+						FPGA::AbortSweep();
+						sweepActive = false;
+						LOG_DEBUG("Erasing FLASH in preparation for firmware update...");
+						if(flash.eraseChip()) {
+							LOG_DEBUG("...FLASH erased");
+							FirmwareUpload::Start(&flash, FirmwareUpload::MaxImageSize, true);
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							LOG_ERR("Failed to erase FLASH");
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::FirmwareStart:
+						FPGA::AbortSweep();
+						sweepActive = false;
+						if(FirmwareUpload::Start(&flash, packet.firmwareStart.size)) {
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::FirmwarePacket:
+						LOG_DEBUG("Writing firmware packet at address %u", packet.firmware.address);
+						// the page is programmed while the next packet is received
+						if(FirmwareUpload::Write(packet.firmware)) {
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::FirmwareVerify:
+						if(FirmwareUpload::Verify(packet.firmwareVerify.size, packet.firmwareVerify.crc)) {
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+						} else {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
+						break;
+					case Protocol::PacketType::PerformFirmwareUpdate: {
+						auto fw_info = Firmware::GetFlashContentInfo(&flash);
+						if(fw_info.valid) {
+							Communication::SendResponse(Protocol::PacketType::Ack, packet.seq);
+							// Some delay to allow communication to finish
+							vTaskDelay(1000);
+							Firmware::PerformUpdate(&flash);
+							// should never get here
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						} else {
+							Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						}
 					}
-				}
-					break;
+						break;
 #endif
-				default:
-					// this packet type is not supported
-					Communication::SendWithoutPayload(Protocol::PacketType::Nack);
-					break;
+					default:
+						// this packet type is not supported
+						Communication::SendResponse(Protocol::PacketType::Nack, packet.seq);
+						break;
+					}
 				}
 			}
 		}
 
 		if(sweepActive && HAL_GetTick() - lastNewPoint > 1000) {
-			LOG_WARN("Timed out waiting for point, last received point was %d", result.pointNum);
+			LOG_WARN("Timed out waiting for point, last received point was %d", lastPointNum);
 			LOG_WARN("FPGA status: 0x%04x", FPGA::GetStatus());
-			FPGA::AbortSweep();
 			// restart the current sweep
-			VNA::Init();
-			VNA::Ref::applySettings(reference);
-			VNA::ConfigureSweep(settings, VNACallback);
+			DiscardPoints();
+			switch(recoveryLevel) {
+			case 0:
+				// most likely a transient glitch, the configuration is still valid
+				LOG_WARN("Restarting sweep");
+				VNA::RestartSweep();
+				recoveries.restarts++;
+				break;
+			case 1:
+				LOG_WARN("Uploading sweep again");
+				VNA::ReloadSweep();
+				recoveries.reconfigurations++;
+				break;
+			default:
+				// reinitialize clocks, FPGA and synthesizers (the VCO maps are reused)
+				LOG_WARN("Reinitializing");
+				VNA::Init();
+				StoreVCOMaps();
+				VNA::Ref::applySettings(reference);
+				VNA::ReloadSweep();
+				recoveries.reinitializations++;
+				break;
+			}
+			if(recoveryLevel < 2) {
+				recoveryLevel++;
+			}
 			sweepActive = true;
 			lastNewPoint = HAL_GetTick();
 		}
@@ -0,0 +1,163 @@
+#include "Averaging.hpp"
+
+#include <cstring>
+
+// Most entries are required for the S-parameters of sweeps with a single excited port (two complex values per point)
+static constexpr uint16_t MaxEntries = Protocol::AveragingMemory / (2 * 2 * sizeof(float));
+
+// Sums of the S-parameters (4 floats per excited port) or of the raw accumulators (6 per excited port)
+static union {
+	float ratio[Protocol::AveragingMemory / sizeof(float)];
+	int64_t raw[Protocol::AveragingMemory / sizeof(int64_t)];
+} sums;
+// Number of accumulated sweeps per point (S-parameters) or port measurement (raw)
+static uint8_t counts[MaxEntries];
+
+static uint16_t sweeps = 1;
+static uint16_t points;
+static Protocol::DatapointFormat format;
+static uint8_t parameters;
+static uint8_t ports;
+static bool active = false;
+// sweeps accumulated in the current block
+static uint16_t completed;
+// accumulation only starts at the first point of a sweep
+static bool started;
+// expected point number, a smaller one means that the end of the previous sweep was lost
+static uint16_t nextPoint;
+
+static constexpr float Protocol::Datapoint::*values[8] = {
+	&Protocol::Datapoint::real_S11, &Protocol::Datapoint::imag_S11,
+	&Protocol::Datapoint::real_S21, &Protocol::Datapoint::imag_S21,
+	&Protocol::Datapoint::real_S12, &Protocol::Datapoint::imag_S12,
+	&Protocol::Datapoint::real_S22, &Protocol::Datapoint::imag_S22,
+};
+
+static void Update() {
+	ports = 0;
+	uint8_t p = parameters ? parameters : Protocol::ParameterAll;
+	if(p & Protocol::ParameterForward) {
+		ports++;
+	}
+	if(p & Protocol::ParameterReverse) {
+		ports++;
+	}
+	active = sweeps > 1 && points > 0 && points <= Protocol::AveragingPoints(format, parameters);
+	Averaging::Restart();
+}
+
+void Averaging::SetSweeps(uint16_t s) {
+	sweeps = s <= Protocol::MaxAverages ? s : Protocol::MaxAverages;
+	Update();
+}
+
+void Averaging::Start(uint16_t p, Protocol::DatapointFormat f, uint8_t param) {
+	points = p;
+	format = f;
+	parameters = param;
+	Update();
+}
+
+void Averaging::Restart() {
+	completed = 0;
+	started = false;
+	nextPoint = 0;
+	memset(counts, 0, sizeof(counts));
+}
+
+static void SweepComplete() {
+	completed++;
+	if(completed >= sweeps) {
+		// block complete, the averages have been transmitted
+		Averaging::Restart();
+	}
+}
+
+// Returns false if the point is not accumulated
+static bool Synchronize(uint16_t point, bool lastOfPoint) {
+	if(started && point < nextPoint) {
+		// the last point of the previous sweep was lost
+		SweepComplete();
+	}
+	if(!started) {
+		if(point != 0) {
+			return false;
+		}
+		started = true;
+	}
+	nextPoint = lastOfPoint ? point + 1 : point;
+	return point < points;
+}
+
+// Returns true if the average has to be transmitted
+static bool Finish(uint16_t point, bool lastOfPoint) {
+	bool transmit = completed + 1 >= sweeps;
+	if(lastOfPoint && point == points - 1) {
+		nextPoint = 0;
+		SweepComplete();
+	}
+	return transmit;
+}
+
+bool Averaging::Add(Protocol::Datapoint &d) {
+	if(!active) {
+		return true;
+	}
+	if(!Synchronize(d.pointNum, true)) {
+		return false;
+	}
+	// the counts are cleared when the block is complete, keep a copy
+	uint8_t count = counts[d.pointNum]++;
+	float *sum = &sums.ratio[d.pointNum * ports * 4];
+	uint8_t k = 0;
+	for(uint8_t j=0;j<8 && k<ports * 4;j++) {
+		if(!(d.valid & (1 << (j / 2)))) {
+			continue;
+		}
+		sum[k] = count ? sum[k] + d.*values[j] : d.*values[j];
+		k++;
+	}
+	count++;
+	if(!Finish(d.pointNum, true)) {
+		return false;
+	}
+	k = 0;
+	for(uint8_t j=0;j<8 && k<ports * 4;j++) {
+		if(!(d.valid & (1 << (j / 2)))) {
+			continue;
+		}
+		d.*values[j] = sum[k] / count;
+		k++;
+	}
+	return true;
+}
+
+bool Averaging::Add(Protocol::RawMeasurement &m) {
+	if(!active) {
+		return true;
+	}
+	if(!Synchronize(m.pointNum, m.last)) {
+		return false;
+	}
+	uint16_t entry = m.pointNum * ports + (ports > 1 && m.port == 2 ? 1 : 0);
+	uint8_t count = counts[entry]++;
+	int64_t *sum = &sums.raw[entry * 6];
+	int64_t *acc[6] = {&m.P1I, &m.P1Q, &m.P2I, &m.P2Q, &m.RefI, &m.RefQ};
+	for(uint8_t i=0;i<6;i++) {
+		sum[i] = count ? sum[i] + *acc[i] : *acc[i];
+	}
+	count++;
+	if(!Finish(m.pointNum, m.last)) {
+		return false;
+	}
+	// the average of 48 bit values still fits into the transmitted range, the sample count is unchanged
+	for(uint8_t i=0;i<6;i++) {
+		*acc[i] = sum[i] / count;
+	}
+	return true;
+}
+
+void Averaging::fillDeviceInfo(Protocol::DeviceInfo *info) {
+	info->averaging.sweeps = active ? sweeps : 0;
+	info->averaging.completed = completed;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include "Protocol.hpp"
+
+// Averaging of consecutive sweeps on the device (see Protocol::AveragingSettings). The points are accumulated
+// by the App task, only the averages of the last sweep of every block are transmitted.
+namespace Averaging {
+
+// Averaged sweeps per transmitted sweep, restarts the accumulation
+void SetSweeps(uint16_t sweeps);
+// Called for every new sweep configuration, averaging is inactive if the sweep does not fit into the accumulators
+void Start(uint16_t points, Protocol::DatapointFormat format, uint8_t parameters);
+// Discards the accumulated sweeps, the next block starts with the next sweep
+void Restart();
+// Accumulate a point (or port measurement). Returns true if it has to be transmitted, it then contains the average
+bool Add(Protocol::Datapoint &d);
+bool Add(Protocol::RawMeasurement &m);
+void fillDeviceInfo(Protocol::DeviceInfo *info);
+
+}
@@ -3,11 +3,23 @@
 #include "stm.hpp"
 #include "../App.h"
 #include <string.h>
+#include "FrameBuffer.hpp"
 #include "USB/usb.h"
+#include "Log.h"
 
-static uint8_t inputBuffer[1024];
-uint16_t inputCnt = 0;
-static uint8_t outputBuffer[1024];
+static uint8_t inputMemory[FrameBuffer::RequiredMemory(1024)];
+static FrameBuffer input = FrameBuffer(inputMemory, 1024);
+static uint8_t outputBuffer[Protocol::MaxFrameSize];
+static Protocol::PacketInfo received;
+
+// sequence number of the next command that will be executed
+static uint8_t expectedSeq = 0;
+static bool retransmitRequested = false;
+// results of the latest executed commands (see Protocol::Response), bit 0 belongs to the latest one
+static uint8_t rejected = 0;
+static uint8_t responseSeq;
+// the latest response did not fit into the USB transmit queue, SendPendingResponse tries again
+static bool responsePending = false;
 
 static Communication::Callback callback = nullptr;
 
@@ -17,36 +29,41 @@ void Communication::SetCallback(Callback cb) {
 
 
 void Communication::Input(const uint8_t *buf, uint16_t len) {
-	if (inputCnt + len < sizeof(inputBuffer)) {
+	while (len > 0) {
 		// add received data to input buffer
-		memcpy(&inputBuffer[inputCnt], buf, len);
-		inputCnt += len;
-	}
-	Protocol::PacketInfo packet;
-	uint16_t handled_len;
-	do {
-		handled_len = Protocol::DecodeBuffer(inputBuffer, inputCnt, &packet);
-		if (handled_len == inputCnt) {
-			// complete input buffer used up, reset counter
-			inputCnt = 0;
-		} else {
-			// only used part of the buffer, move up remaining bytes
-			uint16_t remaining = inputCnt - handled_len;
-			memmove(inputBuffer, &inputBuffer[handled_len], remaining);
-			inputCnt = remaining;
-		}
-		if(packet.type != Protocol::PacketType::None) {
+		uint16_t added = input.write(buf, len);
+		buf += added;
+		len -= added;
+		// handle all complete frames, they are decoded directly from the input buffer
+		FrameBuffer::Frame frame;
+		while (input.nextFrame(frame)) {
+			Protocol::DecodeFrame(frame.data, &received);
+			input.release(frame);
 			if(callback) {
-				callback(packet);
+				callback(received);
 			}
 		}
-	} while (handled_len > 0);
+		if (len > 0 && input.getFree() == 0) {
+			// Can not happen as long as the buffer holds at least one maximum sized frame,
+			// make sure to never get stuck anyway
+			input.skip(len);
+		}
+	}
 }
 
-bool Communication::Send(Protocol::PacketInfo packet) {
+// Responses and retransmit requests may use the reserved part of the USB transmit queue
+static bool SendPacket(const Protocol::PacketInfo &packet, bool reserved) {
 	uint16_t len = Protocol::EncodePacket(packet, outputBuffer,
 					sizeof(outputBuffer));
-	return usb_transmit(outputBuffer, len);
+	if(!len) {
+		return false;
+	}
+	// copied into the USB transmit queue, outputBuffer can be reused right away
+	return reserved ? usb_transmit_reserved(outputBuffer, len) : usb_transmit(outputBuffer, len);
+}
+
+bool Communication::Send(Protocol::PacketInfo packet) {
+	return SendPacket(packet, false);
 //	if (hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED) {
 //		uint16_t len = Protocol::EncodePacket(packet, outputBuffer,
 //				sizeof(outputBuffer));
@@ -68,3 +85,58 @@ bool Communication::SendWithoutPayload(Protocol::PacketType type) {
 	p.type = type;
 	return Send(p);
 }
+
+bool Communication::AcceptCommand(const Protocol::PacketInfo &command) {
+	if(command.type == Protocol::PacketType::SequenceReset) {
+		// host (re)started the numbering, nothing else to execute. A new connection also needs the log sites again
+		Log_ResendSites();
+		expectedSeq = command.seq + 1;
+		retransmitRequested = false;
+		rejected = 0;
+		SendResponse(Protocol::PacketType::Ack, command.seq);
+		return false;
+	}
+	int8_t diff = command.seq - expectedSeq;
+	if(diff == 0) {
+		expectedSeq++;
+		retransmitRequested = false;
+		rejected <<= 1;
+		return true;
+	} else if(diff < 0 && diff >= -Protocol::CommandWindow) {
+		// Already executed, the response must have been lost. Responses are cumulative and contain the results of
+		// the previous commands, repeating the latest one is enough
+		responsePending = true;
+		SendPendingResponse();
+	} else if(!retransmitRequested) {
+		// missed at least one command, the host has to resend everything starting at the expected one.
+		// Only request this once, the following commands in the window will show the same gap
+		Protocol::PacketInfo p;
+		p.type = Protocol::PacketType::Retransmit;
+		p.seq = expectedSeq;
+		retransmitRequested = SendPacket(p, true);
+	}
+	return false;
+}
+
+void Communication::SendResponse(Protocol::PacketType type, uint8_t seq) {
+	if(type == Protocol::PacketType::Nack) {
+		rejected |= 0x01;
+	} else {
+		rejected &= ~0x01;
+	}
+	responseSeq = seq;
+	responsePending = true;
+	SendPendingResponse();
+}
+
+bool Communication::SendPendingResponse() {
+	if(!responsePending) {
+		return true;
+	}
+	Protocol::PacketInfo p;
+	p.type = rejected & 0x01 ? Protocol::PacketType::Nack : Protocol::PacketType::Ack;
+	p.seq = responseSeq;
+	p.response.rejected = rejected;
+	responsePending = !SendPacket(p, true);
+	return !responsePending;
+}
@@ -8,12 +8,20 @@
 
 namespace Communication {
 
-using Callback = void(*)(Protocol::PacketInfo);
+using Callback = void(*)(const Protocol::PacketInfo&);
 
 void SetCallback(Callback cb);
 void Input(const uint8_t *buf, uint16_t len);
 bool Send(Protocol::PacketInfo packet);
 bool SendWithoutPayload(Protocol::PacketType type);
+// Sequence number check for commands from the host (see Protocol::CommandWindow). Returns true if the command
+// has to be executed and answered with SendResponse. Retransmissions and commands after a gap are handled here.
+bool AcceptCommand(const Protocol::PacketInfo &command);
+// Answers an executed command with Ack or Nack. A response that does not fit into the USB transmit queue is
+// kept and sent by SendPendingResponse, it is never dropped
+void SendResponse(Protocol::PacketType type, uint8_t seq);
+// Returns false if the latest response could still not be queued, it has to be called again later
+bool SendPendingResponse();
 
 }
 
@@ -0,0 +1,119 @@
+#include "FrameBuffer.hpp"
+
+#include <cstring>
+
+uint16_t FrameBuffer::write(const uint8_t *src, uint16_t len) {
+	if(len > getFree()) {
+		len = getFree();
+	}
+	uint16_t remaining = len;
+	while(remaining > 0) {
+		uint16_t chunk = capacity - writePos;
+		if(chunk > remaining) {
+			chunk = remaining;
+		}
+		memcpy(&buf[writePos], src, chunk);
+		if(writePos < Overhang) {
+			// keep the mirror behind the ring up to date
+			uint16_t mirrored = Overhang - writePos;
+			if(mirrored > chunk) {
+				mirrored = chunk;
+			}
+			memcpy(&buf[capacity + writePos], src, mirrored);
+		}
+		src += chunk;
+		remaining -= chunk;
+		writePos += chunk;
+		if(writePos >= capacity) {
+			writePos = 0;
+		}
+	}
+	used += len;
+	return len;
+}
+
+bool FrameBuffer::nextFrame(Frame &f) {
+	while(used > 0) {
+		uint8_t *data = &buf[readPos];
+		if(*data != Protocol::FrameHeader) {
+			// remove out-of-order bytes in front of the frame
+			skip(1);
+			continue;
+		}
+		if(used < Protocol::FrameHeaderSize) {
+			// the frame header has not been completely received
+			return false;
+		}
+		uint16_t length = Protocol::FrameLength(data);
+		if(length < Protocol::FrameOverhead || length > Protocol::MaxFrameSize
+				|| length > capacity) {
+			// can not be a valid frame, remove header
+			skip(1);
+			continue;
+		}
+		if(used < length) {
+			// the frame payload has not been completely received
+			return false;
+		}
+		if(!Protocol::FrameValid(data, length)) {
+			// CRC mismatch, remove header
+			skip(1);
+			continue;
+		}
+		f.data = data;
+		f.length = length;
+		return true;
+	}
+	return false;
+}
+
+void FrameBuffer::release(const Frame &f) {
+	skip(f.length);
+}
+
+int32_t FrameBuffer::find(uint8_t value) const {
+	uint16_t first = capacity - readPos;
+	if(first > used) {
+		first = used;
+	}
+	auto found = (const uint8_t*) memchr(&buf[readPos], value, first);
+	if(found) {
+		return found - &buf[readPos];
+	}
+	found = (const uint8_t*) memchr(buf, value, used - first);
+	if(found) {
+		return first + (found - buf);
+	}
+	return -1;
+}
+
+uint16_t FrameBuffer::read(uint8_t *dest, uint16_t len) {
+	if(len > used) {
+		len = used;
+	}
+	uint16_t first = capacity - readPos;
+	if(first > len) {
+		first = len;
+	}
+	memcpy(dest, &buf[readPos], first);
+	memcpy(&dest[first], buf, len - first);
+	skip(len);
+	return len;
+}
+
+void FrameBuffer::skip(uint16_t len) {
+	if(len > used) {
+		len = used;
+	}
+	used -= len;
+	readPos += len;
+	if(readPos >= capacity) {
+		readPos -= capacity;
+	}
+}
+
+void FrameBuffer::clear() {
+	readPos = 0;
+	writePos = 0;
+	used = 0;
+}
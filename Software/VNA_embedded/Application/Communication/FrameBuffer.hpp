@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include "Protocol.hpp"
+
+/*
+ * Ring buffer for received data that locates frames in place.
+ *
+ * Behind the ring, the first Overhang bytes of the buffer are mirrored. A frame starting anywhere in the
+ * ring is therefore always contiguous in memory, even if it wraps around the end, and can be decoded
+ * without moving any bytes. The memory passed to the constructor must be at least capacity + Overhang bytes.
+ */
+class FrameBuffer {
+public:
+	static constexpr uint16_t Overhang = Protocol::MaxFrameSize;
+	static constexpr uint16_t RequiredMemory(uint16_t capacity) {
+		return capacity + Overhang;
+	}
+
+	FrameBuffer(uint8_t *mem, uint16_t capacity) :
+		buf(mem),
+		capacity(capacity),
+		readPos(0),
+		writePos(0),
+		used(0) {};
+
+	// View of a complete, CRC-checked frame inside the buffer. Only valid until release() is called
+	using Frame = struct {
+		uint8_t *data;
+		uint16_t length;
+	};
+
+	// Adds received data, returns the number of bytes that fit into the buffer
+	uint16_t write(const uint8_t *src, uint16_t len);
+	// Looks for the next valid frame, discarding any bytes in front of it and corrupted frames.
+	// Returns false if no complete frame is available (yet).
+	bool nextFrame(Frame &f);
+	// Removes a frame previously returned by nextFrame
+	void release(const Frame &f);
+
+	// Access for non-framed data
+	uint16_t getUsed() const {
+		return used;
+	}
+	uint16_t getFree() const {
+		return capacity - used;
+	}
+	// Returns the offset of the first occurrence of value (relative to the oldest byte) or -1 if not contained
+	int32_t find(uint8_t value) const;
+	// Copies up to len bytes to dest and removes them from the buffer, returns the number of copied bytes
+	uint16_t read(uint8_t *dest, uint16_t len);
+	void skip(uint16_t len);
+	void clear();
+
+private:
+	uint8_t *buf;
+	const uint16_t capacity;
+	uint16_t readPos;
+	uint16_t writePos;
+	uint16_t used;
+};
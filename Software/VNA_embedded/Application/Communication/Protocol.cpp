@@ -1,78 +1,131 @@
 #include "Protocol.hpp"
 
 #include <cstring>
+#include <cmath>
+#include <type_traits>
+
+// The firmware calculates the frame checksum with the CRC peripheral, the host uses the table-driven
+// software implementation. Define PROTOCOL_NO_HW_CRC to force the software implementation on the device.
+#if defined(STM32L432xx) && !defined(PROTOCOL_NO_HW_CRC)
+#define PROTOCOL_HW_CRC
+#include "HWCRC.hpp"
+#endif
 
 /*
  * General packet format:
  * 1. 1 byte header
  * 2. 2 byte overall packet length (with header and checksum)
  * 3. packet type
- * 4. packet payload
+ * 4. packet payload (starting with the sequence number for commands and responses)
  * 5. 4 byte CRC32 (with header)
  */
 
-static constexpr uint8_t header = 0x5A;
-static constexpr uint8_t header_size = 4;
 
+#ifndef PROTOCOL_HW_CRC
+// The software implementation (and its 8kB of tables) is only linked if the peripheral is not used
 #define CRC32_POLYGON 0xEDB88320
-uint32_t Protocol::CRC32(uint32_t crc, const void *data, uint32_t len) {
-	uint8_t *u8buf = (uint8_t*) data;
-	int k;
+
+// Lookup tables for slicing-by-8: table[0] is the classic byte-wise table,
+// table[n] advances a byte through n additional zero bytes
+using CRC32Tables = struct {
+	uint32_t table[8][256];
+};
+static constexpr CRC32Tables BuildCRC32Tables() {
+	CRC32Tables t{};
+	for (uint16_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (uint8_t k = 0; k < 8; k++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYGON : crc >> 1;
+		}
+		t.table[0][i] = crc;
+	}
+	for (uint16_t i = 0; i < 256; i++) {
+		for (uint8_t n = 1; n < 8; n++) {
+			uint32_t prev = t.table[n - 1][i];
+			t.table[n][i] = (prev >> 8) ^ t.table[0][prev & 0xFF];
+		}
+	}
+	return t;
+}
+static constexpr CRC32Tables crc32 = BuildCRC32Tables();
+
+uint32_t Protocol::CRC32Software(uint32_t crc, const void *data, uint32_t len) {
+	auto u8buf = (const uint8_t*) data;
+	auto &t = crc32.table;
 
 	crc = ~crc;
+	while (len >= 8) {
+		// assemble words byte by byte to stay independent of endianness and alignment
+		uint32_t one = crc ^ ((uint32_t) u8buf[0] | (uint32_t) u8buf[1] << 8
+				| (uint32_t) u8buf[2] << 16 | (uint32_t) u8buf[3] << 24);
+		uint32_t two = (uint32_t) u8buf[4] | (uint32_t) u8buf[5] << 8
+				| (uint32_t) u8buf[6] << 16 | (uint32_t) u8buf[7] << 24;
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF]
+				^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+				^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF]
+				^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+		u8buf += 8;
+		len -= 8;
+	}
 	while (len--) {
-		crc ^= *u8buf++;
-		for (k = 0; k < 8; k++)
-			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYGON : crc >> 1;
+		crc = (crc >> 8) ^ t[0][(crc ^ *u8buf++) & 0xFF];
 	}
 	return ~crc;
 }
+#endif
+
+uint32_t Protocol::CRC32(uint32_t crc, const void *data, uint32_t len) {
+#ifdef PROTOCOL_HW_CRC
+	return HWCRC::CRC32(crc, data, len);
+#else
+	return CRC32Software(crc, data, len);
+#endif
+}
 
+// Schema visitor writing the fields into the buffer. The size of fixed packets is known at compile time
+// and checked once before encoding, no bounds checks per field are necessary
 class Encoder {
 public:
-    Encoder(uint8_t *buf, uint16_t size) :
+    Encoder(uint8_t *buf) :
         buf(buf),
-        bufSize(size),
         usedSize(0),
-        bitpos(0) {
-        memset(buf, 0, size);
-    };
-    template<typename T> bool add(T data) {
+        bitpos(0) {};
+    template<typename T> void field(const T &data) {
         if(bitpos != 0) {
             // add padding to next byte boundary
             bitpos = 0;
             usedSize++;
         }
-        if(bufSize - usedSize < (long) sizeof(T)) {
-            // not enough space left
-            return false;
-        }
         memcpy(&buf[usedSize], &data, sizeof(T));
         usedSize += sizeof(T);
-        return true;
     }
-    bool addBits(uint8_t value, uint8_t bits) {
-        if(bits >= 8 || usedSize >= bufSize) {
-            return false;
+    template<typename T> void field(const T &data, uint8_t size) {
+        if(bitpos != 0) {
+            bitpos = 0;
+            usedSize++;
+        }
+        // little endian, the lower bytes come first
+        memcpy(&buf[usedSize], &data, size);
+        usedSize += size;
+    }
+    uint8_t bits(uint8_t value, uint8_t bits) {
+        if(bitpos == 0) {
+            // first bits in this byte, overwrite whatever was in the buffer before
+            buf[usedSize] = value;
+        } else {
+            buf[usedSize] |= value << bitpos;
         }
-        buf[usedSize] |= (value << bitpos) & 0xFF;
         bitpos += bits;
-        if(bitpos > 8) {
-            // the value did not fit completely into the current byte
-            if(usedSize >= bufSize - 1) {
-                // already at maximum limit, not enough space for remaining bits
-                return false;
-            }
+        if(bitpos >= 8) {
             // move access to next byte
             bitpos -= 8;
             usedSize++;
-            // add remaining bytes
-            buf[usedSize] = value >> (bits - bitpos);
-        } else if(bitpos == 8) {
-            bitpos = 0;
-            usedSize++;
+            if(bitpos > 0) {
+                // the value did not fit completely into the previous byte, add remaining bits
+                buf[usedSize] = value >> (bits - bitpos);
+            }
         }
-        return true;
+        return value;
     }
     uint16_t getSize() const {
         if(bitpos == 0) {
@@ -84,292 +137,453 @@ public:
 
 private:
     uint8_t *buf;
-    uint16_t bufSize;
     uint16_t usedSize;
     uint8_t bitpos;
 };
 
+// Schema visitor reading the fields from the buffer
 class Decoder {
 public:
-    Decoder(uint8_t *buf) :
+    Decoder(const uint8_t *buf) :
         buf(buf),
         usedSize(0),
         bitpos(0) {};
-    template<typename T> void get(T &t) {
+    template<typename T> void field(T &t) {
         if(bitpos != 0) {
             // add padding to next byte boundary
             bitpos = 0;
             usedSize++;
         }
-        // still enough bytes available
         memcpy(&t, &buf[usedSize], sizeof(T));
         usedSize += sizeof(T);
     }
-    uint8_t getBits(uint8_t bits) {
-        if(bits >= 8) {
-            return 0;
+    template<typename T> void field(T &t, uint8_t size) {
+        if(bitpos != 0) {
+            bitpos = 0;
+            usedSize++;
         }
-        uint8_t mask = 0x00;
-        for(uint8_t i=0;i<bits;i++) {
-            mask <<= 1;
-            mask |= 0x01;
+        uint64_t value = 0;
+        memcpy(&value, &buf[usedSize], size);
+        usedSize += size;
+        uint8_t unused = 64 - 8 * size;
+        if(std::is_signed<T>::value) {
+            t = (T) ((int64_t) (value << unused) >> unused);
+        } else {
+            t = (T) value;
         }
+    }
+    uint8_t bits(uint8_t, uint8_t bits) {
+        uint8_t mask = (1U << bits) - 1;
         uint8_t value = (buf[usedSize] >> bitpos) & mask;
         bitpos += bits;
-        if(bitpos > 8) {
-            // the current byte did not contain the complete value
+        if(bitpos >= 8) {
             // move access to next byte
             bitpos -= 8;
             usedSize++;
-            // get remaining bits
-            value |= (buf[usedSize] << (bits - bitpos)) & mask;
-        } else if(bitpos == 8) {
-            bitpos = 0;
-            usedSize++;
+            if(bitpos > 0) {
+                // the current byte did not contain the complete value, get remaining bits
+                value |= (buf[usedSize] << (bits - bitpos)) & mask;
+            }
         }
         return value;
     }
 private:
-    uint8_t *buf;
+    const uint8_t *buf;
     uint16_t usedSize;
     uint8_t bitpos;
 };
 
-static Protocol::Datapoint DecodeDatapoint(uint8_t *buf) {
-    Protocol::Datapoint d;
+static_assert(Protocol::PayloadSize<Protocol::Datapoint>() == 43, "Datapoint wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::ReferenceSettings>() == 5, "ReferenceSettings wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::DeviceInfo>() == 37, "DeviceInfo wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::ManualControl>() == 34, "ManualControl wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::SweepSegment>() == 26, "SweepSegment wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::TimingHistogram>() == 117, "TimingHistogram wire format changed");
+static_assert(Protocol::PayloadSize<Protocol::RawMeasurement>() == 43, "RawMeasurement wire format changed");
+
+template<typename T> static bool DecodeFixed(uint8_t *buf, uint16_t length, T &d) {
+    if(length != Protocol::PayloadSize<T>()) {
+        // sender uses a different layout for this packet, do not interpret the payload
+        return false;
+    }
     Decoder e(buf);
-    e.get<float>(d.real_S11);
-    e.get<float>(d.imag_S11);
-    e.get<float>(d.real_S21);
-    e.get<float>(d.imag_S21);
-    e.get<float>(d.real_S12);
-    e.get<float>(d.imag_S12);
-    e.get<float>(d.real_S22);
-    e.get<float>(d.imag_S22);
-    e.get<uint64_t>(d.frequency);
-    e.get<uint16_t>(d.pointNum);
-    return d;
+    Protocol::Schema(e, d);
+    return true;
 }
-static int16_t EncodeDatapoint(Protocol::Datapoint d, uint8_t *buf,
-		uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<float>(d.real_S11);
-    e.add<float>(d.imag_S11);
-    e.add<float>(d.real_S21);
-    e.add<float>(d.imag_S21);
-    e.add<float>(d.real_S12);
-    e.add<float>(d.imag_S12);
-    e.add<float>(d.real_S22);
-    e.add<float>(d.imag_S22);
-    e.add<uint64_t>(d.frequency);
-    e.add<uint16_t>(d.pointNum);
-    return e.getSize();
+template<typename T> static int16_t EncodeFixed(T d, uint8_t *buf, uint16_t bufSize) {
+    constexpr uint16_t size = Protocol::PayloadSize<T>();
+    // one additional byte for the sequence number of commands
+    static_assert(size + 1 + Protocol::FrameOverhead <= Protocol::MaxFrameSize, "Packet does not fit into a frame");
+    if(bufSize < size) {
+        // unable to encode, not enough space
+        return -1;
+    }
+    Encoder e(buf);
+    Protocol::Schema(e, d);
+    return size;
 }
 
-static Protocol::SweepSettings DecodeSweepSettings(uint8_t *buf) {
-    Protocol::SweepSettings d;
-    Decoder e(buf);
-    e.get<uint64_t>(d.f_start);
-    e.get<uint64_t>(d.f_stop);
-    e.get<uint16_t>(d.points);
-    e.get<uint32_t>(d.if_bandwidth);
-    e.get<int16_t>(d.cdbm_excitation);
-    return d;
+// IEEE 754 half precision conversion (round to nearest even), used by DatapointFormat::Half
+static uint16_t FloatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    int16_t exp = (int16_t) ((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x007FFFFF;
+    if(((x >> 23) & 0xFF) == 0xFF) {
+        // infinity or NaN
+        return sign | 0x7C00 | (mant ? 0x0200 : 0);
+    } else if(exp >= 31) {
+        // too large, saturate to infinity
+        return sign | 0x7C00;
+    } else if(exp <= 0) {
+        // subnormal half (or too small, rounds to zero)
+        if(exp < -10) {
+            return sign;
+        }
+        mant |= 0x00800000;
+        uint8_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1UL << shift) - 1);
+        uint32_t halfway = 1UL << (shift - 1);
+        if(rem > halfway || (rem == halfway && (half & 0x01))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t) exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if(rem > 0x1000 || (rem == 0x1000 && (half & 0x01))) {
+        // might carry into the exponent, this is still the correctly rounded result
+        half++;
+    }
+    return sign | half;
 }
-static int16_t EncodeSweepSettings(Protocol::SweepSettings d, uint8_t *buf,
-		uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<uint64_t>(d.f_start);
-    e.add<uint64_t>(d.f_stop);
-    e.add<uint16_t>(d.points);
-    e.add<uint32_t>(d.if_bandwidth);
-    e.add<int16_t>(d.cdbm_excitation);
-    return e.getSize();
+static float HalfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x03FF;
+    uint32_t x;
+    if(exp == 0) {
+        // zero or subnormal, exactly representable as float
+        float f = mant * (1.0f / (1UL << 24));
+        return sign ? -f : f;
+    } else if(exp == 31) {
+        x = sign | 0x7F800000 | (mant << 13);
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
 }
 
-static Protocol::ReferenceSettings DecodeReferenceSettings(uint8_t *buf) {
-    Protocol::ReferenceSettings d;
-    Decoder e(buf);
-    e.get<uint32_t>(d.ExtRefOuputFreq);
-    d.AutomaticSwitch = e.getBits(1);
-    d.UseExternalRef = e.getBits(1);
-    return d;
+static float *DatapointValue(Protocol::Datapoint &p, uint8_t i) {
+    switch(i) {
+    case 0: return &p.real_S11;
+    case 1: return &p.imag_S11;
+    case 2: return &p.real_S21;
+    case 3: return &p.imag_S21;
+    case 4: return &p.real_S12;
+    case 5: return &p.imag_S12;
+    case 6: return &p.real_S22;
+    default: return &p.imag_S22;
+    }
 }
-static int16_t EncodeReferenceSettings(Protocol::ReferenceSettings d, uint8_t *buf,
-		uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<uint32_t>(d.ExtRefOuputFreq);
-    e.addBits(d.AutomaticSwitch, 1);
-    e.addBits(d.UseExternalRef, 1);
-    return e.getSize();
+
+// Size of a single value in a DatapointBatch, 0 for unknown formats
+static uint8_t BatchValueSize(Protocol::DatapointFormat format) {
+    switch(format) {
+    case Protocol::DatapointFormat::Full:
+    case Protocol::DatapointFormat::Float:
+        return sizeof(float);
+    case Protocol::DatapointFormat::Half:
+    case Protocol::DatapointFormat::Scaled16:
+        return sizeof(uint16_t);
+    case Protocol::DatapointFormat::Raw:
+        // sent as RawDatapointBatch
+        break;
+    }
+    return 0;
 }
 
-static Protocol::GeneratorSettings DecodeGeneratorSettings(uint8_t *buf) {
-    Protocol::GeneratorSettings d;
-    Decoder e(buf);
-    e.get<uint64_t>(d.frequency);
-    e.get<int16_t>(d.cdbm_level);
-    e.get<uint8_t>(d.activePort);
-    return d;
+// Number of transmitted S-parameters (each one consists of a real and imaginary value)
+static uint8_t ValidParameters(uint8_t valid) {
+    uint8_t cnt = 0;
+    for(uint8_t i=0;i<4;i++) {
+        if(valid & (1 << i)) {
+            cnt++;
+        }
+    }
+    return cnt;
 }
-static int16_t EncodeGeneratorSettings(Protocol::GeneratorSettings d, uint8_t *buf,
-		uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<uint64_t>(d.frequency);
-    e.add<int16_t>(d.cdbm_level);
-    e.add<uint8_t>(d.activePort);
-    return e.getSize();
+
+// Size of an encoded DatapointBatch, 0 for unknown formats
+static uint16_t BatchPayloadSize(Protocol::DatapointFormat format, uint8_t valid, uint8_t count) {
+    uint8_t valueSize = BatchValueSize(format);
+    if(!valueSize) {
+        return 0;
+    }
+    uint8_t parameters = ValidParameters(valid);
+    uint16_t pointSize = 2 * parameters * valueSize;
+    uint16_t size = sizeof(Protocol::DatapointBatch::startIndex) + sizeof(Protocol::DatapointBatch::count)
+            + sizeof(Protocol::DatapointBatch::format) + sizeof(Protocol::DatapointBatch::valid);
+    if(format == Protocol::DatapointFormat::Full) {
+        pointSize += sizeof(uint64_t);
+    } else if(format == Protocol::DatapointFormat::Scaled16) {
+        // scale factor per transmitted S-parameter
+        size += parameters * sizeof(float);
+    }
+    return size + count * pointSize;
 }
 
-static Protocol::DeviceInfo DecodeDeviceInfo(uint8_t *buf) {
-    Protocol::DeviceInfo d;
+// Value j of a datapoint belongs to S-parameter j/2 (in the order of the Parameter... bits)
+static bool ValueValid(uint8_t valid, uint8_t j) {
+    return valid & (1 << (j / 2));
+}
+
+static bool DecodeDatapointBatch(uint8_t *buf, uint16_t length, Protocol::DatapointBatch &d) {
+    if(length < BatchPayloadSize(Protocol::DatapointFormat::Float, 0, 0)) {
+        return false;
+    }
     Decoder e(buf);
-    e.get<uint16_t>(d.FW_major);
-    e.get<uint16_t>(d.FW_minor);
-    e.get<char>(d.HW_Revision);
-    d.extRefAvailable = e.getBits(1);
-    d.extRefInUse = e.getBits(1);
-    d.FPGA_configured = e.getBits(1);
-    d.source_locked = e.getBits(1);
-    d.LO1_locked = e.getBits(1);
-    d.ADC_overload = e.getBits(1);
-    e.get<uint8_t>(d.temperatures.source);
-    e.get<uint8_t>(d.temperatures.LO1);
-    e.get<uint8_t>(d.temperatures.MCU);
-    return d;
+    e.field(d.startIndex);
+    e.field(d.count);
+    e.field(d.format);
+    e.field(d.valid);
+    if(d.count > Protocol::DatapointBatchSize
+            || length != BatchPayloadSize(d.format, d.valid, d.count)) {
+        return false;
+    }
+    float scale[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    if(d.format == Protocol::DatapointFormat::Scaled16) {
+        for(uint8_t j=0;j<4;j++) {
+            if(d.valid & (1 << j)) {
+                e.field(scale[j]);
+            }
+        }
+    }
+    for(uint8_t i=0;i<d.count;i++) {
+        auto &p = d.points[i];
+        for(uint8_t j=0;j<8;j++) {
+            float *value = DatapointValue(p, j);
+            if(!ValueValid(d.valid, j)) {
+                // not measured
+                *value = 0.0f;
+                continue;
+            }
+            switch(d.format) {
+            case Protocol::DatapointFormat::Full:
+            case Protocol::DatapointFormat::Float:
+                e.field(*value);
+                break;
+            case Protocol::DatapointFormat::Half: {
+                uint16_t h;
+                e.field(h);
+                *value = HalfToFloat(h);
+            }
+                break;
+            case Protocol::DatapointFormat::Scaled16: {
+                int16_t q;
+                e.field(q);
+                *value = q * scale[j / 2] / INT16_MAX;
+            }
+                break;
+            case Protocol::DatapointFormat::Raw:
+                // rejected by the size check
+                break;
+            }
+        }
+        if(d.format == Protocol::DatapointFormat::Full) {
+            e.field(p.frequency);
+        } else {
+            // not transmitted, has to be filled in by the receiver
+            p.frequency = 0;
+        }
+        // point number is not transmitted, it follows from the position in the batch
+        p.pointNum = d.startIndex + i;
+        p.valid = d.valid;
+    }
+    return true;
 }
-static int16_t EncodeDeviceInfo(Protocol::DeviceInfo d, uint8_t *buf,
-                                                   uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<uint16_t>(d.FW_major);
-    e.add<uint16_t>(d.FW_minor);
-    e.add<char>(d.HW_Revision);
-    e.addBits(d.extRefAvailable, 1);
-    e.addBits(d.extRefInUse, 1);
-    e.addBits(d.FPGA_configured, 1);
-    e.addBits(d.source_locked, 1);
-    e.addBits(d.LO1_locked, 1);
-    e.addBits(d.ADC_overload, 1);
-    e.add<uint8_t>(d.temperatures.source);
-    e.add<uint8_t>(d.temperatures.LO1);
-    e.add<uint8_t>(d.temperatures.MCU);
+static int16_t EncodeDatapointBatch(const Protocol::DatapointBatch &d, uint8_t *buf,
+		uint16_t bufSize) {
+    uint8_t count = d.count <= Protocol::DatapointBatchSize ? d.count : Protocol::DatapointBatchSize;
+    uint8_t valid = d.valid & Protocol::ParameterAll;
+    // size is determined by the format, parameters and number of points, check once instead of for every value
+    uint16_t size = BatchPayloadSize(d.format, valid, count);
+    if(!size) {
+        // unknown format
+        return -1;
+    }
+    if(size > bufSize) {
+        // not enough space for all points
+        return -1;
+    }
+    Encoder e(buf);
+    e.field(d.startIndex);
+    e.field(count);
+    e.field(d.format);
+    e.field(valid);
+    float scale[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    if(d.format == Protocol::DatapointFormat::Scaled16) {
+        // one scale factor per S-parameter, chosen to fit the largest real/imaginary part of the block
+        for(uint8_t i=0;i<count;i++) {
+            auto p = d.points[i];
+            for(uint8_t j=0;j<8;j++) {
+                float value = fabsf(*DatapointValue(p, j));
+                if(value > scale[j / 2]) {
+                    scale[j / 2] = value;
+                }
+            }
+        }
+        for(uint8_t j=0;j<4;j++) {
+            if(valid & (1 << j)) {
+                e.field(scale[j]);
+            }
+        }
+    }
+    for(uint8_t i=0;i<count;i++) {
+        auto p = d.points[i];
+        for(uint8_t j=0;j<8;j++) {
+            if(!ValueValid(valid, j)) {
+                continue;
+            }
+            float value = *DatapointValue(p, j);
+            switch(d.format) {
+            case Protocol::DatapointFormat::Full:
+            case Protocol::DatapointFormat::Float:
+                e.field(value);
+                break;
+            case Protocol::DatapointFormat::Half:
+                e.field(FloatToHalf(value));
+                break;
+            case Protocol::DatapointFormat::Scaled16: {
+                int16_t q = scale[j / 2] > 0.0f ? lroundf(value / scale[j / 2] * INT16_MAX) : 0;
+                e.field(q);
+            }
+                break;
+            case Protocol::DatapointFormat::Raw:
+                // rejected by the size check
+                break;
+            }
+        }
+        if(d.format == Protocol::DatapointFormat::Full) {
+            e.field(p.frequency);
+        }
+    }
     return e.getSize();
 }
 
-static Protocol::ManualStatus DecodeStatus(uint8_t *buf) {
-    Protocol::ManualStatus d;
+static_assert(1 + Protocol::RawDatapointBatchSize * Protocol::PayloadSize<Protocol::RawMeasurement>()
+		+ Protocol::FrameOverhead <= Protocol::MaxFrameSize, "RawDatapointBatch does not fit into a frame");
+
+static bool DecodeRawDatapointBatch(uint8_t *buf, uint16_t length, Protocol::RawDatapointBatch &d) {
+    if(length < 1) {
+        return false;
+    }
     Decoder e(buf);
-    e.get<int16_t>(d.port1min);
-    e.get<int16_t>(d.port1max);
-    e.get<int16_t>(d.port2min);
-    e.get<int16_t>(d.port2max);
-    e.get<int16_t>(d.refmin);
-    e.get<int16_t>(d.refmax);
-    e.get<float>(d.port1real);
-    e.get<float>(d.port1imag);
-    e.get<float>(d.port2real);
-    e.get<float>(d.port2imag);
-    e.get<float>(d.refreal);
-    e.get<float>(d.refimag);
-    e.get<uint8_t>(d.temp_source);
-    e.get<uint8_t>(d.temp_LO);
-    d.source_locked = e.getBits( 1);
-    d.LO_locked = e.getBits(1);
-    return d;
+    e.field(d.count);
+    if(d.count > Protocol::RawDatapointBatchSize
+            || length != 1 + d.count * Protocol::PayloadSize<Protocol::RawMeasurement>()) {
+        return false;
+    }
+    for(uint8_t i=0;i<d.count;i++) {
+        Protocol::Schema(e, d.measurements[i]);
+    }
+    return true;
 }
-static int16_t EncodeStatus(Protocol::ManualStatus d, uint8_t *buf,
-                                     uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.add<int16_t>(d.port1min);
-    e.add<int16_t>(d.port1max);
-    e.add<int16_t>(d.port2min);
-    e.add<int16_t>(d.port2max);
-    e.add<int16_t>(d.refmin);
-    e.add<int16_t>(d.refmax);
-    e.add<float>(d.port1real);
-    e.add<float>(d.port1imag);
-    e.add<float>(d.port2real);
-    e.add<float>(d.port2imag);
-    e.add<float>(d.refreal);
-    e.add<float>(d.refimag);
-    e.add<uint8_t>(d.temp_source);
-    e.add<uint8_t>(d.temp_LO);
-    e.addBits(d.source_locked, 1);
-    e.addBits(d.LO_locked, 1);
-    return e.getSize();
+static int16_t EncodeRawDatapointBatch(const Protocol::RawDatapointBatch &d, uint8_t *buf, uint16_t bufSize) {
+    uint8_t count = d.count <= Protocol::RawDatapointBatchSize ? d.count : Protocol::RawDatapointBatchSize;
+    uint16_t size = 1 + count * Protocol::PayloadSize<Protocol::RawMeasurement>();
+    if(size > bufSize) {
+        return -1;
+    }
+    Encoder e(buf);
+    e.field(count);
+    for(uint8_t i=0;i<count;i++) {
+        auto m = d.measurements[i];
+        Protocol::Schema(e, m);
+    }
+    return size;
 }
 
-static Protocol::ManualControl DecodeManualControl(uint8_t *buf) {
-    Protocol::ManualControl d;
+static constexpr uint8_t SegmentedSweepHeaderSize = 5;
+static_assert(SegmentedSweepHeaderSize + Protocol::SweepSegmentsPerChunk * Protocol::PayloadSize<Protocol::SweepSegment>()
+		+ 1 + Protocol::FrameOverhead <= Protocol::MaxFrameSize, "SegmentedSweep does not fit into a frame");
+
+static bool DecodeSegmentedSweep(uint8_t *buf, uint16_t length, Protocol::SegmentedSweep &d) {
+    if(length < SegmentedSweepHeaderSize) {
+        return false;
+    }
     Decoder e(buf);
-    d.SourceHighCE = e.getBits(1);
-    d.SourceHighRFEN = e.getBits(1);
-    d.SourceHighPower = e.getBits(2);
-    d.SourceHighLowpass = e.getBits(2);
-    e.get<uint64_t>(d.SourceHighFrequency);
-    d.SourceLowEN = e.getBits(1);
-    d.SourceLowPower = e.getBits( 2);
-    e.get<uint32_t>(d.SourceLowFrequency);
-    d.attenuator = e.getBits(7);
-    d.SourceHighband = e.getBits(1);
-    d.AmplifierEN = e.getBits(1);
-    d.PortSwitch = e.getBits(1);
-    d.LO1CE = e.getBits(1);
-    d.LO1RFEN = e.getBits(1);
-    e.get<uint64_t>(d.LO1Frequency);
-    d.LO2EN = e.getBits(1);
-    e.get<uint32_t>(d.LO2Frequency);
-    d.Port1EN = e.getBits(1);
-    d.Port2EN = e.getBits(1);
-    d.RefEN = e.getBits(1);
-    e.get<uint32_t>(d.Samples);
-    return d;
+    e.field(d.startIndex);
+    e.field(d.count);
+    e.field(d.totalSegments);
+    e.field(d.format);
+    e.field(d.parameters);
+    if(d.count > Protocol::SweepSegmentsPerChunk
+            || length != SegmentedSweepHeaderSize + d.count * Protocol::PayloadSize<Protocol::SweepSegment>()) {
+        return false;
+    }
+    for(uint8_t i=0;i<d.count;i++) {
+        Protocol::Schema(e, d.segments[i]);
+    }
+    return true;
 }
-static int16_t EncodeManualControl(Protocol::ManualControl d, uint8_t *buf,
-                                                   uint16_t bufSize) {
-    Encoder e(buf, bufSize);
-    e.addBits(d.SourceHighCE, 1);
-    e.addBits(d.SourceHighRFEN, 1);
-    e.addBits(d.SourceHighPower, 2);
-    e.addBits(d.SourceHighLowpass, 2);
-    e.add<uint64_t>(d.SourceHighFrequency);
-    e.addBits(d.SourceLowEN, 1);
-    e.addBits(d.SourceLowPower, 2);
-    e.add<uint32_t>(d.SourceLowFrequency);
-    e.addBits(d.attenuator, 7);
-    e.addBits(d.SourceHighband, 1);
-    e.addBits(d.AmplifierEN, 1);
-    e.addBits(d.PortSwitch, 1);
-    e.addBits(d.LO1CE, 1);
-    e.addBits(d.LO1RFEN, 1);
-    e.add<uint64_t>(d.LO1Frequency);
-    e.addBits(d.LO2EN, 1);
-    e.add<uint32_t>(d.LO2Frequency);
-    e.addBits(d.Port1EN, 1);
-    e.addBits(d.Port2EN, 1);
-    e.addBits(d.RefEN, 1);
-    e.add<uint32_t>(d.Samples);
-    return e.getSize();
+static int16_t EncodeSegmentedSweep(const Protocol::SegmentedSweep &d, uint8_t *buf, uint16_t bufSize) {
+    uint8_t count = d.count <= Protocol::SweepSegmentsPerChunk ? d.count : Protocol::SweepSegmentsPerChunk;
+    uint16_t size = SegmentedSweepHeaderSize + count * Protocol::PayloadSize<Protocol::SweepSegment>();
+    if(size > bufSize) {
+        return -1;
+    }
+    Encoder e(buf);
+    e.field(d.startIndex);
+    e.field(count);
+    e.field(d.totalSegments);
+    e.field(d.format);
+    e.field(d.parameters);
+    for(uint8_t i=0;i<count;i++) {
+        auto s = d.segments[i];
+        Protocol::Schema(e, s);
+    }
+    return size;
 }
 
-static Protocol::FirmwarePacket DecodeFirmwarePacket(uint8_t *buf) {
-    Protocol::FirmwarePacket d;
-    // simple packet format, memcpy is faster than using the decoder
-    memcpy(&d.address, buf, 4);
-    buf += 4;
-    memcpy(d.data, buf, Protocol::FirmwareChunkSize);
-    return d;
+uint64_t Protocol::PointFrequency(const SweepSettings &s, uint16_t pointNum) {
+    if(s.points <= 1) {
+        return s.f_start;
+    }
+    return s.f_start + (s.f_stop - s.f_start) * pointNum / (s.points - 1);
 }
-static int16_t EncodeFirmwarePacket(const Protocol::FirmwarePacket &d, uint8_t *buf, uint16_t bufSize) {
-    if(bufSize < 4 + Protocol::FirmwareChunkSize) {
-        // unable to encode, not enough space
-        return -1;
+
+uint64_t Protocol::PointFrequency(const SweepSegment &s, uint16_t pointNum) {
+    if(s.points <= 1) {
+        return s.f_start;
+    }
+    return s.f_start + (s.f_stop - s.f_start) * pointNum / (s.points - 1);
+}
+
+uint16_t Protocol::AveragingPoints(DatapointFormat format, uint8_t parameters) {
+    if(!parameters) {
+        parameters = ParameterAll;
+    }
+    uint8_t ports = 0;
+    if(parameters & ParameterForward) {
+        ports++;
+    }
+    if(parameters & ParameterReverse) {
+        ports++;
     }
-    // simple packet format, memcpy is faster than using the encoder
-    memcpy(buf, &d.address, 4);
-    buf += 4;
-    memcpy(buf, d.data, Protocol::FirmwareChunkSize);
-    return 4 + Protocol::FirmwareChunkSize;
+    uint16_t pointSize;
+    if(format == DatapointFormat::Raw) {
+        // six 64 bit accumulator sums per excited port
+        pointSize = ports * 6 * sizeof(int64_t);
+    } else {
+        // two complex S-parameters per excited port
+        pointSize = ports * 2 * 2 * sizeof(float);
+    }
+    return AveragingMemory / pointSize;
 }
 
 uint16_t Protocol::DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info) {
@@ -379,7 +593,7 @@ uint16_t Protocol::DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info) {
 	}
 	uint8_t *data = buf;
 	/* Remove any out-of-order bytes in front of the frame */
-	while (*data != header) {
+	while (*data != FrameHeader) {
 		data++;
 		if(--len == 0) {
 			/* Reached end of data */
@@ -389,14 +603,19 @@ uint16_t Protocol::DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info) {
 		}
 	}
 	/* At this point, data points to the beginning of the frame */
-	if(len < header_size) {
+	if(len < FrameHeaderSize) {
 		/* the frame header has not been completely received */
 		info->type = PacketType::None;
 		return data - buf;
 	}
 
 	/* Evaluate frame size */
-	uint16_t length = *(uint16_t*) &data[1];
+	uint16_t length = FrameLength(data);
+	if(length < FrameOverhead || length > MaxFrameSize) {
+		// invalid length, remove header
+		info->type = PacketType::None;
+		return data - buf + 1;
+	}
 	if(len < length) {
 		/* The frame payload has not been completely received */
 		info->type = PacketType::None;
@@ -404,9 +623,7 @@ uint16_t Protocol::DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info) {
 	}
 
 	/* The complete frame has been received, check checksum */
-    uint32_t crc = *(uint32_t*) &data[length - 4];
-	uint32_t compare = CRC32(0, data, length - 4);
-	if(crc != compare) {
+	if(!FrameValid(data, length)) {
 		// CRC mismatch, remove header
 		data += 1;
 		info->type = PacketType::None;
@@ -414,87 +631,225 @@ uint16_t Protocol::DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info) {
 	}
 
 	// Valid packet, extract packet info
-	info->type = (PacketType) data[3];
+	DecodeFrame(data, info);
+	return data - buf + length;
+}
+
+uint16_t Protocol::FrameLength(const uint8_t *frame) {
+	uint16_t length;
+	memcpy(&length, &frame[1], sizeof(length));
+	return length;
+}
+
+bool Protocol::FrameValid(const uint8_t *frame, uint16_t length) {
+	uint32_t crc;
+	memcpy(&crc, &frame[length - 4], sizeof(crc));
+	return crc == CRC32(0, frame, length - 4);
+}
+
+bool Protocol::HasSequenceNumber(PacketType type) {
+	switch(type) {
+	case PacketType::SweepSettings:
+	case PacketType::ManualControl:
+	case PacketType::FirmwarePacket:
+	case PacketType::Ack:
+	case PacketType::ClearFlash:
+	case PacketType::PerformFirmwareUpdate:
+	case PacketType::Nack:
+	case PacketType::Reference:
+	case PacketType::Generator:
+	case PacketType::Retransmit:
+	case PacketType::SequenceReset:
+	case PacketType::RebuildVCOMaps:
+	case PacketType::SegmentedSweep:
+	case PacketType::TimingRequest:
+	case PacketType::Averaging:
+	case PacketType::FirmwareStart:
+	case PacketType::FirmwareVerify:
+	case PacketType::DeviceInfoInterval:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void Protocol::DecodeFrame(uint8_t *frame, PacketInfo *info) {
+	uint8_t *payload = &frame[FrameHeaderSize];
+	uint16_t length = FrameLength(frame) - FrameOverhead;
+	bool valid = true;
+	info->type = (PacketType) frame[3];
+	if(HasSequenceNumber(info->type)) {
+		if(length < 1) {
+			info->type = PacketType::None;
+			return;
+		}
+		info->seq = *payload++;
+		length--;
+	}
 	switch (info->type) {
 	case PacketType::Datapoint:
-		info->datapoint = DecodeDatapoint(&data[4]);
+		valid = DecodeFixed(payload, length, info->datapoint);
+		break;
+	case PacketType::DatapointBatch:
+		valid = DecodeDatapointBatch(payload, length, info->batch);
+		break;
+	case PacketType::RawDatapointBatch:
+		valid = DecodeRawDatapointBatch(payload, length, info->raw);
 		break;
 	case PacketType::SweepSettings:
-		info->settings = DecodeSweepSettings(&data[4]);
+		valid = DecodeFixed(payload, length, info->settings);
+		break;
+	case PacketType::SegmentedSweep:
+		valid = DecodeSegmentedSweep(payload, length, info->segments);
 		break;
 	case PacketType::Reference:
-		info->reference = DecodeReferenceSettings(&data[4]);
+		valid = DecodeFixed(payload, length, info->reference);
 		break;
     case PacketType::DeviceInfo:
-        info->info = DecodeDeviceInfo(&data[4]);
+        valid = DecodeFixed(payload, length, info->info);
         break;
     case PacketType::Status:
-        info->status = DecodeStatus(&data[4]);
+        valid = DecodeFixed(payload, length, info->status);
         break;
     case PacketType::ManualControl:
-        info->manual = DecodeManualControl(&data[4]);
+        valid = DecodeFixed(payload, length, info->manual);
         break;
     case PacketType::FirmwarePacket:
-        info->firmware = DecodeFirmwarePacket(&data[4]);
+        valid = DecodeFixed(payload, length, info->firmware);
         break;
     case PacketType::Generator:
-    	info->generator = DecodeGeneratorSettings(&data[4]);
+    	valid = DecodeFixed(payload, length, info->generator);
     	break;
+    case PacketType::TimingRequest:
+        valid = DecodeFixed(payload, length, info->timingRequest);
+        break;
+    case PacketType::Averaging:
+        valid = DecodeFixed(payload, length, info->averaging);
+        break;
+    case PacketType::DeviceInfoInterval:
+        valid = DecodeFixed(payload, length, info->deviceInfo);
+        break;
+    case PacketType::FirmwareStart:
+        valid = DecodeFixed(payload, length, info->firmwareStart);
+        break;
+    case PacketType::FirmwareVerify:
+        valid = DecodeFixed(payload, length, info->firmwareVerify);
+        break;
+    case PacketType::TimingHistogram:
+        valid = DecodeFixed(payload, length, info->timing);
+        break;
     case PacketType::Ack:
+    case PacketType::Nack:
+        valid = DecodeFixed(payload, length, info->response);
+        break;
     case PacketType::PerformFirmwareUpdate:
     case PacketType::ClearFlash:
-    case PacketType::Nack:
-        // no payload, nothing to do
+    case PacketType::Retransmit:
+    case PacketType::SequenceReset:
+    case PacketType::RebuildVCOMaps:
+        // no payload apart from the sequence number, nothing to do
         break;
     case PacketType::None:
         break;
 	}
-
-	return data - buf + length;
+	if(!valid) {
+		info->type = PacketType::None;
+	}
 }
 
 uint16_t Protocol::EncodePacket(PacketInfo packet, uint8_t *dest, uint16_t destsize) {
+    if(destsize < FrameOverhead) {
+        return 0;
+    }
+    uint8_t *payload = &dest[FrameHeaderSize];
+    uint16_t payload_space = destsize - FrameOverhead;
+    uint8_t seq_size = 0;
+    if(HasSequenceNumber(packet.type)) {
+        if(payload_space < 1) {
+            return 0;
+        }
+        *payload++ = packet.seq;
+        payload_space--;
+        seq_size = 1;
+    }
     int16_t payload_size = 0;
 	switch (packet.type) {
 	case PacketType::Datapoint:
-        payload_size = EncodeDatapoint(packet.datapoint, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.datapoint, payload, payload_space);
+		break;
+	case PacketType::DatapointBatch:
+		payload_size = EncodeDatapointBatch(packet.batch, payload, payload_space);
+		break;
+	case PacketType::RawDatapointBatch:
+		payload_size = EncodeRawDatapointBatch(packet.raw, payload, payload_space);
 		break;
 	case PacketType::SweepSettings:
-        payload_size = EncodeSweepSettings(packet.settings, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.settings, payload, payload_space);
+		break;
+	case PacketType::SegmentedSweep:
+        payload_size = EncodeSegmentedSweep(packet.segments, payload, payload_space);
 		break;
 	case PacketType::Reference:
-		payload_size = EncodeReferenceSettings(packet.reference, &dest[4], destsize - 8);
+		payload_size = EncodeFixed(packet.reference, payload, payload_space);
 		break;
     case PacketType::DeviceInfo:
-        payload_size = EncodeDeviceInfo(packet.info, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.info, payload, payload_space);
         break;
     case PacketType::Status:
-        payload_size = EncodeStatus(packet.status, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.status, payload, payload_space);
         break;
     case PacketType::ManualControl:
-        payload_size = EncodeManualControl(packet.manual, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.manual, payload, payload_space);
         break;
     case PacketType::FirmwarePacket:
-        payload_size = EncodeFirmwarePacket(packet.firmware, &dest[4], destsize - 8);
+        payload_size = EncodeFixed(packet.firmware, payload, payload_space);
         break;
     case PacketType::Generator:
-    	payload_size = EncodeGeneratorSettings(packet.generator, &dest[4], destsize - 8);
+    	payload_size = EncodeFixed(packet.generator, payload, payload_space);
     	break;
+    case PacketType::TimingRequest:
+        payload_size = EncodeFixed(packet.timingRequest, payload, payload_space);
+        break;
+    case PacketType::Averaging:
+        payload_size = EncodeFixed(packet.averaging, payload, payload_space);
+        break;
+    case PacketType::DeviceInfoInterval:
+        payload_size = EncodeFixed(packet.deviceInfo, payload, payload_space);
+        break;
+    case PacketType::FirmwareStart:
+        payload_size = EncodeFixed(packet.firmwareStart, payload, payload_space);
+        break;
+    case PacketType::FirmwareVerify:
+        payload_size = EncodeFixed(packet.firmwareVerify, payload, payload_space);
+        break;
+    case PacketType::TimingHistogram:
+        payload_size = EncodeFixed(packet.timing, payload, payload_space);
+        break;
     case PacketType::Ack:
+    case PacketType::Nack:
+        payload_size = EncodeFixed(packet.response, payload, payload_space);
+        break;
     case PacketType::PerformFirmwareUpdate:
     case PacketType::ClearFlash:
-    case PacketType::Nack:
-        // no payload, nothing to do
+    case PacketType::Retransmit:
+    case PacketType::SequenceReset:
+    case PacketType::RebuildVCOMaps:
+        // no payload apart from the sequence number, nothing to do
         break;
     case PacketType::None:
         break;
     }
-    if (payload_size < 0 || payload_size + 8 > destsize) {
+    if (payload_size < 0) {
+		// encoding failed, buffer too small
+		return 0;
+	}
+    payload_size += seq_size;
+    if (payload_size + 8 > destsize || payload_size + 8 > MaxFrameSize) {
 		// encoding failed, buffer too small
 		return 0;
 	}
 	// Write header
-	dest[0] = header;
+	dest[0] = FrameHeader;
 	uint16_t overall_size = payload_size + 8;
 	memcpy(&dest[1], &overall_size, 2);
 	dest[3] = (int) packet.type;
@@ -4,7 +4,17 @@
 
 namespace Protocol {
 
-// When changing/adding/removing variables from these structs also adjust the decode/encode functions in Protocol.cpp
+// When changing/adding/removing variables from these structs also adjust the Schema functions below
+
+// S-parameter mask, used for the requested parameters of a sweep and the valid parameters of a datapoint.
+// Port 1 is only excited for S11/S21, port 2 only for S12/S22
+static constexpr uint8_t ParameterS11 = 0x01;
+static constexpr uint8_t ParameterS21 = 0x02;
+static constexpr uint8_t ParameterS12 = 0x04;
+static constexpr uint8_t ParameterS22 = 0x08;
+static constexpr uint8_t ParameterForward = ParameterS11 | ParameterS21;
+static constexpr uint8_t ParameterReverse = ParameterS12 | ParameterS22;
+static constexpr uint8_t ParameterAll = ParameterForward | ParameterReverse;
 
 using Datapoint = struct _datapoint {
 	float real_S11, imag_S11;
@@ -13,6 +23,48 @@ using Datapoint = struct _datapoint {
 	float real_S22, imag_S22;
 	uint64_t frequency;
 	uint16_t pointNum;
+	uint8_t valid; // measured S-parameters, the others are set to zero
+};
+
+// Wire format of the points in a DatapointBatch. Except for Full, the frequency is not transmitted
+// and has to be reconstructed from the pointNum and the sweep settings (see PointFrequency)
+enum class DatapointFormat : uint8_t {
+	Full = 0, // 8 floats and frequency per point
+	Float = 1, // 8 floats per point
+	Half = 2, // IEEE 754 half precision per value
+	Scaled16 = 3, // int16 per value, one scale factor per S-parameter and block
+	Raw = 4, // no datapoints, the receiver accumulators are sent as RawDatapointBatch instead
+};
+
+// Contiguous block of datapoints, pointNum of each point is implicit (startIndex + position in block).
+// All points share the same valid parameters, only those are transmitted
+static constexpr uint8_t DatapointBatchSize = 8;
+using DatapointBatch = struct _datapointBatch {
+	uint16_t startIndex;
+	uint8_t count;
+	DatapointFormat format;
+	uint8_t valid;
+	Datapoint points[DatapointBatchSize];
+};
+
+// Unprocessed receiver accumulators of one port excitation (DatapointFormat::Raw), the host calculates the
+// S-parameters. Each accumulator is the sum over all samples of the point, transmitted as 48 bit signed value.
+// A point consists of one measurement per excited port, port 1 is measured first
+using RawMeasurement = struct _rawMeasurement {
+	int64_t P1I, P1Q;
+	int64_t P2I, P2Q;
+	int64_t RefI, RefQ;
+	uint32_t samples; // number of ADC samples summed up in the accumulators
+	uint16_t pointNum;
+	uint8_t port:2; // excited port (1 or 2)
+	uint8_t last:1; // last measurement of this point
+};
+
+// Consecutive raw measurements, not necessarily of consecutive points
+static constexpr uint8_t RawDatapointBatchSize = 6;
+using RawDatapointBatch = struct _rawDatapointBatch {
+	uint8_t count;
+	RawMeasurement measurements[RawDatapointBatchSize];
 };
 
 using SweepSettings = struct _sweepSettings {
@@ -21,6 +73,49 @@ using SweepSettings = struct _sweepSettings {
     uint16_t points;
     uint32_t if_bandwidth;
     int16_t cdbm_excitation; // in 1/100 dbm
+    DatapointFormat format; // requested format, the device may fall back to DatapointFormat::Full
+    uint8_t parameters; // requested S-parameters (Parameter...), 0 requests all of them
+};
+
+// Segmented sweep: the points of all segments are measured in order within one sweep, the pointNum of the
+// datapoints counts across all segments. A segment with a single point only uses f_start, a sequence of those
+// sweeps an arbitrary list of frequencies.
+static constexpr uint8_t MaxSweepSegments = 128;
+using SweepSegment = struct _sweepSegment {
+	uint64_t f_start;
+	uint64_t f_stop;
+	uint16_t points;
+	uint32_t if_bandwidth;
+	int16_t cdbm_excitation; // in 1/100 dbm
+	uint16_t settling_us; // minimum settling time before sampling a point, the device rounds up and extends it for larger synthesizer steps
+};
+
+// Segments are uploaded in chunks, starting at index 0 and in order. The sweep starts when the chunk
+// containing the last segment has been received
+static constexpr uint8_t SweepSegmentsPerChunk = 8;
+using SegmentedSweep = struct _segmentedSweep {
+	uint8_t startIndex;
+	uint8_t count; // segments in this chunk
+	uint8_t totalSegments;
+	DatapointFormat format;
+	uint8_t parameters; // requested S-parameters, see SweepSettings
+	SweepSegment segments[SweepSegmentsPerChunk];
+};
+
+// Averaging on the device: the points of consecutive sweeps are accumulated and only the average of every block of
+// sweeps is transmitted. The accumulators occupy a fixed amount of memory, larger sweeps are transmitted without
+// averaging (see AveragingPoints). Applies to the current and all following sweeps
+static constexpr uint16_t AveragingMemory = 16384;
+static constexpr uint16_t MaxAverages = 255;
+using AveragingSettings = struct _averagingSettings {
+	uint16_t sweeps; // 0 or 1 disables averaging
+};
+
+// Minimum time between two DeviceInfo packets while sweeping. Gathering the information delays the start of the
+// next sweep, the host trades update rate against sweep rate. Applies until the device restarts
+static constexpr uint16_t DefaultDeviceInfoInterval = 1000;
+using DeviceInfoSettings = struct _deviceInfoSettings {
+	uint16_t interval; // in ms, 0 only sends a DeviceInfo after the reference settings changed
 };
 
 using ReferenceSettings = struct _referenceSettings {
@@ -50,6 +145,26 @@ using DeviceInfo = struct _deviceInfo {
         uint8_t LO1;
         uint8_t MCU;
     } temperatures;
+    uint32_t droppedPoints; // datapoints lost on the device because the App task fell behind, since power up
+    uint32_t droppedPackets; // packets that did not fit into the USB transmit queue, since power up
+    uint16_t usbQueueHighWater; // maximum fill level of the USB transmit queue in bytes
+    // sweep watchdog recoveries since power up, per escalation level
+    struct {
+        uint16_t restarts; // sweep restarted with the existing configuration
+        uint16_t reconfigurations; // sweep uploaded again
+        uint16_t reinitializations; // clocks, FPGA and synthesizers initialized again
+    } recoveries;
+    struct {
+        uint16_t sweeps; // averaged sweeps per transmitted sweep, 0 if the device does not average
+        uint16_t completed; // sweeps already accumulated for the next transmitted sweep
+    } averaging;
+    // duration of the boot stages in ms, the clocks lock while the FPGA is configured
+    struct {
+        uint16_t clocks; // Si5351 programmed
+        uint16_t configuration; // bitstream loaded (or FPGA configured itself)
+        uint16_t initialization; // PLL lock, FPGA and synthesizer initialization including the VCO maps
+        uint16_t total; // power up until the device is ready
+    } boot;
 };
 
 using ManualStatus = struct _manualstatus {
@@ -96,12 +211,55 @@ using ManualControl = struct _manualControl {
 };
 
 
+// Timing statistics of the sweep, collected with the cycle counter of the MCU. Requested with TimingRequest,
+// the device answers with one TimingHistogram per stage
+enum class TimingStage : uint8_t {
+	Acquisition = 0, // FPGA measuring one port: PLL reload, settling and sampling
+	Readout = 1, // SPI transfer of the sampling result
+	Processing = 2, // evaluation of the sampling result
+	Halt = 3, // reconfiguration while the sweep is halted (lowband points)
+	Point = 4, // time between two completed points
+	Sweep = 5, // time between two completed sweeps
+	Transmit = 6, // encoding and queueing of a datapoint batch for USB
+	Last = 7,
+};
+
+using TimingRequest = struct _timingRequest {
+	uint8_t clear; // reset the statistics after reporting them
+};
+
+// Bin 0 counts durations below 1us, bin n durations in [2^(n-1), 2^n) us. The last bin also counts all longer durations
+static constexpr uint8_t TimingBins = 24;
+using TimingHistogram = struct _timingHistogram {
+	TimingStage stage;
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+	uint32_t bins[TimingBins];
+};
+
 static constexpr uint16_t FirmwareChunkSize = 256;
 using FirmwarePacket = struct _firmwarePacket {
     uint32_t address;
     uint8_t data[FirmwareChunkSize];
 };
 
+/*
+ * Streamed firmware update, replaces ClearFlash for images that do not fill the whole flash:
+ * 1. FirmwareStart with the size of the image. Nothing is erased yet.
+ * 2. FirmwarePackets in ascending order, the host may use the complete command window. Each 4kB sector (or
+ *    64kB block if the image covers it completely) is erased right before the first chunk is written to it.
+ * 3. FirmwareVerify, answered with Nack if the CRC32 (see Protocol::CRC32) of the flash content differs.
+ */
+using FirmwareStart = struct _firmwareStart {
+    uint32_t size;
+};
+using FirmwareVerify = struct _firmwareVerify {
+    uint32_t size;
+    uint32_t crc;
+};
+
 enum class PacketType : uint8_t {
 	None = 0,
 	Datapoint = 1,
@@ -116,24 +274,286 @@ enum class PacketType : uint8_t {
 	Nack = 10,
 	Reference = 11,
 	Generator = 12,
+	DatapointBatch = 13,
+	Retransmit = 14,
+	SequenceReset = 15,
+	// builds the VCO maps of the synthesizers again instead of using the stored ones
+	RebuildVCOMaps = 16,
+	SegmentedSweep = 17,
+	TimingRequest = 18,
+	TimingHistogram = 19,
+	RawDatapointBatch = 20,
+	Averaging = 21,
+	FirmwareStart = 22,
+	FirmwareVerify = 23,
+	DeviceInfoInterval = 24,
+};
+
+/*
+ * Commands from the host carry a sequence number and are answered with an Ack/Nack containing the same number.
+ * The host may have up to CommandWindow commands in flight. The device executes them strictly in order:
+ * - a command with a sequence number ahead of the expected one reveals a gap, the device discards it and
+ *   sends a Retransmit with the expected sequence number (once per gap)
+ * - a command with an already executed sequence number is a retransmission, it is only answered again
+ * - SequenceReset is always accepted and restarts the numbering after its own sequence number
+ * Responses are cumulative, the host considers all commands up to the answered one as completed. A lost Nack
+ * must not turn into an Ack that way, every response lists which of the preceding commands were rejected.
+ */
+static constexpr uint8_t CommandWindow = 4;
+
+// Payload of Ack/Nack
+using Response = struct _response {
+	// bit i is set if the command i sequence numbers before the answered one was rejected (bit 0: the answered one)
+	uint8_t rejected;
 };
+static_assert(CommandWindow <= 8, "Response::rejected has to cover the complete command window");
 
 using PacketInfo = struct _packetinfo {
 	PacketType type;
+	uint8_t seq; // only transmitted for commands and responses, see HasSequenceNumber
 	union {
 		Datapoint datapoint;
+		DatapointBatch batch;
+		RawDatapointBatch raw;
 		SweepSettings settings;
+		SegmentedSweep segments;
 		ReferenceSettings reference;
 		GeneratorSettings generator;
+		AveragingSettings averaging;
+		DeviceInfoSettings deviceInfo;
+		Response response;
         DeviceInfo info;
         ManualControl manual;
         ManualStatus status;
         FirmwarePacket firmware;
+        FirmwareStart firmwareStart;
+        FirmwareVerify firmwareVerify;
+        TimingRequest timingRequest;
+        TimingHistogram timing;
 	};
 };
 
+// Wire layout of the fixed size packets. Each Schema function lists the fields in transmission order and
+// is used for encoding, decoding and the compile time size calculation. Multi-byte fields start at the next
+// byte boundary, bits are packed LSB first. Bitfields can not be bound to references, the visitor returns
+// the (decoded) value instead: d.x = v.bits(d.x, width). v.field(d.x, size) only transmits the lower size bytes
+// of an integer, signed values are sign extended when decoding
+template<class V> constexpr void Schema(V &v, Datapoint &d) {
+	v.field(d.real_S11);
+	v.field(d.imag_S11);
+	v.field(d.real_S21);
+	v.field(d.imag_S21);
+	v.field(d.real_S12);
+	v.field(d.imag_S12);
+	v.field(d.real_S22);
+	v.field(d.imag_S22);
+	v.field(d.frequency);
+	v.field(d.pointNum);
+	v.field(d.valid);
+}
+template<class V> constexpr void Schema(V &v, RawMeasurement &d) {
+	v.field(d.P1I, 6);
+	v.field(d.P1Q, 6);
+	v.field(d.P2I, 6);
+	v.field(d.P2Q, 6);
+	v.field(d.RefI, 6);
+	v.field(d.RefQ, 6);
+	v.field(d.samples);
+	v.field(d.pointNum);
+	d.port = v.bits(d.port, 2);
+	d.last = v.bits(d.last, 1);
+}
+template<class V> constexpr void Schema(V &v, SweepSettings &d) {
+	v.field(d.f_start);
+	v.field(d.f_stop);
+	v.field(d.points);
+	v.field(d.if_bandwidth);
+	v.field(d.cdbm_excitation);
+	v.field(d.format);
+	v.field(d.parameters);
+}
+template<class V> constexpr void Schema(V &v, SweepSegment &d) {
+	v.field(d.f_start);
+	v.field(d.f_stop);
+	v.field(d.points);
+	v.field(d.if_bandwidth);
+	v.field(d.cdbm_excitation);
+	v.field(d.settling_us);
+}
+template<class V> constexpr void Schema(V &v, ReferenceSettings &d) {
+	v.field(d.ExtRefOuputFreq);
+	d.AutomaticSwitch = v.bits(d.AutomaticSwitch, 1);
+	d.UseExternalRef = v.bits(d.UseExternalRef, 1);
+}
+template<class V> constexpr void Schema(V &v, GeneratorSettings &d) {
+	v.field(d.frequency);
+	v.field(d.cdbm_level);
+	v.field(d.activePort);
+}
+template<class V> constexpr void Schema(V &v, DeviceInfo &d) {
+	v.field(d.FW_major);
+	v.field(d.FW_minor);
+	v.field(d.HW_Revision);
+	d.extRefAvailable = v.bits(d.extRefAvailable, 1);
+	d.extRefInUse = v.bits(d.extRefInUse, 1);
+	d.FPGA_configured = v.bits(d.FPGA_configured, 1);
+	d.source_locked = v.bits(d.source_locked, 1);
+	d.LO1_locked = v.bits(d.LO1_locked, 1);
+	d.ADC_overload = v.bits(d.ADC_overload, 1);
+	v.field(d.temperatures.source);
+	v.field(d.temperatures.LO1);
+	v.field(d.temperatures.MCU);
+	v.field(d.droppedPoints);
+	v.field(d.droppedPackets);
+	v.field(d.usbQueueHighWater);
+	v.field(d.recoveries.restarts);
+	v.field(d.recoveries.reconfigurations);
+	v.field(d.recoveries.reinitializations);
+	v.field(d.averaging.sweeps);
+	v.field(d.averaging.completed);
+	v.field(d.boot.clocks);
+	v.field(d.boot.configuration);
+	v.field(d.boot.initialization);
+	v.field(d.boot.total);
+}
+template<class V> constexpr void Schema(V &v, AveragingSettings &d) {
+	v.field(d.sweeps);
+}
+template<class V> constexpr void Schema(V &v, DeviceInfoSettings &d) {
+	v.field(d.interval);
+}
+template<class V> constexpr void Schema(V &v, ManualStatus &d) {
+	v.field(d.port1min);
+	v.field(d.port1max);
+	v.field(d.port2min);
+	v.field(d.port2max);
+	v.field(d.refmin);
+	v.field(d.refmax);
+	v.field(d.port1real);
+	v.field(d.port1imag);
+	v.field(d.port2real);
+	v.field(d.port2imag);
+	v.field(d.refreal);
+	v.field(d.refimag);
+	v.field(d.temp_source);
+	v.field(d.temp_LO);
+	d.source_locked = v.bits(d.source_locked, 1);
+	d.LO_locked = v.bits(d.LO_locked, 1);
+}
+template<class V> constexpr void Schema(V &v, ManualControl &d) {
+	d.SourceHighCE = v.bits(d.SourceHighCE, 1);
+	d.SourceHighRFEN = v.bits(d.SourceHighRFEN, 1);
+	d.SourceHighPower = v.bits(d.SourceHighPower, 2);
+	d.SourceHighLowpass = v.bits(d.SourceHighLowpass, 2);
+	v.field(d.SourceHighFrequency);
+	d.SourceLowEN = v.bits(d.SourceLowEN, 1);
+	d.SourceLowPower = v.bits(d.SourceLowPower, 2);
+	v.field(d.SourceLowFrequency);
+	d.attenuator = v.bits(d.attenuator, 7);
+	d.SourceHighband = v.bits(d.SourceHighband, 1);
+	d.AmplifierEN = v.bits(d.AmplifierEN, 1);
+	d.PortSwitch = v.bits(d.PortSwitch, 1);
+	d.LO1CE = v.bits(d.LO1CE, 1);
+	d.LO1RFEN = v.bits(d.LO1RFEN, 1);
+	v.field(d.LO1Frequency);
+	d.LO2EN = v.bits(d.LO2EN, 1);
+	v.field(d.LO2Frequency);
+	d.Port1EN = v.bits(d.Port1EN, 1);
+	d.Port2EN = v.bits(d.Port2EN, 1);
+	d.RefEN = v.bits(d.RefEN, 1);
+	v.field(d.Samples);
+}
+template<class V> constexpr void Schema(V &v, TimingRequest &d) {
+	v.field(d.clear);
+}
+template<class V> constexpr void Schema(V &v, TimingHistogram &d) {
+	v.field(d.stage);
+	v.field(d.count);
+	v.field(d.min_us);
+	v.field(d.max_us);
+	v.field(d.sum_us);
+	v.field(d.bins);
+}
+template<class V> constexpr void Schema(V &v, Response &d) {
+	v.field(d.rejected);
+}
+template<class V> constexpr void Schema(V &v, FirmwarePacket &d) {
+	v.field(d.address);
+	v.field(d.data);
+}
+template<class V> constexpr void Schema(V &v, FirmwareStart &d) {
+	v.field(d.size);
+}
+template<class V> constexpr void Schema(V &v, FirmwareVerify &d) {
+	v.field(d.size);
+	v.field(d.crc);
+}
+
+// Schema visitor that only counts the bytes
+class SchemaSize {
+public:
+	constexpr SchemaSize() : bytes(0), bitpos(0) {}
+	template<typename T> constexpr void field(T&) {
+		if(bitpos != 0) {
+			// padding to next byte boundary
+			bitpos = 0;
+			bytes++;
+		}
+		bytes += sizeof(T);
+	}
+	template<typename T> constexpr void field(T&, uint8_t size) {
+		if(bitpos != 0) {
+			bitpos = 0;
+			bytes++;
+		}
+		bytes += size;
+	}
+	constexpr uint8_t bits(uint8_t value, uint8_t width) {
+		bitpos += width;
+		bytes += bitpos / 8;
+		bitpos %= 8;
+		return value;
+	}
+	constexpr uint16_t get() const {
+		return bitpos != 0 ? bytes + 1 : bytes;
+	}
+private:
+	uint16_t bytes;
+	uint8_t bitpos;
+};
+
+// Exact payload size of a fixed size packet, known at compile time
+template<typename T> constexpr uint16_t PayloadSize() {
+	SchemaSize s;
+	T d{};
+	Schema(s, d);
+	return s.get();
+}
+
 uint32_t CRC32(uint32_t crc, const void *data, uint32_t len);
+// Table-driven implementation, used by CRC32 unless the hardware CRC unit is available (only then it exists)
+uint32_t CRC32Software(uint32_t crc, const void *data, uint32_t len);
+// Frequency of a point in a sweep, calculated identically on device and host
+uint64_t PointFrequency(const SweepSettings &s, uint16_t pointNum);
+uint64_t PointFrequency(const SweepSegment &s, uint16_t pointNum);
+// Maximum number of points of a sweep that the device is able to average (identical on device and host)
+uint16_t AveragingPoints(DatapointFormat format, uint8_t parameters);
+// Whether the payload of this packet type starts with a sequence number
+bool HasSequenceNumber(PacketType type);
+// Frame layout: header byte, 2 byte overall length, packet type, payload, 4 byte CRC32
+static constexpr uint8_t FrameHeader = 0x5A;
+static constexpr uint8_t FrameHeaderSize = 4;
+static constexpr uint8_t FrameOverhead = FrameHeaderSize + 4;
+// No packet type encodes to a larger frame, longer length fields are treated as corrupted
+static constexpr uint16_t MaxFrameSize = 512;
+
+// Searches a linear buffer for the first valid frame. Returns the number of bytes that can be removed from the buffer
 uint16_t DecodeBuffer(uint8_t *buf, uint16_t len, PacketInfo *info);
+// Helpers for decoding frames in place (see FrameBuffer)
+uint16_t FrameLength(const uint8_t *frame);
+bool FrameValid(const uint8_t *frame, uint16_t length);
+// Decodes a complete frame (already checked by FrameValid)
+void DecodeFrame(uint8_t *frame, PacketInfo *info);
 uint16_t EncodePacket(PacketInfo packet, uint8_t *dest, uint16_t destsize);
 
 }
@@ -3,6 +3,7 @@
 #include "stm.hpp"
 #include "main.h"
 #include "FPGA_HAL.hpp"
+#include <cstring>
 
 #define LOG_LEVEL	LOG_LEVEL_DEBUG
 #define LOG_MODULE	"FPGA"
@@ -14,40 +15,179 @@ static uint16_t ISRMaskReg = 0x0000;
 
 using namespace FPGAHAL;
 
+/*
+ * SPI transactions are executed in order. Sweep configurations of consecutive points are collected into blocks
+ * and transmitted by DMA (the FPGA advances the point number after every 6 data words), the next block is filled
+ * while the previous one is still transmitted. All other transactions first wait for pending sweep configurations.
+ */
+static constexpr uint16_t SweepConfigWords = 6;
+static constexpr uint16_t SweepBlockPoints = 32;
+using SweepBlock = struct _sweepBlock {
+	// command word with the number of the first point, followed by the configuration of each point
+	uint16_t words[1 + SweepBlockPoints * SweepConfigWords];
+	uint16_t points;
+};
+static SweepBlock blocks[2];
+static SweepBlock *filling = &blocks[0];
+static volatile bool sweepBlockBusy = false;
+
+// Register writes between BeginBatch and EndBatch are collected, consecutive registers are written in a single
+// transaction (the FPGA advances the register address after every word)
+static constexpr uint8_t NumRegisters = 16;
+static uint16_t registers[NumRegisters];
+static uint16_t dirtyRegisters;
+static uint8_t batchDepth;
+// register write started by EnableDMA
+static uint16_t registerTransfer[2];
+static FPGA::TransferCallback registerCallback;
+
+static void TransmitSweepBlock() {
+	if(filling->points == 0) {
+		return;
+	}
+	// wait for the previous block
+	while(sweepBlockBusy || FPGA_SPI.State != HAL_SPI_STATE_READY);
+	sweepBlockBusy = true;
+	Low(CS);
+	if(HAL_SPI_Transmit_DMA(&FPGA_SPI, (uint8_t*) filling->words, 1 + filling->points * SweepConfigWords) != HAL_OK) {
+		High(CS);
+		sweepBlockBusy = false;
+		LOG_ERR("Failed to start sweep config transfer");
+	}
+	// the other block receives the next points
+	filling = filling == &blocks[0] ? &blocks[1] : &blocks[0];
+	filling->points = 0;
+}
+
+// Has to be called before any other transaction
+static void Sync() {
+	TransmitSweepBlock();
+	while(sweepBlockBusy || registerCallback);
+}
+
+static void TransmitRegisters(uint8_t first, uint8_t cnt) {
+	uint16_t cmd[1 + NumRegisters];
+	cmd[0] = 0x8000 | first;
+	memcpy(&cmd[1], &registers[first], cnt * sizeof(uint16_t));
+	Sync();
+	Low(CS);
+	HAL_SPI_Transmit(&FPGA_SPI, (uint8_t*) cmd, 1 + cnt, 100);
+	High(CS);
+}
+
 void WriteRegister(FPGA::Reg reg, uint16_t value) {
-	uint16_t cmd[2] = {(uint16_t) (0x8000 | (uint16_t) reg), value};
+	registers[(int) reg] = value;
+	if(batchDepth > 0) {
+		dirtyRegisters |= 1 << (int) reg;
+	} else {
+		TransmitRegisters((int) reg, 1);
+	}
+}
+
+void FPGA::BeginBatch() {
+	batchDepth++;
+}
+
+void FPGA::EndBatch() {
+	if(batchDepth == 0 || --batchDepth > 0) {
+		return;
+	}
+	uint8_t reg = 0;
+	while(dirtyRegisters) {
+		if(!(dirtyRegisters & (1 << reg))) {
+			reg++;
+			continue;
+		}
+		uint8_t cnt = 0;
+		while(reg + cnt < NumRegisters && (dirtyRegisters & (1 << (reg + cnt)))) {
+			dirtyRegisters &= ~(1 << (reg + cnt));
+			cnt++;
+		}
+		TransmitRegisters(reg, cnt);
+		reg += cnt;
+	}
+}
+
+/*
+ * The bitstream is loaded in chunks with two buffers: while one chunk is transmitted to the FPGA by DMA, the next
+ * one is read from the flash. The configuration SPI uses 16 bit frames (shared with FPGA_SPI), the bytes of each
+ * word are swapped to shift out the bitstream in order.
+ */
+static constexpr uint16_t ConfigurationChunk = 512;
+static uint16_t configurationBuffers[2][ConfigurationChunk / 2];
+static volatile bool configurationBusy = false;
+
+// Sends the status/ID command, returns true if the FPGA responds with its ID
+static bool ReadID(uint16_t *status) {
+	uint16_t cmd[2] = {0x4000, 0x0000};
+	uint16_t recv[2];
 	Low(CS);
-	HAL_SPI_Transmit(&FPGA_SPI, (uint8_t*) cmd, 2, 100);
+	HAL_SPI_TransmitReceive(&FPGA_SPI, (uint8_t*) cmd, (uint8_t*) recv, 2, 100);
 	High(CS);
+	if(status) {
+		*status = recv[0];
+	}
+	return recv[1] == 0xF0A5;
+}
+
+bool FPGA::WaitForConfiguration(uint32_t timeout) {
+	Sync();
+	SetMode(Mode::FPGA);
+	uint32_t start = HAL_GetTick();
+	// an unconfigured FPGA does not drive its outputs
+	while(!ReadID(nullptr)) {
+		if(HAL_GetTick() - start > timeout) {
+			LOG_ERR("FPGA not configured after %lums", timeout);
+			return false;
+		}
+		Delay::ms(1);
+	}
+	LOG_INFO("FPGA configured after %lums", HAL_GetTick() - start);
+	return true;
 }
 
 bool FPGA::Configure(Flash *f, uint32_t start_address, uint32_t bitstream_size) {
 	if(!PROGRAM_B.gpio) {
 		LOG_WARN("PROGRAM_B not defined, assuming FPGA configures itself in master configuration");
-		// wait too allow enough time for FPGA configuration
-		HAL_Delay(2000);
-		return true;
+		return WaitForConfiguration(2000);
 	}
+	Sync();
 	LOG_INFO("Loading bitstream of size %lu...", bitstream_size);
 	Low(PROGRAM_B);
 	while(isHigh(INIT_B));
 	High(PROGRAM_B);
 	while(!isHigh(INIT_B));
 
-	uint8_t buf[256];
+	uint8_t active = 0;
 	while(bitstream_size > 0) {
-		uint16_t size = sizeof(buf);
+		uint16_t size = ConfigurationChunk;
 		if(size > bitstream_size) {
 			size = bitstream_size;
 		}
-		// TODO this part might be doable with the DMA instead of the buffer
-		// get chunk of bitstream from flash...
+		auto buf = configurationBuffers[active];
+		// get chunk of bitstream from flash while the previous one is still transmitted...
 		f->read(start_address, size, buf);
+		if(size % 2) {
+			// trailing byte, additional clock cycles after the bitstream are ignored by the FPGA
+			((uint8_t*) buf)[size] = 0xFF;
+		}
+		uint16_t words = (size + 1) / 2;
+		for(uint16_t i=0;i<words;i++) {
+			buf[i] = __REV16(buf[i]);
+		}
 		// ... and pass it on to FPGA
-		HAL_SPI_Transmit(&CONFIGURATION_SPI, buf, size, 100);
+		while(configurationBusy);
+		configurationBusy = true;
+		if(HAL_SPI_Transmit_DMA(&CONFIGURATION_SPI, (uint8_t*) buf, words) != HAL_OK) {
+			configurationBusy = false;
+			LOG_ERR("Failed to start bitstream transfer");
+			return false;
+		}
+		active = !active;
 		bitstream_size -= size;
 		start_address += size;
 	}
+	while(configurationBusy);
 	Delay::ms(1);
 	if(!isHigh(INIT_B)) {
 		LOG_CRIT("INIT_B asserted after configuration, CRC error occurred");
@@ -62,9 +202,12 @@ bool FPGA::Configure(Flash *f, uint32_t start_address, uint32_t bitstream_size)
 }
 
 bool FPGA::Init(HaltedCallback cb) {
+	Sync();
 	halted_cb = cb;
 	SysCtrlReg = 0;
 	ISRMaskReg = 0;
+	batchDepth = 0;
+	dirtyRegisters = 0;
 	// Reset FPGA
 	High(FPGA_RESET);
 	SetMode(Mode::FPGA);
@@ -73,18 +216,13 @@ bool FPGA::Init(HaltedCallback cb) {
 	Delay::ms(10);
 
 	// Check if FPGA response is as expected
-	uint16_t cmd[2] = {0x4000, 0x0000};
-	uint16_t recv[2];
-	Low(CS);
-	HAL_SPI_TransmitReceive(&FPGA_SPI, (uint8_t*) cmd, (uint8_t*) recv, 2, 100);
-	High(CS);
-
-	if(recv[1] != 0xF0A5) {
-		LOG_ERR("Initialization failed, got 0x%04x instead of 0xF0A5", recv[1]);
+	uint16_t status;
+	if(!ReadID(&status)) {
+		LOG_ERR("Initialization failed, no ID received");
 		return false;
 	}
 
-	LOG_DEBUG("Initialized, status register: 0x%04x", recv[0]);
+	LOG_DEBUG("Initialized, status register: 0x%04x", status);
 	return true;
 }
 
@@ -116,6 +254,28 @@ void FPGA::Disable(Periphery p) {
 	WriteRegister(Reg::SystemControl, SysCtrlReg);
 }
 
+bool FPGA::EnableDMA(Periphery p, bool enable, TransferCallback cb) {
+	if(sweepBlockBusy || registerCallback || FPGA_SPI.State != HAL_SPI_STATE_READY) {
+		return false;
+	}
+	if (enable) {
+		SysCtrlReg |= (uint16_t) p;
+	} else {
+		SysCtrlReg &= ~(uint16_t) p;
+	}
+	registers[(int) Reg::SystemControl] = SysCtrlReg;
+	registerTransfer[0] = 0x8000 | (int) Reg::SystemControl;
+	registerTransfer[1] = SysCtrlReg;
+	registerCallback = cb;
+	Low(CS);
+	if(HAL_SPI_Transmit_DMA(&FPGA_SPI, (uint8_t*) registerTransfer, 2) != HAL_OK) {
+		High(CS);
+		registerCallback = nullptr;
+		return false;
+	}
+	return true;
+}
+
 void FPGA::EnableInterrupt(Interrupt i) {
 	ISRMaskReg |= (uint16_t) i;
 	WriteRegister(Reg::InterruptMask, ISRMaskReg);
@@ -127,6 +287,7 @@ void FPGA::DisableInterrupt(Interrupt i) {
 }
 
 void FPGA::WriteMAX2871Default(uint32_t *DefaultRegs) {
+	BeginBatch();
 	WriteRegister(Reg::MAX2871Def0LSB, DefaultRegs[0] & 0xFFFF);
 	WriteRegister(Reg::MAX2871Def0MSB, DefaultRegs[0] >> 16);
 	WriteRegister(Reg::MAX2871Def1LSB, DefaultRegs[1] & 0xFFFF);
@@ -135,13 +296,23 @@ void FPGA::WriteMAX2871Default(uint32_t *DefaultRegs) {
 	WriteRegister(Reg::MAX2871Def3MSB, DefaultRegs[3] >> 16);
 	WriteRegister(Reg::MAX2871Def4LSB, DefaultRegs[4] & 0xFFFF);
 	WriteRegister(Reg::MAX2871Def4MSB, DefaultRegs[4] >> 16);
+	EndBatch();
 }
 
 void FPGA::WriteSweepConfig(uint16_t pointnum, bool lowband, uint32_t *SourceRegs, uint32_t *LORegs,
 		uint8_t attenuation, uint64_t frequency, SettlingTime settling, Samples samples, bool halt, LowpassFilter filter) {
-	uint16_t send[7];
-	// select which point this sweep config is for
-	send[0] = pointnum & 0x1FFF;
+	if(filling->points > 0) {
+		uint16_t next = (filling->words[0] & 0x1FFF) + filling->points;
+		if(pointnum != next || filling->points >= SweepBlockPoints) {
+			// not a continuation of the current block
+			TransmitSweepBlock();
+		}
+	}
+	if(filling->points == 0) {
+		// select which point this block starts with
+		filling->words[0] = pointnum & 0x1FFF;
+	}
+	uint16_t *send = &filling->words[filling->points * SweepConfigWords];
 	// assemble sweep config from required fields of PLL registers
 	uint16_t LO_N = (LORegs[0] & 0x7FFF8000) >> 15;
 	uint16_t LO_FRAC = (LORegs[0] & 0x00007FF8) >> 3;
@@ -183,9 +354,11 @@ void FPGA::WriteSweepConfig(uint16_t pointnum, bool lowband, uint32_t *SourceReg
 	}
 	send[5] = (Source_M & 0x000F) << 12 | Source_FRAC;
 	send[6] = Source_DIV_A << 13 | Source_VCO << 7 | Source_N;
-	Low(CS);
-	HAL_SPI_Transmit(&FPGA_SPI, (uint8_t*) send, 7, 100);
-	High(CS);
+	filling->points++;
+}
+
+void FPGA::FlushSweepConfig() {
+	Sync();
 }
 
 static inline int64_t sign_extend_64(int64_t x, uint16_t bits) {
@@ -198,6 +371,7 @@ static uint16_t raw[18];
 static bool halted;
 
 bool FPGA::InitiateSampleRead(ReadCallback cb) {
+	// sweep configurations are only written while no sweep is active, nothing to wait for
 	callback = cb;
 	uint16_t cmd = 0xC000;
 	uint16_t status;
@@ -232,6 +406,21 @@ bool FPGA::InitiateSampleRead(ReadCallback cb) {
 }
 
 extern "C" {
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
+	if(hspi == &FPGA_SPI && sweepBlockBusy) {
+		High(CS);
+		sweepBlockBusy = false;
+	}
+	if(hspi == &FPGA_SPI && registerCallback) {
+		High(CS);
+		auto cb = registerCallback;
+		registerCallback = nullptr;
+		cb(true);
+	}
+	if(hspi == &CONFIGURATION_SPI && configurationBusy) {
+		configurationBusy = false;
+	}
+}
 void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi) {
 	FPGA::SamplingResult result;
 	High(CS);
@@ -258,6 +447,10 @@ void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi) {
 }
 
 void FPGA::StartSweep() {
+	Sync();
+	// an edge left over from the aborted sweep must not start a readout
+	__HAL_GPIO_EXTI_CLEAR_IT(FPGA_INTR_Pin);
+	EXTI->IMR1 |= FPGA_INTR_Pin;
 	Low(AUX3);
 	Delay::us(1);
 	High(AUX3);
@@ -265,9 +458,15 @@ void FPGA::StartSweep() {
 
 void FPGA::AbortSweep() {
 	Low(AUX3);
+	// No readout of the aborted sweep may start anymore and one that is still active has to complete before returning.
+	// Otherwise its sample would be passed on after the caller discarded the points of the old sweep
+	EXTI->IMR1 &= ~FPGA_INTR_Pin;
+	__DSB();
+	while(FPGA_SPI.State != HAL_SPI_STATE_READY);
 }
 
 void FPGA::SetMode(Mode mode) {
+	Sync();
 	switch(mode) {
 	case Mode::FPGA:
 		// Both AUX1/2 low
@@ -293,6 +492,7 @@ void FPGA::SetMode(Mode mode) {
 }
 
 uint16_t FPGA::GetStatus() {
+	Sync();
 	uint16_t cmd = 0x4000;
 	uint16_t status;
 	Low(CS);
@@ -303,6 +503,7 @@ uint16_t FPGA::GetStatus() {
 }
 
 FPGA::ADCLimits FPGA::GetADCLimits() {
+	Sync();
 	uint16_t cmd = 0xE000;
 	Low(CS);
 	HAL_SPI_Transmit(&FPGA_SPI, (uint8_t*) &cmd, 1, 100);
@@ -313,6 +514,7 @@ FPGA::ADCLimits FPGA::GetADCLimits() {
 }
 
 void FPGA::ResetADCLimits() {
+	Sync();
 	uint16_t cmd = 0x6000;
 	Low(CS);
 	HAL_SPI_Transmit(&FPGA_SPI, (uint8_t*) &cmd, 1, 100);
@@ -85,7 +85,10 @@ enum class Samples {
 	S91392 = 0x07,
 };
 
+// Loads the bitstream from the flash (or waits for the FPGA to configure itself if PROGRAM_B is not connected)
 bool Configure(Flash *f, uint32_t start_address, uint32_t bitstream_size);
+// Waits until a self-configuring FPGA responds, returns false after timeout ms
+bool WaitForConfiguration(uint32_t timeout);
 
 using HaltedCallback = void(*)(void);
 bool Init(HaltedCallback cb = nullptr);
@@ -93,11 +96,22 @@ void SetNumberOfPoints(uint16_t npoints);
 void SetSamplesPerPoint(uint32_t nsamples);
 void Enable(Periphery p, bool enable = true);
 void Disable(Periphery p);
+// called from interrupt context when a DMA transfer has finished
+using TransferCallback = void(*)(bool success);
+// Non-blocking version of Enable for a halted sweep (no other SPI transfer is active). Returns false if the
+// transfer could not be started, the callback is not called then
+bool EnableDMA(Periphery p, bool enable, TransferCallback cb);
 void EnableInterrupt(Interrupt i);
 void DisableInterrupt(Interrupt i);
+// Register writes until the matching EndBatch are collected and transmitted together (may be nested)
+void BeginBatch();
+void EndBatch();
 void WriteMAX2871Default(uint32_t *DefaultRegs);
+// Only queues the configuration, consecutive points are transmitted in blocks by DMA. Any other
+// transaction (or FlushSweepConfig) waits for all queued configurations to be written
 void WriteSweepConfig(uint16_t pointnum, bool lowband, uint32_t *SourceRegs, uint32_t *LORegs,
 		uint8_t attenuation, uint64_t frequency, SettlingTime settling, Samples samples, bool halt = false, LowpassFilter filter = LowpassFilter::Auto);
+void FlushSweepConfig();
 using ReadCallback = void(*)(SamplingResult result);
 bool InitiateSampleRead(ReadCallback cb);
 ADCLimits GetADCLimits();
@@ -106,6 +120,7 @@ void ResumeHaltedSweep();
 uint16_t GetStatus();
 
 void StartSweep();
+// Stops the sweep. Once it returns, no sampling result of the aborted sweep is passed on anymore
 void AbortSweep();
 
 enum class Mode {
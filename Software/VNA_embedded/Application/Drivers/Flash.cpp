@@ -1,6 +1,7 @@
 #include "Flash.hpp"
 
 bool Flash::isPresent() {
+	WaitProgrammed();
 	CS(false);
 	// read JEDEC ID
 	uint8_t send[4] = {0x9F};
@@ -26,30 +27,47 @@ bool Flash::write(uint32_t address, uint16_t length, uint8_t *src) {
 		// only writes to complete pages allowed
 		return false;
 	}
-	address &= 0x00FFFFFF;
 	while(length > 0) {
-		EnableWrite();
-		CS(false);
-		uint8_t cmd[4] = {
-			0x02,
-			((uint8_t) address >> 16) & 0xFF,
-			((uint8_t) address >> 8) & 0xFF,
-			(uint8_t) (address & 0xFF),
-		};
-		// issue read command
-		HAL_SPI_Transmit(spi, cmd, 4, 100);
-		// write data
-		HAL_SPI_Transmit(spi, src, 256, 1000);
-		CS(true);
-		if(!WaitBusy(5)) {
+		if(!programPage(address, src)) {
 			return false;
 		}
-		length -= 256;
-		src += 256;
+		address += PageSize;
+		length -= PageSize;
+		src += PageSize;
+	}
+	return WaitProgrammed();
+}
+
+bool Flash::programPage(uint32_t address, const uint8_t *src) {
+	if((address & 0xFF) != 0 || !WaitProgrammed()) {
+		return false;
 	}
+	address &= 0x00FFFFFF;
+	EnableWrite();
+	CS(false);
+	uint8_t cmd[4] = {
+		0x02,
+		(uint8_t) ((address >> 16) & 0xFF),
+		(uint8_t) ((address >> 8) & 0xFF),
+		(uint8_t) (address & 0xFF),
+	};
+	// issue page program command
+	HAL_SPI_Transmit(spi, cmd, 4, 100);
+	// write data
+	HAL_SPI_Transmit(spi, (uint8_t*) src, PageSize, 1000);
+	CS(true);
+	programming = true;
 	return true;
 }
 
+bool Flash::WaitProgrammed() {
+	if(!programming) {
+		return true;
+	}
+	programming = false;
+	return WaitBusy(5);
+}
+
 void Flash::EnableWrite() {
 	CS(false);
 	// enable write latch
@@ -59,6 +77,9 @@ void Flash::EnableWrite() {
 }
 
 bool Flash::eraseChip() {
+	if(!WaitProgrammed()) {
+		return false;
+	}
 	EnableWrite();
 	CS(false);
 	// enable write latch
@@ -68,13 +89,42 @@ bool Flash::eraseChip() {
 	return WaitBusy(25000);
 }
 
+bool Flash::eraseSector(uint32_t address) {
+	// align address with sector
+	return Erase(0x20, address & ~(SectorSize - 1), 400);
+}
+
+bool Flash::eraseBlock(uint32_t address) {
+	return Erase(0xD8, address & ~(BlockSize - 1), 2000);
+}
+
+bool Flash::Erase(uint8_t command, uint32_t address, uint32_t timeout) {
+	if(!WaitProgrammed()) {
+		return false;
+	}
+	address &= 0x00FFFFFF;
+	EnableWrite();
+	CS(false);
+	uint8_t cmd[4] = {
+		command,
+		(uint8_t) ((address >> 16) & 0xFF),
+		(uint8_t) ((address >> 8) & 0xFF),
+		(uint8_t) (address & 0xFF),
+	};
+	HAL_SPI_Transmit(spi, cmd, 4, 100);
+	CS(true);
+	return WaitBusy(timeout);
+}
+
 void Flash::initiateRead(uint32_t address) {
+	// reading is not possible while a page is programmed
+	WaitProgrammed();
 	address &= 0x00FFFFFF;
 	CS(false);
 	uint8_t cmd[4] = {
 		0x03,
-		((uint8_t) address >> 16) & 0xFF,
-		((uint8_t) address >> 8) & 0xFF,
+		(uint8_t) ((address >> 16) & 0xFF),
+		(uint8_t) ((address >> 8) & 0xFF),
 		(uint8_t) (address & 0xFF),
 	};
 	// issue read command
@@ -86,7 +136,7 @@ bool Flash::WaitBusy(uint32_t timeout) {
 	CS(false);
 	uint8_t readStatus1 = 0x05;
 	HAL_SPI_Transmit(spi, &readStatus1, 1, 100);
-	while(HAL_GetTick() - starttime > timeout) {
+	while(HAL_GetTick() - starttime <= timeout) {
 		uint8_t status1;
 		HAL_SPI_Receive(spi, &status1, 1, 100);
 		if(!(status1 & 0x01)) {
@@ -13,12 +13,22 @@
 class Flash {
 public:
 	constexpr Flash(SPI_HandleTypeDef *spi, GPIO_TypeDef *CS_gpio, uint16_t CS_pin)
-	: spi(spi),CS_gpio(CS_gpio),CS_pin(CS_pin){};
+	: spi(spi),CS_gpio(CS_gpio),CS_pin(CS_pin),programming(false){};
 
 	bool isPresent();
 	void read(uint32_t address, uint16_t length, void *dest);
 	bool write(uint32_t address, uint16_t length, uint8_t *src);
+	static constexpr uint16_t PageSize = 256;
+	// Starts programming a complete page and returns without waiting for the flash. The data has been
+	// transferred when the function returns, the next operation waits until the page is programmed.
+	bool programPage(uint32_t address, const uint8_t *src);
 	bool eraseChip();
+	static constexpr uint32_t SectorSize = 4096;
+	// Erases the sector containing the address
+	bool eraseSector(uint32_t address);
+	static constexpr uint32_t BlockSize = 65536;
+	// Erases the 64kB block containing the address
+	bool eraseBlock(uint32_t address);
 	// Starts the reading process without actually reading any bytes
 	void initiateRead(uint32_t address);
 	const SPI_HandleTypeDef* const getSpi() const {
@@ -35,9 +45,13 @@ private:
 	}
 	void EnableWrite();
 	bool WaitBusy(uint32_t timeout);
+	// Waits for a page started by programPage
+	bool WaitProgrammed();
+	bool Erase(uint8_t command, uint32_t address, uint32_t timeout);
 	SPI_HandleTypeDef * const spi;
 	GPIO_TypeDef * const CS_gpio;
 	const uint16_t CS_pin;
+	bool programming;
 };
 
 
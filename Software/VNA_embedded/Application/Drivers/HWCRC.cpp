@@ -0,0 +1,38 @@
+#include "HWCRC.hpp"
+
+#include "stm.hpp"
+#include <cstring>
+
+static bool initialized = false;
+
+uint32_t HWCRC::CRC32(uint32_t crc, const void *data, uint32_t len) {
+	auto u8buf = (const uint8_t*) data;
+	// The peripheral is shared between the USB interrupt (decoding) and the tasks (encoding)
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(!initialized) {
+		__HAL_RCC_CRC_CLK_ENABLE();
+		// default polynomial 0x04C11DB7, 32 bit
+		CRC->POL = 0x04C11DB7;
+		initialized = true;
+	}
+	// reflected CRC32: bit reversal of input bytes and output word
+	CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;
+	// the peripheral works on the non-reflected CRC value
+	CRC->INIT = __RBIT(~crc);
+	CRC->CR |= CRC_CR_RESET;
+	while (len >= 4) {
+		uint32_t word;
+		memcpy(&word, u8buf, 4);
+		// peripheral expects the first byte in the MSB
+		CRC->DR = __REV(word);
+		u8buf += 4;
+		len -= 4;
+	}
+	while (len--) {
+		*(volatile uint8_t*) &CRC->DR = *u8buf++;
+	}
+	crc = ~CRC->DR;
+	__set_PRIMASK(primask);
+	return crc;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HWCRC {
+
+// Calculates the same CRC32 as the software implementation in Protocol.cpp,
+// using the CRC peripheral of the STM32L4 (safe to call from interrupt context)
+uint32_t CRC32(uint32_t crc, const void *data, uint32_t len);
+
+}
@@ -49,12 +49,31 @@ extern "C" {
 static char fifo[LOG_SENDBUF_LENGTH + MAX_LINE_LENGTH];
 static uint16_t fifo_write, fifo_read;
 
-#ifdef LOG_USE_MUTEX
-#include "FreeRTOS.h"
-#include "semphr.h"
-static StaticSemaphore_t xMutex;
-static SemaphoreHandle_t mutex;
-#endif
+/*
+ * Entry ring buffer, indices run freely and are masked on access. Writers reserve space by advancing ring_head
+ * (LDREX/STREX, any context may preempt another writer) and mark the entry as complete by writing its header
+ * word last. The reader stops at the first incomplete entry.
+ */
+#define RING_MASK			(LOG_RING_WORDS - 1)
+#define ENTRY_HEADER_WORDS	3
+#define ENTRY_VALID			0x4C4F4700
+#define ENTRY_VALID_MASK	0xFFFFFF00
+#define MAX_ARGS			8
+// longer site definitions are truncated, a definition and its entry always fit into one transfer
+#define MAX_DEFINITION		200
+
+static uint32_t ring[LOG_RING_WORDS];
+static volatile uint32_t ring_head, ring_tail;
+static volatile uint32_t lost_entries;
+static volatile uint32_t flushing;
+
+extern const log_site_t __log_sites_start[];
+extern const log_site_t __log_sites_end[];
+// sites already sent to the redirect function
+static uint8_t site_sent[LOG_MAX_SITES / 8];
+// entries that were stored but could not be passed on to the redirect function
+static uint32_t undelivered;
+static uint32_t lost_reported;
 
 #define INC_FIFO_POS(pos, inc) do { pos = (pos + inc) % LOG_SENDBUF_LENGTH; } while(0)
 
@@ -73,10 +92,15 @@ static log_redirect_t redirect;
 void Log_Init() {
 	fifo_write = 0;
 	fifo_read = 0;
+	ring_head = 0;
+	ring_tail = 0;
+	lost_entries = 0;
+	undelivered = 0;
+	lost_reported = 0;
+	flushing = 0;
+	memset(ring, 0, sizeof(ring));
+	memset(site_sent, 0, sizeof(site_sent));
 	redirect = NULL;
-#ifdef LOG_USE_MUTEXES
-	mutex = xSemaphoreCreateMutexStatic(&xMutex);
-#endif
 
 	/* USART interrupt Init */
 	HAL_NVIC_SetPriority(NVIC_ISR, 5, 0);
@@ -87,23 +111,54 @@ void Log_SetRedirect(log_redirect_t redirect_function) {
 	redirect = redirect_function;
 }
 
-void _log_write(const char *module, const char *level, const char *fmt, ...) {
-	int written = 0;
+void Log_ResendSites() {
+	memset(site_sent, 0, sizeof(site_sent));
+}
+
+void _log_write(const log_site_t *site, uint8_t nargs, ...) {
+	uint32_t words = ENTRY_HEADER_WORDS + nargs;
+	uint32_t head;
+	do {
+		head = __LDREXW(&ring_head);
+		if (head + words - ring_tail > LOG_RING_WORDS) {
+			__CLREX();
+			uint32_t lost;
+			do {
+				lost = __LDREXW(&lost_entries);
+			} while (__STREXW(lost + 1, &lost_entries));
+			return;
+		}
+	} while (__STREXW(head + words, &ring_head));
+	ring[(head + 1) & RING_MASK] = (uintptr_t) site;
+	ring[(head + 2) & RING_MASK] = HAL_GetTick();
 	va_list args;
-	va_start(args, fmt);
-#ifdef LOG_USE_MUTEX
-	if (!STM::InInterrupt()) {
-		xSemaphoreTake(mutex, portMAX_DELAY);
+	va_start(args, nargs);
+	for (uint8_t i = 0; i < nargs; i++) {
+		ring[(head + ENTRY_HEADER_WORDS + i) & RING_MASK] = va_arg(args, uint32_t);
 	}
+	va_end(args);
+	// entry must be complete before it becomes visible
+	__DMB();
+	ring[head & RING_MASK] = ENTRY_VALID | nargs;
+	if (!STM::InInterrupt()) {
+		// formatting is only deferred for interrupts
+		Log_Flush();
+#ifdef LOG_BLOCKING
+		while(USART_BASE->CR1 & USART_CR1_TCIE);
 #endif
-	written = snprintf(&fifo[fifo_write], MAX_LINE_LENGTH, "%05lu [%6.6s,%s]: ",
-			HAL_GetTick(), module, level);
-	written += vsnprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
-			fmt, args);
+	}
+}
+
+static void write_text(const log_site_t *site, uint32_t timestamp, const uint32_t *a) {
+	int written = snprintf(&fifo[fifo_write], MAX_LINE_LENGTH, "%05lu [%6.6s,%s]: ",
+			timestamp, site->module, site->level);
+	// unused arguments are ignored by the format string
+	written += snprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
+			site->fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
 	written += snprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
 			"\r\n");
-	if(redirect) {
-		redirect(&fifo[fifo_write], written);
+	if (written >= MAX_LINE_LENGTH) {
+		written = MAX_LINE_LENGTH - 1;
 	}
 	// check if line still fits into ring buffer
 #ifdef LOG_BLOCKING
@@ -113,11 +168,6 @@ void _log_write(const char *module, const char *level, const char *fmt, ...) {
 #else
 	if (written > fifo_space()) {
 		// unable to fit line, skip
-#ifdef LOG_USE_MUTEX
-		if (!stm_in_interrupt()) {
-			xSemaphoreGive(mutex);
-		}
-#endif
 		return;
 	}
 #endif
@@ -130,14 +180,160 @@ void _log_write(const char *module, const char *level, const char *fmt, ...) {
 	// enable interrupt
 	CLK_ENABLE();
 	USART_BASE->CR1 |= USART_CR1_TXEIE | USART_CR1_TCIE;
-#ifdef LOG_USE_MUTEX
-	if (!stm_in_interrupt()) {
-		xSemaphoreGive(mutex);
+}
+
+static uint16_t site_definition(uint8_t *dest, uint16_t id, const log_site_t *site) {
+	const char *parts[3] = {site->module, site->level, site->fmt};
+	uint16_t len = 0;
+	for (uint8_t i = 0; i < 3; i++) {
+		// module and level include their terminating zero as separator
+		uint16_t part = strlen(parts[i]) + (i < 2 ? 1 : 0);
+		if (len + part > MAX_DEFINITION) {
+			part = MAX_DEFINITION - len;
+		}
+		if (dest) {
+			memcpy(&dest[5 + len], parts[i], part);
+		}
+		len += part;
 	}
-#endif
-#ifdef LOG_BLOCKING
-	while(USART_BASE->CR1 & USART_CR1_TCIE);
-#endif
+	if (dest) {
+		dest[0] = LOG_FRAME_SYNC;
+		dest[1] = LOG_FRAME_SITE;
+		dest[2] = id & 0xFF;
+		dest[3] = id >> 8;
+		dest[4] = len;
+	}
+	return 5 + len;
+}
+
+static uint16_t entry_frame(uint8_t *dest, uint16_t id, uint32_t timestamp, uint8_t nargs, const uint32_t *a) {
+	dest[0] = LOG_FRAME_SYNC;
+	dest[1] = LOG_FRAME_ENTRY;
+	dest[2] = id & 0xFF;
+	dest[3] = id >> 8;
+	dest[4] = nargs;
+	memcpy(&dest[5], &timestamp, sizeof(timestamp));
+	memcpy(&dest[9], a, nargs * sizeof(uint32_t));
+	return 9 + nargs * sizeof(uint32_t);
+}
+
+using Entry = struct {
+	const log_site_t *site;
+	uint32_t timestamp;
+	uint8_t nargs;
+	uint32_t args[MAX_ARGS];
+};
+
+// Reads the entry at ring position pos, returns false if it is not complete yet
+static bool read_entry(uint32_t pos, Entry &e) {
+	uint32_t header = ring[pos & RING_MASK];
+	if ((header & ENTRY_VALID_MASK) != ENTRY_VALID) {
+		return false;
+	}
+	e.nargs = header & 0xFF;
+	e.site = (const log_site_t*) (uintptr_t) ring[(pos + 1) & RING_MASK];
+	e.timestamp = ring[(pos + 2) & RING_MASK];
+	for (uint8_t i = 0; i < MAX_ARGS; i++) {
+		e.args[i] = i < e.nargs ? ring[(pos + ENTRY_HEADER_WORDS + i) & RING_MASK] : 0;
+	}
+	return true;
+}
+
+static uint16_t site_id(const log_site_t *site) {
+	return site - __log_sites_start;
+}
+
+static bool site_pending(uint16_t id) {
+	return id < LOG_MAX_SITES && !(site_sent[id / 8] & (1 << (id % 8)));
+}
+
+void Log_Flush() {
+	// only one reader at a time
+	do {
+		if (__LDREXW(&flushing)) {
+			__CLREX();
+			return;
+		}
+	} while (__STREXW(1, &flushing));
+
+	static uint8_t frames[256];
+	Entry e;
+	uint32_t tail = ring_tail;
+	while (tail != ring_head) {
+		// collect the binary frames of as many entries as fit
+		uint16_t frames_len = 0;
+		uint32_t end = tail;
+		while (end != ring_head && read_entry(end, e)) {
+			if (redirect) {
+				uint16_t id = site_id(e.site);
+				bool definition = site_pending(id);
+				uint16_t needed = (definition ? site_definition(NULL, id, e.site) : 0) + 9 + e.nargs * 4;
+				if (frames_len + needed > sizeof(frames) - 4) {
+					// leave space for the lost entries frame
+					break;
+				}
+				if (definition) {
+					frames_len += site_definition(&frames[frames_len], id, e.site);
+					site_sent[id / 8] |= 1 << (id % 8);
+				}
+				frames_len += entry_frame(&frames[frames_len], id, e.timestamp, e.nargs, e.args);
+			}
+			end += ENTRY_HEADER_WORDS + e.nargs;
+		}
+		if (end == tail) {
+			// next entry is still being written
+			break;
+		}
+		if (redirect) {
+			uint32_t lost = lost_entries + undelivered;
+			if (lost != lost_reported) {
+				uint32_t diff = lost - lost_reported;
+				if (diff > UINT16_MAX) {
+					diff = UINT16_MAX;
+				}
+				frames[frames_len++] = LOG_FRAME_SYNC;
+				frames[frames_len++] = LOG_FRAME_LOST;
+				frames[frames_len++] = diff & 0xFF;
+				frames[frames_len++] = diff >> 8;
+			}
+			if (redirect(frames, frames_len)) {
+				lost_reported = lost;
+			} else {
+				// definitions have not been sent either
+				for (uint32_t pos = tail; pos != end; pos += ENTRY_HEADER_WORDS + e.nargs) {
+					read_entry(pos, e);
+					uint16_t id = site_id(e.site);
+					if (id < LOG_MAX_SITES) {
+						site_sent[id / 8] &= ~(1 << (id % 8));
+					}
+				}
+				if (ring_head - tail < LOG_RING_WORDS / 2) {
+					// receiver busy, try again with the next flush
+					break;
+				}
+				// Nobody seems to read the redirected data and the ring is filling up. Only write the text for these
+				// entries, the receiver is told about the gap later
+				for (uint32_t pos = tail; pos != end; pos += ENTRY_HEADER_WORDS + e.nargs) {
+					read_entry(pos, e);
+					undelivered++;
+				}
+			}
+		}
+		// output as text and release the entries
+		while (tail != end) {
+			read_entry(tail, e);
+			write_text(e.site, e.timestamp, e.args);
+			// Clear all words, not just the header: later entries may start at any of them and an old argument could
+			// look like a valid header
+			for (uint8_t i = 0; i < ENTRY_HEADER_WORDS + e.nargs; i++) {
+				ring[(tail + i) & RING_MASK] = 0;
+			}
+			tail += ENTRY_HEADER_WORDS + e.nargs;
+		}
+		__DMB();
+		ring_tail = tail;
+	}
+	flushing = 0;
 }
 
 /* Implemented directly here for speed reasons. Disable interrupt in CubeMX! */
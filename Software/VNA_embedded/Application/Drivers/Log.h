@@ -8,7 +8,10 @@ extern "C" {
 
 #define LOG_USART			2
 #define LOG_SENDBUF_LENGTH	1024
-//#define LOG_USE_MUTEX
+// size of the entry ring buffer, must be a power of two. Each entry needs 3 words plus one per argument
+#define LOG_RING_WORDS		128
+// highest number of call sites that can be identified on the host
+#define LOG_MAX_SITES		512
 
 #define LOG_LEVEL_DEBUG	4
 #define LOG_LEVEL_INFO	3
@@ -26,39 +29,98 @@ extern "C" {
 #define LOG_MODULE	"Log"
 #endif
 
+/*
+ * Log calls only store a pointer to the (constant) call site, a timestamp and the raw arguments in a ring buffer.
+ * This takes a few cycles and is safe in any context. Formatting and transmission is deferred to Log_Flush().
+ * Arguments are stored as 32 bit words: at most 8 integer/char arguments per call, no strings, 64 bit or
+ * floating point values. In C++ other arguments fail to compile.
+ */
+#include <stdint.h>
+
+typedef struct {
+	const char *module;
+	const char *level;
+	const char *fmt;
+} log_site_t;
+
+#define _LOG_NARGS(...)		_LOG_NARGS_(0, ## __VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+#ifdef __cplusplus
+/* rejects arguments that do not fit into a 32 bit word at compile time (C only checks the format at runtime) */
+#define _LOG_CHECK_ARGS(...) static_assert(decltype(_log_arg_types(__VA_ARGS__))::value, \
+		"log arguments must be at most 8 integers/chars of up to 32 bit (no strings, pointers, 64 bit or floats)")
+#else
+#define _LOG_CHECK_ARGS(...)
+#endif
+
+/* all call sites are collected in the .log_sites section, their index identifies them on the host */
+#define _LOG(lvl, fmt, ...) do { \
+	_LOG_CHECK_ARGS(__VA_ARGS__); \
+	static const log_site_t _log_site __attribute__((section(".log_sites"), used)) = {LOG_MODULE, lvl, fmt}; \
+	_log_write(&_log_site, _LOG_NARGS(__VA_ARGS__), ## __VA_ARGS__); \
+} while(0)
+
 #if LOG_LEVEL >= LOG_LEVEL_CRIT
-#define LOG_CRIT(fmt, ...)		_log_write(LOG_MODULE, "CRT", fmt, ## __VA_ARGS__)
+#define LOG_CRIT(fmt, ...)		_LOG("CRT", fmt, ## __VA_ARGS__)
 #else
 #define LOG_CRIT(fmt, ...)
 #endif
 #if LOG_LEVEL >= LOG_LEVEL_ERR
-#define LOG_ERR(fmt, ...)		_log_write(LOG_MODULE, "ERR", fmt, ## __VA_ARGS__)
+#define LOG_ERR(fmt, ...)		_LOG("ERR", fmt, ## __VA_ARGS__)
 #else
 #define LOG_ERR(fmt, ...)
 #endif
 #if LOG_LEVEL >= LOG_LEVEL_WARN
-#define LOG_WARN(fmt, ...)		_log_write(LOG_MODULE, "WRN", fmt, ## __VA_ARGS__)
+#define LOG_WARN(fmt, ...)		_LOG("WRN", fmt, ## __VA_ARGS__)
 #else
 #define LOG_WARN(fmt, ...)
 #endif
 #if LOG_LEVEL >= LOG_LEVEL_INFO
-#define LOG_INFO(fmt, ...)		_log_write(LOG_MODULE, "INF", fmt, ## __VA_ARGS__)
+#define LOG_INFO(fmt, ...)		_LOG("INF", fmt, ## __VA_ARGS__)
 #else
 #define LOG_INFO(fmt, ...)
 #endif
 #if LOG_LEVEL >= LOG_LEVEL_DEBUG
-#define LOG_DEBUG(fmt, ...)		_log_write(LOG_MODULE, "DBG", fmt, ## __VA_ARGS__)
+#define LOG_DEBUG(fmt, ...)		_LOG("DBG", fmt, ## __VA_ARGS__)
 #else
 #define LOG_DEBUG(fmt, ...)
 #endif
 
-#include <stdint.h>
+/*
+ * Binary format passed to the redirect function (little endian). Every frame starts with LOG_FRAME_SYNC:
+ * - LOG_FRAME_SITE:    uint16 id, uint8 length, "module\0level\0fmt" (length bytes). Sent before the first entry of
+ *                      a site and again after Log_ResendSites()
+ * - LOG_FRAME_ENTRY:   uint16 id, uint8 number of arguments, uint32 timestamp (ms), uint32 arguments
+ * - LOG_FRAME_LOST:    uint16 number of entries that could not be stored or transmitted
+ */
+#define LOG_FRAME_SYNC		0xA5
+#define LOG_FRAME_SITE		0x01
+#define LOG_FRAME_ENTRY		0x02
+#define LOG_FRAME_LOST		0x03
 
 void Log_Init();
-typedef void (*log_redirect_t)(const char *line, uint16_t length);
+/* Returns false if the data could not be accepted yet, it is offered again with the next flush */
+typedef bool (*log_redirect_t)(const uint8_t *data, uint16_t length);
 void Log_SetRedirect(log_redirect_t redirect_function);
-void _log_write(const char *module, const char *level, const char *fmt, ...);
+/* Formats/transmits the stored entries, must not be called from interrupts */
+void Log_Flush();
+/* The receiver of the redirected data lost the site definitions (e.g. host reconnected) */
+void Log_ResendSites();
+void _log_write(const log_site_t *site, uint8_t nargs, ...);
 
 #ifdef __cplusplus
 }
+
+#include <type_traits>
+
+template<typename... T> struct _log_args_valid;
+template<> struct _log_args_valid<> : std::true_type {};
+template<typename T, typename... R> struct _log_args_valid<T, R...> : std::integral_constant<bool,
+		(std::is_integral<T>::value || std::is_enum<T>::value) && sizeof(T) <= sizeof(uint32_t)
+		&& _log_args_valid<R...>::value> {};
+
+/* only used in unevaluated context, arguments are taken by value so arrays decay and bit fields work */
+template<typename... T> std::integral_constant<bool, sizeof...(T) <= 8 && _log_args_valid<T...>::value>
+	_log_arg_types(T...);
 #endif
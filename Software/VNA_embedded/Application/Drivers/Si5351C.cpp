@@ -1,14 +1,22 @@
 #include "Si5351C.hpp"
 
 #include <cmath>
+#include <cstring>
+#include "algorithm.hpp"
 
 #define LOG_LEVEL	LOG_LEVEL_DEBUG
 #define LOG_MODULE	"SI5351"
 #include "Log.h"
 
+// Only one DMA transfer can be active on the bus, its completion is reported through the HAL callbacks
+static Si5351C *transferDevice;
+static Si5351C::TransferCallback transferCallback;
+
 bool Si5351C::Init(uint32_t clkin_freq) {
 	bool success = true;
 	FreqCLKINDiv = 0;
+	// register content is unknown until written or read once
+	memset(shadowValid, 0, sizeof(shadowValid));
 
 	// Disable OEB pin functionality
 	success &= WriteRegister(Reg::OEBPinMask, 0xFF);
@@ -75,6 +83,29 @@ bool Si5351C::SetPLL(PLL pll, uint32_t frequency, PLLSource src) {
 
 bool Si5351C::SetCLK(uint8_t clknum, uint32_t frequency, PLL source, DriveStrength strength, uint32_t PLLFreqOverride) {
 	ClkConfig c;
+	if (!CalculateCLKConfig(c, clknum, frequency, source, strength, PLLFreqOverride)) {
+		return false;
+	}
+	LOG_DEBUG("Setting CLK%d to %luHz", clknum, frequency);
+	return WriteClkConfig(c, clknum);
+}
+
+bool Si5351C::CalculateRawCLKConfig(uint8_t clknum, uint32_t frequency, PLL source, uint8_t *config,
+		uint32_t PLLFreqOverride) {
+	if (clknum > 5) {
+		LOG_ERR("No raw configuration block for CLK%d", clknum);
+		return false;
+	}
+	ClkConfig c;
+	if (!CalculateCLKConfig(c, clknum, frequency, source, DriveStrength::mA2, PLLFreqOverride)) {
+		return false;
+	}
+	EncodeMultisynth(c, config);
+	return true;
+}
+
+bool Si5351C::CalculateCLKConfig(ClkConfig &c, uint8_t clknum, uint32_t frequency, PLL source,
+		DriveStrength strength, uint32_t PLLFreqOverride) {
 	c.DivideBy4 = false;
 	c.IntegerMode = false;
 	c.Inverted = false;
@@ -114,8 +145,7 @@ bool Si5351C::SetCLK(uint8_t clknum, uint32_t frequency, PLL source, DriveStreng
 		}
 		FindOptimalDivider(pllFreq, frequency * c.RDiv, c.P1, c.P2, c.P3);
 	}
-	LOG_DEBUG("Setting CLK%d to %luHz", clknum, frequency);
-	return WriteClkConfig(c, clknum);
+	return true;
 }
 
 bool Si5351C::SetCLKtoXTAL(uint8_t clknum) {
@@ -181,12 +211,6 @@ bool Si5351C::WritePLLConfig(PLLConfig config, PLL pll) {
 	// Reset the PLL
 	mask = pll == PLL::A ? 0x20 : 0x80;
 	//success &=SetBits(Reg::PLLReset, mask);
-	reg = pll == PLL::A ? Reg::MSNA_CONFIG : Reg::MSNB_CONFIG;
-	for(uint8_t i=0;i<8;i++) {
-		uint8_t readback;
-		ReadRegister((Reg)((int)reg + i), &readback);
-		LOG_DEBUG("PLL readback %d: 0x%02x", i, readback);
-	}
 
 	return success;
 }
@@ -232,15 +256,7 @@ bool Si5351C::WriteClkConfig(ClkConfig config, uint8_t clknum) {
 	success &= WriteRegister(reg, clkcontrol);
 	if (clknum <= 5) {
 		uint8_t ClkData[8];
-		ClkData[0] = (config.P3 >> 8) & 0xFF;
-		ClkData[1] = config.P3 & 0xFF;
-		ClkData[2] = (31 - __builtin_clz(config.RDiv)) << 4
-				| (config.DivideBy4 ? 0xC0 : 0x00) | ((config.P1 >> 16) & 0x03);
-		ClkData[3] = (config.P1 >> 8) & 0xFF;
-		ClkData[4] = config.P1 & 0xFF;
-		ClkData[5] = ((config.P3 >> 12) & 0xF0) | ((config.P2 >> 16) & 0x0F);
-		ClkData[6] = (config.P2 >> 8) & 0xFF;
-		ClkData[7] = config.P2 & 0xFF;
+		EncodeMultisynth(config, ClkData);
 		// Calculate address of register control block
 		reg = (Reg) ((int) Reg::MS0_CONFIG + 8 * clknum);
 		success &= WriteRegisterRange(reg, ClkData, sizeof(ClkData));
@@ -253,13 +269,25 @@ bool Si5351C::WriteClkConfig(ClkConfig config, uint8_t clknum) {
 	return success;
 }
 
+void Si5351C::EncodeMultisynth(const ClkConfig &config, uint8_t *data) {
+	// See register map in https://www.silabs.com/documents/public/application-notes/AN619.pdf (page 11)
+	data[0] = (config.P3 >> 8) & 0xFF;
+	data[1] = config.P3 & 0xFF;
+	data[2] = (31 - __builtin_clz(config.RDiv)) << 4
+			| (config.DivideBy4 ? 0xC0 : 0x00) | ((config.P1 >> 16) & 0x03);
+	data[3] = (config.P1 >> 8) & 0xFF;
+	data[4] = config.P1 & 0xFF;
+	data[5] = ((config.P3 >> 12) & 0xF0) | ((config.P2 >> 16) & 0x0F);
+	data[6] = (config.P2 >> 8) & 0xFF;
+	data[7] = config.P2 & 0xFF;
+}
+
 bool Si5351C::WriteRegister(Reg reg, uint8_t data) {
 	return WriteRegisterRange(reg, &data, 1);
 }
 
 bool Si5351C::ReadRegister(Reg reg, uint8_t *data) {
-	return HAL_I2C_Mem_Read(i2c, address, (int) reg,
-	I2C_MEMADD_SIZE_8BIT, data, 1, 100) == HAL_OK;
+	return ReadRegisterRange(reg, data, 1);
 }
 
 bool Si5351C::SetBits(Reg reg, uint8_t bits) {
@@ -281,8 +309,15 @@ bool Si5351C::ClearBits(Reg reg, uint8_t bits) {
 }
 
 bool Si5351C::WriteRegisterRange(Reg start, const uint8_t *data, uint8_t len) {
-	return HAL_I2C_Mem_Write(i2c, address, (int) start,
-	I2C_MEMADD_SIZE_8BIT, (uint8_t*) data, len, 100) == HAL_OK;
+	uint8_t first, last;
+	if (!ChangedRange(start, data, len, first, last)) {
+		// device already contains the data
+		return true;
+	}
+	bool success = HAL_I2C_Mem_Write(i2c, address, (int) start + first,
+	I2C_MEMADD_SIZE_8BIT, (uint8_t*) &data[first], last - first, 100) == HAL_OK;
+	UpdateShadow((int) start + first, &data[first], last - first, success);
+	return success;
 }
 
 bool Si5351C::ExtCLKAvailable() {
@@ -297,8 +332,65 @@ bool Si5351C::ExtCLKAvailable() {
 }
 
 bool Si5351C::ReadRegisterRange(Reg start, uint8_t *data, uint8_t len) {
-	return HAL_I2C_Mem_Read(i2c, address, (int) start,
+	bool cached = true;
+	for (uint8_t i = 0; i < len; i++) {
+		if (!ShadowValid((int) start + i)) {
+			cached = false;
+			break;
+		}
+	}
+	if (cached) {
+		memcpy(data, &shadow[(int) start], len);
+		return true;
+	}
+	bool success = HAL_I2C_Mem_Read(i2c, address, (int) start,
 	I2C_MEMADD_SIZE_8BIT, data, len, 100) == HAL_OK;
+	UpdateShadow((int) start, data, len, success);
+	return success;
+}
+
+bool Si5351C::Cacheable(uint8_t reg) {
+	// status registers and the self clearing PLL reset always access the device
+	return reg != (int) Reg::DeviceStatus && reg != (int) Reg::InterruptStatusSticky && reg != (int) Reg::PLLReset
+			&& reg < ShadowSize;
+}
+
+bool Si5351C::ShadowValid(uint8_t reg) {
+	return Cacheable(reg) && (shadowValid[reg / 8] & (1 << (reg % 8)));
+}
+
+void Si5351C::UpdateShadow(uint8_t reg, const uint8_t *data, uint8_t len, bool valid) {
+	for (uint8_t i = 0; i < len; i++, reg++) {
+		if (!Cacheable(reg)) {
+			continue;
+		}
+		if (valid) {
+			shadow[reg] = data[i];
+			shadowValid[reg / 8] |= 1 << (reg % 8);
+		} else {
+			shadowValid[reg / 8] &= ~(1 << (reg % 8));
+		}
+	}
+}
+
+bool Si5351C::ChangedRange(Reg start, const uint8_t *data, uint8_t len, uint8_t &first, uint8_t &last) {
+	auto unchanged = [&](uint8_t i) {
+		uint8_t reg = (int) start + i;
+		return ShadowValid(reg) && shadow[reg] == data[i];
+	};
+	first = 0;
+	while (first < len && unchanged(first)) {
+		first++;
+	}
+	if (first == len) {
+		return false;
+	}
+	// unchanged bytes in between are written as well, one transfer is cheaper than several
+	last = len;
+	while (unchanged(last - 1)) {
+		last--;
+	}
+	return true;
 }
 
 bool Si5351C::ResetPLL(PLL pll) {
@@ -312,28 +404,13 @@ bool Si5351C::ResetPLL(PLL pll) {
 void Si5351C::FindOptimalDivider(uint32_t f_pll, uint32_t f, uint32_t &P1,
 		uint32_t &P2, uint32_t &P3) {
 	// see https://www.silabs.com/documents/public/application-notes/AN619.pdf (page 3/6)
-	uint32_t a = f_pll / f;
-	int32_t f_rem = f_pll - f * a;
-	uint32_t best_b, best_c;
-	uint32_t best_deviation = UINT32_MAX;
-	for (uint32_t c = (1UL << 20) - 1; c >= (1UL << 19); c--) {
-		uint32_t guess_b = (uint64_t) f_rem * c / f;
-		for (uint32_t b = guess_b; b <= guess_b + 1; b++) {
-			int32_t f_div = (uint64_t) f * b / c;
-			uint32_t deviation = abs(f_rem - f_div);
-			if (deviation < best_deviation) {
-				best_b = b;
-				best_c = c;
-				best_deviation = deviation;
-				if (deviation == 0) {
-					break;
-				}
-			}
-		}
-		if (best_deviation == 0) {
-			break;
-		}
-	}
+	// a + b/c with c limited to 20 bits
+	auto divider = Algorithm::BestFractionalDivider(f_pll, f, (1UL << 20) - 1);
+	uint32_t a = divider.integer;
+	uint32_t best_b = divider.num;
+	uint32_t best_c = divider.denom;
+	uint64_t f_div = (uint64_t) f * a + (uint64_t) f * best_b / best_c;
+	uint32_t best_deviation = f_div > f_pll ? f_div - f_pll : f_pll - f_div;
 	LOG_DEBUG(
 			"Optimal divider for %luHz/%luHz is: a=%lu, b=%lu, c=%lu (%luHz deviation)",
 			f_pll, f, a, best_b, best_c, best_deviation);
@@ -351,10 +428,90 @@ bool Si5351C::WriteRawCLKConfig(uint8_t clknum, const uint8_t *config) {
 	return WriteRegisterRange(reg, config, 8);
 }
 
+bool Si5351C::WriteRawCLKConfigDMA(uint8_t clknum, const uint8_t *config, TransferCallback cb) {
+	auto reg = (Reg) ((int) Reg::MS0_CONFIG + 8 * clknum);
+	return WriteRegisterRangeDMA(reg, config, 8, cb);
+}
+
+bool Si5351C::SetOutputDMA(uint8_t clknum, bool enabled, TransferCallback cb) {
+	if (transferCallback || !ShadowValid((int) Reg::OutputEnableControl)) {
+		// busy or the state of the other outputs is unknown
+		return false;
+	}
+	outputEnable = shadow[(int) Reg::OutputEnableControl];
+	if (enabled) {
+		outputEnable &= ~(1 << clknum);
+	} else {
+		outputEnable |= 1 << clknum;
+	}
+	return WriteRegisterRangeDMA(Reg::OutputEnableControl, &outputEnable, 1, cb);
+}
+
+bool Si5351C::WriteRegisterRangeDMA(Reg start, const uint8_t *data, uint8_t len, TransferCallback cb) {
+	if (transferCallback) {
+		// previous transfer still active
+		return false;
+	}
+	uint8_t first, last;
+	if (!ChangedRange(start, data, len, first, last)) {
+		// nothing to transfer
+		cb(true);
+		return true;
+	}
+	transferDevice = this;
+	transferCallback = cb;
+	transferReg = (int) start + first;
+	transferData = &data[first];
+	transferLen = last - first;
+	// content is unknown until the transfer has completed
+	UpdateShadow(transferReg, transferData, transferLen, false);
+	if (HAL_I2C_Mem_Write_DMA(i2c, address, transferReg, I2C_MEMADD_SIZE_8BIT, (uint8_t*) transferData,
+			transferLen) != HAL_OK) {
+		transferCallback = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void Si5351C::AbortTransfer() {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool active = transferCallback != nullptr;
+	transferCallback = nullptr;
+	__set_PRIMASK(primask);
+	if (!active) {
+		return;
+	}
+	// restart the peripheral, the registers of the transfer stay unknown
+	HAL_I2C_DeInit(i2c);
+	HAL_I2C_Init(i2c);
+}
+
 bool Si5351C::ReadRawCLKConfig(uint8_t clknum, uint8_t *config) {
 	// Calculate address of register control block
 	auto reg = (Reg) ((int) Reg::MS0_CONFIG + 8 * clknum);
 	return ReadRegisterRange(reg, config, 8);
 }
 
+void Si5351C::TransferComplete(bool success) {
+	UpdateShadow(transferReg, transferData, transferLen, success);
+	auto cb = transferCallback;
+	transferCallback = nullptr;
+	cb(success);
+}
 
+static void TransferComplete(I2C_HandleTypeDef *hi2c, bool success) {
+	if (!transferCallback || hi2c != transferDevice->GetI2C()) {
+		return;
+	}
+	transferDevice->TransferComplete(success);
+}
+
+extern "C" {
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	TransferComplete(hi2c, true);
+}
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
+	TransferComplete(hi2c, false);
+}
+}
@@ -27,8 +27,17 @@ public:
 		oeb_pin(oeb_pin),
 		FreqPLL{},
 		FreqXTAL(XTAL_freq),
-		FreqCLKINDiv(0) {
+		FreqCLKINDiv(0),
+		shadow{},
+		shadowValid{},
+		transferReg(0),
+		transferData(nullptr),
+		transferLen(0),
+		outputEnable(0xFF) {
 	};
+	// called from interrupt context when a DMA transfer has finished
+	using TransferCallback = void(*)(bool success);
+
 	bool Init(uint32_t clkin_freq = 0);
 	bool ConfigureCLKIn(uint32_t clkin_freq);
 	bool SetPLL(PLL pll, uint32_t frequency, PLLSource src);
@@ -45,6 +54,19 @@ public:
 	// config has to point to a buffer containing at least 8 bytes
 	bool WriteRawCLKConfig(uint8_t clknum, const uint8_t *config);
 	bool ReadRawCLKConfig(uint8_t clknum, uint8_t *config);
+	// Calculates the configuration block of CLK0-5 without accessing the device
+	bool CalculateRawCLKConfig(uint8_t clknum, uint32_t frequency, PLL source, uint8_t *config, uint32_t PLLFreqOverride = 0);
+	// Non-blocking version of WriteRawCLKConfig, config must stay valid until the callback has been called
+	bool WriteRawCLKConfigDMA(uint8_t clknum, const uint8_t *config, TransferCallback cb);
+	// Non-blocking version of Enable/Disable. Requires a known output enable register (any previous Enable/Disable)
+	bool SetOutputDMA(uint8_t clknum, bool enabled, TransferCallback cb);
+	// Gives up on an active DMA transfer that did not complete, its callback is not called anymore
+	void AbortTransfer();
+	// Completion of the DMA transfer, only used by the HAL I2C callbacks
+	void TransferComplete(bool success);
+	I2C_HandleTypeDef* GetI2C() const {
+		return i2c;
+	}
 private:
 	void FindOptimalDivider(uint32_t f_pll, uint32_t f, uint32_t &P1, uint32_t &P2, uint32_t &P3);
 	enum class Reg : uint8_t {
@@ -104,6 +126,9 @@ private:
 		bool Inverted;
 		DriveStrength strength;
 	};
+	bool CalculateCLKConfig(ClkConfig &c, uint8_t clknum, uint32_t frequency, PLL source, DriveStrength strength,
+			uint32_t PLLFreqOverride);
+	static void EncodeMultisynth(const ClkConfig &config, uint8_t *data);
 	bool WriteClkConfig(ClkConfig config, uint8_t clknum);
 
 	static constexpr uint8_t address = 0xC0;
@@ -112,7 +137,16 @@ private:
 	bool SetBits(Reg reg, uint8_t bits);
 	bool ClearBits(Reg reg, uint8_t bits);
 	bool WriteRegisterRange(Reg start, const uint8_t *data, uint8_t len);
+	bool WriteRegisterRangeDMA(Reg start, const uint8_t *data, uint8_t len, TransferCallback cb);
 	bool ReadRegisterRange(Reg start, uint8_t *data, uint8_t len);
+
+	// Register shadow, reads are answered from it and writes only transfer the bytes that differ
+	static constexpr uint8_t ShadowSize = (uint8_t) Reg::FanoutEnable + 1;
+	static bool Cacheable(uint8_t reg);
+	bool ShadowValid(uint8_t reg);
+	void UpdateShadow(uint8_t reg, const uint8_t *data, uint8_t len, bool valid);
+	// Range [first, last) of data that differs from the shadow, false if nothing differs
+	bool ChangedRange(Reg start, const uint8_t *data, uint8_t len, uint8_t &first, uint8_t &last);
 	I2C_HandleTypeDef *i2c;
 	GPIO_InitTypeDef *intr_gpio;
 	uint16_t intr_pin;
@@ -120,4 +154,12 @@ private:
 	uint16_t oeb_pin;
 	uint32_t FreqPLL[2];
 	uint32_t FreqXTAL, FreqCLKINDiv;
+	uint8_t shadow[ShadowSize];
+	uint8_t shadowValid[(ShadowSize + 7) / 8];
+	// active DMA transfer
+	uint8_t transferReg;
+	const uint8_t *transferData;
+	uint8_t transferLen;
+	// source of the output enable transfer
+	uint8_t outputEnable;
 };
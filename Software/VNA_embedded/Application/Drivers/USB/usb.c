@@ -20,6 +20,19 @@ static uint8_t usb_receive_buffer[1024];
 static bool data_transmission_active = false;
 static bool log_transmission_active = true;
 
+// Transmit queue of the data endpoint. Frames are appended by usb_transmit, the USB interrupt sends
+// everything that has been queued and chains the next transfer as soon as the previous one is complete.
+// Indices are free running (queue size must be a power of two), tx_write is only modified by usb_transmit,
+// tx_read only by the USB interrupt.
+#define TX_QUEUE_SIZE			2048
+// The last part of the queue is only available to usb_transmit_reserved, datapoints can not crowd out the responses
+#define TX_RESERVED				64
+static uint8_t tx_queue[TX_QUEUE_SIZE];
+static volatile uint16_t tx_read = 0;
+static volatile uint16_t tx_write = 0;
+static uint16_t tx_transfer_len = 0;
+static usb_tx_statistics_t tx_stats;
+
 USBD_ClassTypeDef  USBD_ClassDriver =
 {
   USBD_Class_Init,
@@ -103,8 +116,35 @@ __ALIGN_BEGIN uint8_t USBD_CfgFSDesc[USB_CONFIG_DESC_SIZ] __ALIGN_END =
   0x00                              /* bInterval */
 };
 
+static void start_data_transfer() {
+	// only called with data in the queue and no transfer in progress
+	uint16_t used = tx_write - tx_read;
+	uint16_t offset = tx_read % TX_QUEUE_SIZE;
+	uint16_t len = TX_QUEUE_SIZE - offset;
+	if(len > used) {
+		len = used;
+	}
+	if(len > USB_FS_MAX_PACKET_SIZE) {
+		// only send complete packets, the remaining bytes go out with the next transfer
+		// (together with anything that has been queued in the meantime)
+		len -= len % USB_FS_MAX_PACKET_SIZE;
+	}
+	tx_transfer_len = len;
+	data_transmission_active = true;
+	hUsbDeviceFS.ep_in[EP_DATA_IN_ADDRESS & 0x7F].total_length = len;
+	USBD_LL_Transmit(&hUsbDeviceFS, EP_DATA_IN_ADDRESS, &tx_queue[offset], len);
+}
+
+static void reset_data_queue() {
+	// anything still queued belongs to the previous connection
+	tx_read = tx_write;
+	tx_transfer_len = 0;
+	data_transmission_active = false;
+}
+
 static uint8_t  USBD_Class_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
+	reset_data_queue();
 	// Open endpoints and start reception
 	USBD_LL_OpenEP(pdev, EP_DATA_IN_ADDRESS, USBD_EP_TYPE_BULK, USB_FS_MAX_PACKET_SIZE);
 	USBD_LL_OpenEP(pdev, EP_DATA_OUT_ADDRESS, USBD_EP_TYPE_BULK, USB_FS_MAX_PACKET_SIZE);
@@ -118,9 +158,20 @@ static uint8_t  USBD_Class_DeInit(USBD_HandleTypeDef *pdev,
   USBD_LL_CloseEP(pdev, EP_DATA_IN_ADDRESS);
   USBD_LL_CloseEP(pdev, EP_DATA_OUT_ADDRESS);
   USBD_LL_CloseEP(pdev, EP_LOG_IN_ADDRESS);
+  reset_data_queue();
   return USBD_OK;
 }
 static uint8_t USBD_Class_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+	if(epnum == (EP_DATA_IN_ADDRESS & 0x7F)) {
+		// data of the completed transfer is no longer needed
+		tx_read += tx_transfer_len;
+		tx_transfer_len = 0;
+		if(tx_write != tx_read) {
+			// more frames have been queued, continue right away
+			start_data_transfer();
+			return USBD_OK;
+		}
+	}
 	// A bulk transfer is complete when the endpoint does on of the following:
 	// - Has transferred exactly the amount of data expected
 	// - Transfers a packet with a payload size less than wMaxPacketSize or transfers a zero-length packet
@@ -165,30 +216,73 @@ void usb_init(usbd_callback_t callback) {
 	HAL_NVIC_EnableIRQ(USB_IRQn);
 }
 
-bool usb_transmit(const uint8_t *data, uint16_t length) {
+static bool transmit(const uint8_t *data, uint16_t length, uint16_t reserved) {
 	static bool first = true;
 	if(first) {
 		log_transmission_active = false;
 		first = false;
 	}
-	if(!data_transmission_active) {
-		data_transmission_active = true;
-		hUsbDeviceFS.ep_in[EP_DATA_IN_ADDRESS & 0x7F].total_length = length;
-		return USBD_LL_Transmit(&hUsbDeviceFS, EP_DATA_IN_ADDRESS, (uint8_t*) data, length) == USBD_OK;
-	} else {
-		// already have an ongoing transmission
+	if(hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED || length == 0) {
+		// no host connected
+		return false;
+	}
+	uint16_t used = tx_write - tx_read;
+	if(length + reserved > TX_QUEUE_SIZE - used) {
+		// not enough space, drop the complete frame
+		tx_stats.dropped++;
 		return false;
 	}
+	// The free part of the queue is not accessed by the interrupt, copy without locking
+	uint16_t offset = tx_write % TX_QUEUE_SIZE;
+	uint16_t first_chunk = TX_QUEUE_SIZE - offset;
+	if(first_chunk > length) {
+		first_chunk = length;
+	}
+	memcpy(&tx_queue[offset], data, first_chunk);
+	memcpy(tx_queue, &data[first_chunk], length - first_chunk);
+	used += length;
+	if(used > tx_stats.high_water) {
+		tx_stats.high_water = used;
+	}
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	tx_write += length;
+	if(!data_transmission_active) {
+		start_data_transfer();
+	}
+	__set_PRIMASK(primask);
+	return true;
+}
+
+bool usb_transmit(const uint8_t *data, uint16_t length) {
+	return transmit(data, length, TX_RESERVED);
 }
 
-void usb_log(const char *log, uint16_t length) {
+bool usb_transmit_reserved(const uint8_t *data, uint16_t length) {
+	return transmit(data, length, 0);
+}
+
+void usb_get_tx_statistics(usb_tx_statistics_t *stats) {
+	*stats = tx_stats;
+}
+
+bool usb_log(const uint8_t *log, uint16_t length) {
+	if(hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED) {
+		// no host connected, discard
+		return true;
+	}
 	if(!log_transmission_active) {
 		static uint8_t buffer[256];
+		if(length > sizeof(buffer)) {
+			length = sizeof(buffer);
+		}
 		memcpy(buffer, log, length);
 		log_transmission_active = true;
 		hUsbDeviceFS.ep_in[EP_LOG_IN_ADDRESS & 0x7F].total_length = length;
 		USBD_LL_Transmit(&hUsbDeviceFS, EP_LOG_IN_ADDRESS, buffer, length);
+		return true;
 	} else {
-		// still busy, unable to send log
+		// still busy
+		return false;
 	}
 }
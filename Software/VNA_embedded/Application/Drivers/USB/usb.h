@@ -17,9 +17,18 @@ extern "C" {
 
 typedef void(*usbd_callback_t)(const uint8_t *buf, uint16_t len);
 
+typedef struct {
+	uint16_t high_water;	// maximum number of bytes waiting in the transmit queue
+	uint32_t dropped;		// frames that did not fit into the transmit queue
+} usb_tx_statistics_t;
+
 void usb_init(usbd_callback_t callback);
+// Queues data for the data endpoint, returns false if it does not fit into the transmit queue
 bool usb_transmit(const uint8_t *data, uint16_t length);
-void usb_log(const char *log, uint16_t length);
+// Same, but may also use the part of the queue that is kept free for short control frames (command responses)
+bool usb_transmit_reserved(const uint8_t *data, uint16_t length);
+void usb_get_tx_statistics(usb_tx_statistics_t *stats);
+bool usb_log(const uint8_t *log, uint16_t length);
 
 
 #ifdef __cplusplus
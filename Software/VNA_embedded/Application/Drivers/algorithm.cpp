@@ -1,44 +1,71 @@
 #include "algorithm.hpp"
 
-#include "stm.hpp"
-#include <cmath>
+// |p/q - num/denom| scaled by q * denom
+static uint64_t Deviation(uint32_t p, uint32_t q, uint32_t num, uint32_t denom) {
+	uint64_t a = (uint64_t) p * denom;
+	uint64_t b = (uint64_t) q * num;
+	return a > b ? a - b : b - a;
+}
 
-Algorithm::RationalApproximation Algorithm::BestRationalApproximation(float ratio, uint32_t max_denom) {
+Algorithm::RationalApproximation Algorithm::BestRationalApproximation(uint32_t num, uint32_t denom, uint32_t max_denom) {
 	RationalApproximation result;
-	uint32_t a = 0, b = 1, c = 1, d = 1;
-	while (b + d <= max_denom) {
-		auto mediant = (float) (a + c) / (b + d);
-		if (ratio == mediant) {
-			if (b + d <= max_denom) {
-				result.num = a + c;
-				result.denom = b + d;
-				return result;
-			} else if (d > b) {
-				result.num = c;
-				result.denom = d;
-				return result;
+	// the last two convergents, starting with 1/0 and 0/1
+	uint32_t p = 1, q = 0;
+	uint32_t p_prev = 0, q_prev = 1;
+	uint32_t n = num, d = denom;
+	while (d) {
+		uint32_t a = n / d;
+		if (q_prev + (uint64_t) a * q > max_denom) {
+			// The next convergent exceeds the maximum denominator. The best candidates are the current convergent
+			// and the largest semiconvergent that still fits
+			uint32_t t = (max_denom - q_prev) / q;
+			uint32_t p_semi = t * p + p_prev;
+			uint32_t q_semi = t * q + q_prev;
+			// compare |p_semi/q_semi - x| with |p/q - x| without division
+			if (t > 0 && Deviation(p_semi, q_semi, num, denom) * q < Deviation(p, q, num, denom) * q_semi) {
+				result.num = p_semi;
+				result.denom = q_semi;
 			} else {
-				result.num = a;
-				result.denom = b;
-				return result;
+				result.num = p;
+				result.denom = q;
 			}
-		} else if (ratio > mediant) {
-			a = a + c;
-			b = b + d;
-		} else {
-			c = a + c;
-			d = b + d;
+			return result;
 		}
+		uint32_t r = n - a * d;
+		n = d;
+		d = r;
+		uint32_t p_next = a * p + p_prev;
+		uint32_t q_next = a * q + q_prev;
+		p_prev = p;
+		q_prev = q;
+		p = p_next;
+		q = q_next;
+	}
+	// expansion terminated, the fraction is represented exactly
+	result.num = p;
+	result.denom = q;
+	return result;
+}
+
+Algorithm::FractionalDivider Algorithm::BestFractionalDivider(uint64_t num, uint32_t denom, uint32_t max_denom,
+		uint32_t min_denom) {
+	FractionalDivider result;
+	result.integer = num / denom;
+	uint32_t rem = num - (uint64_t) result.integer * denom;
+	auto approx = BestRationalApproximation(rem, denom, max_denom);
+	if (approx.num == approx.denom) {
+		// rounded up to the next integer
+		result.integer++;
+		approx.num = 0;
+		approx.denom = 1;
 	}
-	// check which of the two is the better solution
-	float dev_ab = (float) a / b - ratio;
-	float dev_cd = (float) c / d - ratio;
-	if(fabs(dev_cd) < fabs(dev_ab)) {
-		result.num = c;
-		result.denom = d;
-	} else {
-		result.num = a;
-		result.denom = b;
+	if (approx.denom < min_denom) {
+		// extend the fraction to the smallest allowed denominator
+		uint32_t scale = (min_denom + approx.denom - 1) / approx.denom;
+		approx.num *= scale;
+		approx.denom *= scale;
 	}
+	result.num = approx.num;
+	result.denom = approx.denom;
 	return result;
 }
@@ -9,6 +9,18 @@ using RationalApproximation = struct _rationalapproximation {
 	uint32_t denom;
 };
 
-RationalApproximation BestRationalApproximation(float ratio, uint32_t max_denom);
+// Closest fraction to num/denom with a denominator of at most max_denom (num/denom itself if possible).
+// Integer continued fraction expansion, the number of steps is logarithmic in max_denom
+RationalApproximation BestRationalApproximation(uint32_t num, uint32_t denom, uint32_t max_denom);
+
+using FractionalDivider = struct _fractionaldivider {
+	uint32_t integer;
+	uint32_t num;
+	uint32_t denom;
+};
+
+// Closest integer + num/denom to the divider num/denom (as used by fractional PLLs), with min_denom <= denom <= max_denom.
+// A fractional part that rounds up to 1 carries into the integer part
+FractionalDivider BestFractionalDivider(uint64_t num, uint32_t denom, uint32_t max_denom, uint32_t min_denom = 1);
 
 }
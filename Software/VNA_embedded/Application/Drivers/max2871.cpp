@@ -16,6 +16,7 @@ bool MAX2871::Init(uint32_t f_ref, bool doubler, uint16_t r, bool div2) {
 	for (uint8_t i = 0; i < 6; i++) {
 		regs[i] = 0;
 	}
+	writtenValid = 0;
 
 	ChipEnable(false);
 	RFEnable(false);
@@ -136,73 +137,40 @@ bool MAX2871::SetFrequency(uint64_t f) {
 	}
 	LOG_DEBUG("Setting frequency to %lu%06luHz...", (uint32_t ) (f / 1000000),
 			(uint32_t ) (f % 1000000));
-	// select divider
-	uint64_t f_vco = f;
-	uint8_t div = 0;
-	if (f < 46875000) {
-		div = 0x07;
-		f_vco *= 128;
-	} else if (f < 93750000) {
-		div = 0x06;
-		f_vco *= 64;
-	} else if (f < 187500000) {
-		div = 0x05;
-		f_vco *= 32;
-	} else if (f < 375000000) {
-		div = 0x04;
-		f_vco *= 16;
-	} else if (f < 750000000) {
-		div = 0x03;
-		f_vco *= 8;
-	} else if (f < 1500000000) {
-		div = 0x02;
-		f_vco *= 4;
-	} else if (f < 3000000000) {
-		div = 0x01;
-		f_vco *= 2;
-	}
+	auto band = GetBand(f);
+	uint64_t f_vco = band.f_vco;
+	uint8_t div = band.divider;
 	LOG_DEBUG("F_VCO: %lu%06luHz",
 			(uint32_t ) (f_vco / 1000000), (uint32_t ) (f_vco % 1000000));
 	if (gotVCOMap) {
 		// manual VCO selection for lock time improvement
-		uint16_t compare = f_vco / 100000;
-		uint8_t vco = 0;
-		for (; vco < 64; vco++) {
-			if (VCOmax[vco] >= compare) {
-				break;
-			}
-		} LOG_DEBUG("Manually selected VCO %d", vco);
+		LOG_DEBUG("Manually selected VCO %d", band.vco);
 		regs[3] &= ~0xFC000000;
-		regs[3] |= (uint32_t) vco << 26;
+		regs[3] |= (uint32_t) band.vco << 26;
 	}
-	uint16_t N = f_vco / f_PFD;
-	if (N < 19 || N > 4091) {
-		LOG_ERR("Invalid N value, should be between 19 and 4091, got %lu", N);
+	LOG_DEBUG("Looking for best fractional match");
+	// fractional modulus M must be at least 2
+	auto divider = Algorithm::BestFractionalDivider(f_vco, f_PFD, 4095, 2);
+	if (divider.integer < 19 || divider.integer > 4091) {
+		LOG_ERR("Invalid N value, should be between 19 and 4091, got %lu", divider.integer);
 		return false;
 	}
-	uint32_t rem_f = f_vco - N * f_PFD;
-	LOG_DEBUG("Remaining fractional frequency: %lu", rem_f);
-	LOG_DEBUG("Looking for best fractional match");
-	float fraction = (float) rem_f / f_PFD;
-
-	auto approx = Algorithm::BestRationalApproximation(fraction, 4095);
+	uint16_t N = divider.integer;
 
-	int32_t rem_approx = ((uint64_t) f_PFD * approx.num) / approx.denom;
-	if(rem_approx != rem_f) {
+	uint64_t f_set = (uint64_t) N * f_PFD + ((uint64_t) f_PFD * divider.num) / divider.denom;
+	if (f_set != f_vco) {
 		LOG_WARN("Best match is F=%u/M=%u, deviation of %luHz",
-				approx.num, approx.denom, abs(rem_f - rem_approx));
+				divider.num, divider.denom, (uint32_t) (f_set > f_vco ? f_set - f_vco : f_vco - f_set));
 	}
-
-	uint64_t f_set = (uint64_t) N * f_PFD + (f_PFD * approx.num) / approx.denom;
 	f_set /= (1UL << div);
 
 	// write values to registers
 	regs[4] &= ~0x00700000;
 	regs[4] |= ((uint32_t) div << 20);
 	regs[0] &= ~0x7FFFFFF8;
-	regs[0] |= ((uint32_t) N << 15) | ((uint32_t) approx.num << 3);
+	regs[0] |= ((uint32_t) N << 15) | ((uint32_t) divider.num << 3);
 	regs[1] &= ~0x00007FF8;
-	regs[1] |= ((uint32_t) approx.denom << 3);
+	regs[1] |= ((uint32_t) divider.denom << 3);
 
 	LOG_DEBUG("Set frequency to %lu%06luHz...",
 			(uint32_t ) (f_set / 1000000), (uint32_t ) (f_set % 1000000));
@@ -210,6 +178,26 @@ bool MAX2871::SetFrequency(uint64_t f) {
 	return true;
 }
 
+MAX2871::Band MAX2871::GetBand(uint64_t f) const {
+	Band b;
+	// select divider, the VCO runs from 3GHz upwards
+	b.divider = 0;
+	while (b.divider < 7 && (f << b.divider) < 3000000000) {
+		b.divider++;
+	}
+	b.f_vco = f << b.divider;
+	b.vco = 0;
+	if (gotVCOMap) {
+		uint16_t compare = b.f_vco / 100000;
+		for (; b.vco < 64; b.vco++) {
+			if (VCOmax[b.vco] >= compare) {
+				break;
+			}
+		}
+	}
+	return b;
+}
+
 bool MAX2871::SetReference(uint32_t f_ref, bool doubler, uint16_t r,
 		bool div2) {
 	if (f_ref < 10000000) {
@@ -280,19 +268,25 @@ bool MAX2871::SetReference(uint32_t f_ref, bool doubler, uint16_t r,
 }
 
 void MAX2871::Update() {
-	Write(5, regs[5]);
-	Write(4, regs[4]);
-	Write(3, regs[3]);
-	Write(2, regs[2]);
-	Write(1, regs[1]);
-	Write(0, regs[0]);
+	UpdateRegisters(0x3F);
 }
 
 void MAX2871::UpdateFrequency() {
-	Write(4, regs[4]);
-	Write(3, regs[3]);
-	Write(1, regs[1]);
-	Write(0, regs[0]);
+	UpdateRegisters(0x1B);
+}
+
+void MAX2871::UpdateRegisters(uint8_t mask) {
+	bool changed = false;
+	for (int8_t i = 5; i >= 0; i--) {
+		if (!(mask & (1 << i))) {
+			continue;
+		}
+		// register 0 latches the new settings, it is written whenever any other register changed
+		if (!(writtenValid & (1 << i)) || written[i] != regs[i] || (i == 0 && changed)) {
+			Write(i, regs[i]);
+			changed = true;
+		}
+	}
 }
 
 void MAX2871::Write(uint8_t reg, uint32_t val) {
@@ -305,6 +299,8 @@ void MAX2871::Write(uint8_t reg, uint32_t val) {
 	LE->BSRR = LEpin;
 	Delay::us(1);
 	LE->BSRR = LEpin << 16;
+	written[reg] = val;
+	writtenValid |= 1 << reg;
 }
 
 // Assumes that the MUX pin is already configured as "Read register 6" and connected to MISO
@@ -323,6 +319,11 @@ uint32_t MAX2871::Read() {
 	return result;
 }
 
+void MAX2871::SetVCOMap(const uint16_t *map) {
+	memcpy(VCOmax, map, sizeof(VCOmax));
+	gotVCOMap = true;
+}
+
 bool MAX2871::BuildVCOMap() {
 	memset(VCOmax, 0, sizeof(VCOmax));
 	// save output frequency
@@ -381,6 +382,42 @@ bool MAX2871::BuildVCOMap() {
 	return true;
 }
 
+bool MAX2871::MeasureLockTime(uint32_t timeout_us, uint32_t &lock_us) {
+	// set MUX to LD
+	regs[2] &= ~(7UL << 26);
+	regs[5] &= ~(1UL << 18);
+	regs[2] |= (6UL << 26);
+	Write(5, regs[5]);
+	Write(2, regs[2]);
+	UpdateFrequency();
+	// based on the DWT cycle counter, independent of the timer used by Delay
+	uint32_t cyclesPerUs = SystemCoreClock / 1000000;
+	uint32_t start = DWT->CYCCNT;
+	bool locked = true;
+	lock_us = 0;
+	// the lock detect needs a few PFD cycles to notice the new frequency, tiny steps might not unlock at all
+	while (MUX->IDR & MUXpin) {
+		if (DWT->CYCCNT - start > 10 * cyclesPerUs) {
+			break;
+		}
+	}
+	if (!(MUX->IDR & MUXpin)) {
+		while (!(MUX->IDR & MUXpin)) {
+			if (DWT->CYCCNT - start > timeout_us * cyclesPerUs) {
+				locked = false;
+				break;
+			}
+		}
+		lock_us = (DWT->CYCCNT - start) / cyclesPerUs;
+	}
+	// Mux pin back to high impedance
+	regs[2] &= ~(7UL << 26);
+	regs[5] &= ~(1UL << 18);
+	Write(5, regs[5]);
+	Write(2, regs[2]);
+	return locked;
+}
+
 uint8_t MAX2871::GetTemp() {
 	// select temperature channel and start ADC
 	regs[5] &= ~0x00000078;
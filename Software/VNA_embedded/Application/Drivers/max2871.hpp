@@ -17,6 +17,8 @@ public:
 		RF_EN(RF_EN), RF_ENpin(RF_ENpin),
 		LD(LD), LDpin(LDpin),
 		outputFrequency(0),
+		written(),
+		writtenValid(0),
 		VCOmax(),
 		gotVCOMap(false)
 		{};
@@ -50,18 +52,49 @@ public:
 	void SetCPMode(CPMode m);
 	void SetCPCurrent(uint8_t mA);
 	bool SetFrequency(uint64_t f);
+	// Output divider and VCO that SetFrequency selects for a frequency (the VCO only with a VCO map)
+	using Band = struct _band {
+		uint8_t divider; // log2 of the division ratio
+		uint8_t vco;
+		uint64_t f_vco;
+	};
+	Band GetBand(uint64_t f) const;
+	// Latches the frequency set by SetFrequency and measures the time until the digital lock detect asserts again
+	// (0 if it did not drop at all). Returns false if the PLL does not lock within timeout_us
+	bool MeasureLockTime(uint32_t timeout_us, uint32_t &lock_us);
 	void Update();
 	void UpdateFrequency();
 	bool BuildVCOMap();
+	// The VCO map is kept across Init(), it only has to be built once
+	bool HasVCOMap() const {
+		return gotVCOMap;
+	}
+	// Maximum frequency of each VCO (in 100kHz), allows to store the map and skip BuildVCOMap at the next start
+	static constexpr uint8_t VCOMapEntries = 64;
+	const uint16_t* GetVCOMap() const {
+		return VCOmax;
+	}
+	void SetVCOMap(const uint16_t *map);
+	// Discards the VCO map, the next Init() of the VNA builds it again
+	void ClearVCOMap() {
+		gotVCOMap = false;
+	}
 	uint8_t GetTemp();
 	uint32_t* GetRegisters() {
 		return regs;
 	}
+	// The registers have been written by someone else (e.g. the FPGA during a sweep),
+	// the next update transfers all of them
+	void InvalidateRegisters() {
+		writtenValid = 0;
+	}
 private:
 	static constexpr uint64_t MaxFreq = 6100000000; // 6GHz according to datasheet, but slight overclocking is possible
 
 	uint32_t Read();
 	void Write(uint8_t reg, uint32_t val);
+	// Writes the registers selected by mask (bit n for register n) that differ from the device
+	void UpdateRegisters(uint8_t mask);
 	uint32_t regs[6];
 	uint32_t f_PFD;
 	SPI_HandleTypeDef *hspi;
@@ -76,6 +109,9 @@ private:
 	GPIO_TypeDef *LD;
 	uint16_t LDpin;
 	uint64_t outputFrequency;
-	uint16_t VCOmax[64];
+	// last values written to the device
+	uint32_t written[6];
+	uint8_t writtenValid;
+	uint16_t VCOmax[VCOMapEntries];
 	bool gotVCOMap;
 };
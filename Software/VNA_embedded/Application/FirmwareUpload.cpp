@@ -0,0 +1,76 @@
+#include "FirmwareUpload.hpp"
+
+#include "VCOMapStorage.hpp"
+
+#define LOG_LEVEL	LOG_LEVEL_INFO
+#define LOG_MODULE	"FWUpd"
+#include "Log.h"
+
+static_assert(Protocol::FirmwareChunkSize == Flash::PageSize, "Firmware chunks have to be complete pages");
+static_assert(FirmwareUpload::MaxImageSize <= VCOMapStorage::Address, "Firmware image would overlap the VCO maps");
+
+static Flash *flash = nullptr;
+// end of the image, rounded up to complete sectors
+static uint32_t limit;
+// everything below this address has been erased during the current update
+static uint32_t erased;
+
+bool FirmwareUpload::Start(Flash *f, uint32_t size, bool chipErased) {
+	flash = nullptr;
+	if(size == 0 || size > MaxImageSize) {
+		LOG_ERR("Invalid firmware size %lu", size);
+		return false;
+	}
+	flash = f;
+	limit = (size + Flash::SectorSize - 1) & ~(Flash::SectorSize - 1);
+	erased = chipErased ? limit : 0;
+	LOG_INFO("Starting update of %lu bytes", size);
+	return true;
+}
+
+bool FirmwareUpload::Write(const Protocol::FirmwarePacket &p) {
+	if(!flash) {
+		return false;
+	}
+	uint32_t end = p.address + sizeof(p.data);
+	if(p.address % Flash::PageSize != 0 || end > limit) {
+		LOG_ERR("Invalid firmware chunk at address %lu", p.address);
+		return false;
+	}
+	while(erased < end) {
+		// large blocks erase faster, but only if the image covers them completely
+		bool ok;
+		if(erased % Flash::BlockSize == 0 && erased + Flash::BlockSize <= limit) {
+			ok = flash->eraseBlock(erased);
+			erased += Flash::BlockSize;
+		} else {
+			ok = flash->eraseSector(erased);
+			erased += Flash::SectorSize;
+		}
+		if(!ok) {
+			LOG_ERR("Failed to erase flash at address %lu", erased);
+			return false;
+		}
+	}
+	return flash->programPage(p.address, p.data);
+}
+
+bool FirmwareUpload::Verify(uint32_t size, uint32_t crc) {
+	if(!flash || size > limit) {
+		return false;
+	}
+	uint8_t buf[256];
+	uint32_t actual = 0;
+	for(uint32_t address = 0;address < size;address += sizeof(buf)) {
+		uint16_t len = size - address < sizeof(buf) ? size - address : sizeof(buf);
+		flash->read(address, len, buf);
+		actual = Protocol::CRC32(actual, buf, len);
+	}
+	flash = nullptr;
+	if(actual != crc) {
+		LOG_ERR("Firmware CRC mismatch: 0x%08lx, expected 0x%08lx", actual, crc);
+		return false;
+	}
+	LOG_INFO("Firmware verified");
+	return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Flash.hpp"
+#include "Protocol.hpp"
+
+// Streamed firmware update (see Protocol::FirmwareStart). Only the sectors covered by the image are erased,
+// the pages are programmed while the next chunk is received.
+namespace FirmwareUpload {
+
+static constexpr uint32_t FlashSize = 0x200000;
+// the last sector holds the VCO maps (see VCOMapStorage) and must not be overwritten by the image
+static constexpr uint32_t MaxImageSize = FlashSize - Flash::SectorSize;
+// Returns false if the image does not fit below the VCO maps. Nothing has to be erased after ClearFlash (chipErased)
+bool Start(Flash *f, uint32_t size, bool chipErased = false);
+// Erases the sectors up to the end of the chunk if necessary and starts programming it
+bool Write(const Protocol::FirmwarePacket &p);
+// Ends the update, returns true if the flash content matches the CRC
+bool Verify(uint32_t size, uint32_t crc);
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+/*
+ * Fixed size single-producer/single-consumer queue.
+ *
+ * push() and pop() may run concurrently (e.g. push from an interrupt, pop from a task) without any locking:
+ * the producer only ever writes the head index, the consumer only the tail index. Both indices are free
+ * running, which requires N to be a power of two. Entries that do not fit into the queue are dropped and counted.
+ */
+template<typename T, uint16_t N>
+class SPSCQueue {
+	static_assert(N > 0 && (N & (N - 1)) == 0, "Queue size must be a power of two");
+public:
+	SPSCQueue() :
+		head(0),
+		tail(0),
+		overflows(0) {};
+
+	// Producer side, returns false (and counts the overflow) if the queue is full
+	bool push(const T &t) {
+		uint16_t h = head.load(std::memory_order_relaxed);
+		if((uint16_t) (h - tail.load(std::memory_order_acquire)) >= N) {
+			overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return false;
+		}
+		buf[h & (N - 1)] = t;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer side, returns false if the queue is empty
+	bool pop(T &t) {
+		uint16_t tl = tail.load(std::memory_order_relaxed);
+		if(tl == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		t = buf[tl & (N - 1)];
+		tail.store(tl + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer side, discards all queued entries
+	void clear() {
+		tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+	}
+	uint16_t getUsed() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+	// Number of entries dropped because the queue was full
+	uint32_t getOverflows() const {
+		return overflows.load(std::memory_order_relaxed);
+	}
+
+private:
+	T buf[N];
+	std::atomic<uint16_t> head;
+	std::atomic<uint16_t> tail;
+	std::atomic<uint32_t> overflows;
+};
@@ -0,0 +1,63 @@
+#include "Timing.hpp"
+
+#include <cstring>
+
+static Protocol::TimingHistogram histograms[(int) Timing::Stage::Last];
+static uint32_t cyclesPerUs;
+
+void Timing::Init() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	cyclesPerUs = SystemCoreClock / 1000000;
+	Clear();
+}
+
+static void Add(Timing::Stage s, uint32_t us) {
+	auto &h = histograms[(int) s];
+	h.count++;
+	h.sum_us += us;
+	if(us < h.min_us) {
+		h.min_us = us;
+	}
+	if(us > h.max_us) {
+		h.max_us = us;
+	}
+	// bin index is the number of significant bits
+	uint8_t bin = us ? 32 - __CLZ(us) : 0;
+	if(bin >= Protocol::TimingBins) {
+		bin = Protocol::TimingBins - 1;
+	}
+	h.bins[bin]++;
+}
+
+void Timing::Record(Stage s, uint32_t cycles) {
+	Add(s, cycles / cyclesPerUs);
+}
+
+void Timing::RecordLong(Stage s, uint64_t cycles) {
+	uint64_t us = cycles / cyclesPerUs;
+	Add(s, us <= UINT32_MAX ? us : UINT32_MAX);
+}
+
+void Timing::Get(Stage s, Protocol::TimingHistogram *h) {
+	// prevent an interrupt from recording while the statistics are copied
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*h = histograms[(int) s];
+	__set_PRIMASK(primask);
+	if(!h->count) {
+		h->min_us = 0;
+	}
+}
+
+void Timing::Clear() {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	memset(histograms, 0, sizeof(histograms));
+	for(uint8_t i=0;i<(int) Stage::Last;i++) {
+		histograms[i].stage = (Stage) i;
+		histograms[i].min_us = UINT32_MAX;
+	}
+	__set_PRIMASK(primask);
+}
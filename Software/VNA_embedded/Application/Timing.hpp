@@ -0,0 +1,27 @@
+#pragma once
+
+#include "stm.hpp"
+#include "Protocol.hpp"
+
+// Timing statistics of the sweep stages, based on the DWT cycle counter. Each stage is only recorded from
+// a single context (either one interrupt or the App task), the statistics are not protected against
+// concurrent recording of the same stage.
+namespace Timing {
+
+using Stage = Protocol::TimingStage;
+
+void Init();
+static inline uint32_t Now() {
+	return DWT->CYCCNT;
+}
+// Durations up to 2^32 cycles (~53s at 80MHz)
+void Record(Stage s, uint32_t cycles);
+// Durations that may exceed the range of the cycle counter (accumulated from several shorter measurements)
+void RecordLong(Stage s, uint64_t cycles);
+static inline void Since(Stage s, uint32_t start) {
+	Record(s, Now() - start);
+}
+void Get(Stage s, Protocol::TimingHistogram *h);
+void Clear();
+
+}
@@ -0,0 +1,68 @@
+#include "VCOMapStorage.hpp"
+
+#include "HWCRC.hpp"
+#include <cstring>
+#include <cstddef>
+
+#define LOG_LEVEL	LOG_LEVEL_INFO
+#define LOG_MODULE	"VCOMap"
+#include "Log.h"
+
+// increase when the layout of the stored data or the content of the VCO maps changes
+static constexpr uint16_t Version = 2;
+static constexpr uint32_t Magic = 0x4D4F4356; // "VCOM"
+
+using Content = struct _content {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	VNA::VCOMaps maps;
+	uint32_t crc;
+};
+
+// flash can only be written in complete pages
+using Storage = union _storage {
+	Content content;
+	uint8_t pages[((sizeof(Content) + 255) / 256) * 256];
+};
+
+static Storage storage;
+
+static uint32_t Checksum(const Content &c) {
+	return HWCRC::CRC32(0, &c, offsetof(Content, crc));
+}
+
+bool VCOMapStorage::Load(Flash *f, VNA::VCOMaps *maps) {
+	f->read(Address, sizeof(storage.content), &storage.content);
+	if(storage.content.magic != Magic || storage.content.version != Version
+			|| storage.content.size != sizeof(VNA::VCOMaps)) {
+		LOG_INFO("No VCO maps stored");
+		return false;
+	}
+	if(storage.content.crc != Checksum(storage.content)) {
+		LOG_WARN("Stored VCO maps are corrupted");
+		return false;
+	}
+	*maps = storage.content.maps;
+	return true;
+}
+
+bool VCOMapStorage::Update(Flash *f, const VNA::VCOMaps &maps) {
+	VNA::VCOMaps stored;
+	if(Load(f, &stored) && !memcmp(&stored, &maps, sizeof(maps))) {
+		// already up to date, avoid wearing out the flash
+		return true;
+	}
+	memset(&storage, 0xFF, sizeof(storage));
+	storage.content.magic = Magic;
+	storage.content.version = Version;
+	storage.content.size = sizeof(VNA::VCOMaps);
+	storage.content.maps = maps;
+	storage.content.crc = Checksum(storage.content);
+	if(!f->eraseSector(Address) || !f->write(Address, sizeof(storage.pages), storage.pages)) {
+		LOG_ERR("Failed to store VCO maps");
+		return false;
+	}
+	LOG_INFO("Stored VCO maps");
+	return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Flash.hpp"
+#include "VNA.hpp"
+
+namespace VCOMapStorage {
+
+// The VCO maps are kept in the last sector of the onboard flash. Firmware images must end below it
+// (FirmwareUpload::MaxImageSize) and FirmwareStart only erases the sectors of the image, so an update keeps the maps.
+// Only ClearFlash erases them, they are built and stored again at the next start.
+static constexpr uint32_t Address = 0x1FF000;
+
+// Returns false if no valid maps (matching version/CRC) are stored
+bool Load(Flash *f, VNA::VCOMaps *maps);
+// Writes the maps to the flash, unless identical maps are already stored
+bool Update(Flash *f, const VNA::VCOMaps &maps);
+
+}
@@ -5,8 +5,11 @@
 #include "delay.hpp"
 #include "FPGA/FPGA.hpp"
 #include <complex>
+#include <cstring>
+#include <utility>
 #include "Exti.hpp"
 #include "VNA_HAL.hpp"
+#include "Timing.hpp"
 
 #define LOG_LEVEL	LOG_LEVEL_INFO
 #define LOG_MODULE	"VNA"
@@ -17,12 +20,17 @@ static constexpr uint32_t IF1_alternate = 57000000;
 static constexpr uint32_t IF2 = 250000;
 
 static VNA::SweepCallback sweepCallback;
+static VNA::RawCallback rawCallback;
 static VNA::StatusCallback statusCallback;
-static Protocol::SweepSettings settings;
 static uint16_t pointCnt;
 static bool excitingPort1;
+// ports excited in each point, depending on the requested S-parameters
+static bool excitePort1, excitePort2;
 static Protocol::Datapoint data;
 static bool manualMode = false;
+// cycle counter values for the timing statistics
+static uint32_t acquisitionStart, readStart, lastPointTime;
+static uint64_t sweepCycles;
 
 using IFTableEntry = struct {
 	uint16_t pointCnt;
@@ -36,12 +44,207 @@ static uint16_t IFTableIndexCnt = 0;
 
 static constexpr uint32_t BandSwitchFrequency = 25000000;
 
+// Multisynth configuration of the lowband source for the points below BandSwitchFrequency, calculated when the
+// sweep is configured. The halt interrupt only has to transfer the registers.
+using LowbandTableEntry = struct {
+	uint16_t pointCnt;
+	uint8_t clkconfig[8];
+};
+
+static constexpr uint16_t LowbandTableNumEntries = 256;
+static LowbandTableEntry LowbandTable[LowbandTableNumEntries];
+static uint16_t LowbandTableEntries = 0;
+static uint16_t LowbandTableIndexCnt = 0;
+// set while the registers of a lowband point are transferred, the sweep is still halted
+static volatile bool lowbandTransfer = false;
+// DMA transfers started by the halt interrupt that have not completed yet
+static volatile uint8_t haltTransfers = 0;
+// multisynth configuration that is written after the lowband output has been switched
+static const uint8_t *lowbandConfig;
+// configuration of a lowband point that did not fit into the lowband table
+static uint8_t overflowConfig[8];
+// state of the lowband source output, the highband source output is always the opposite during a sweep
+static bool lowbandOutput = false;
+static uint32_t haltStart;
+
+// Sweep definition, a linear sweep is a single segment
+using SweepTable = struct _sweepTable {
+	Protocol::SweepSegment segments[Protocol::MaxSweepSegments];
+	uint8_t count;
+	uint16_t points;
+	// value of the SamplesPerPoint register. Points with a different IF bandwidth use one of the fixed sample counts
+	uint32_t samplesPerPoint;
+	uint8_t parameters; // requested S-parameters
+};
+// The active table is measured by the sweep, new definitions are collected in the pending table. When a new table
+// is applied, only the points that differ from the active table are written to the FPGA again
+static SweepTable tables[2];
+static SweepTable *active = &tables[0];
+static SweepTable *pending = &tables[1];
+// FPGA contains the sweep of the active table
+static bool sweepUploaded = false;
+
+// Position within a sweep table, looking up increasing point numbers is cheap
+using PointCursor = struct _pointCursor {
+	const SweepTable *table;
+	uint8_t segment;
+	uint16_t firstPoint; // point number of the first point in the current segment
+};
+// separate cursors for the interrupts, they run independently of each other
+static PointCursor haltCursor;
+static PointCursor readCursor;
+
+// VCO maps have been set externally and not been verified by a locked PLL yet
+static bool externalVCOMaps = false;
+
+// Settling time of each VNA::Transition, calibrated after building the VCO maps. Until then all points use the
+// longest settling time
+static constexpr uint16_t MaxSettling = 540;
+static uint16_t settlingTable[VNA::Transitions] = {MaxSettling, MaxSettling, MaxSettling, MaxSettling, MaxSettling};
+static bool settlingCalibrated = false;
+
 static uint32_t extOutFreq = 0;
 static bool extRefInUse = false;
 
 using namespace VNAHAL;
 
+static const Protocol::SweepSegment& Seek(PointCursor &c, uint16_t point) {
+	if(point < c.firstPoint) {
+		// moving backwards, start at the first segment again
+		c.segment = 0;
+		c.firstPoint = 0;
+	}
+	while(c.segment + 1 < c.table->count && point >= c.firstPoint + c.table->segments[c.segment].points) {
+		c.firstPoint += c.table->segments[c.segment].points;
+		c.segment++;
+	}
+	return c.table->segments[c.segment];
+}
+
+static uint64_t PointFrequency(PointCursor &c, uint16_t point) {
+	auto &segment = Seek(c, point);
+	return Protocol::PointFrequency(segment, point - c.firstPoint);
+}
+
+static uint32_t SamplesPerPoint(uint32_t if_bandwidth) {
+	uint32_t samplesPerPoint = (1000000 / if_bandwidth);
+	// round up to next multiple of 128 (128 samples are spread across 35 IF2 periods)
+	return ((uint32_t) ((samplesPerPoint + 127) / 128)) * 128;
+}
+
+// Sample counts of FPGA::Samples::S128 and up
+static constexpr uint32_t FixedSamples[] = {128, 384, 896, 3072, 9088, 30464, 91392};
+
+static FPGA::Samples PointSamples(uint32_t samples, uint32_t samplesRegister) {
+	if(samples == samplesRegister) {
+		return FPGA::Samples::SPPRegister;
+	}
+	// use the first fixed sample count that achieves at least the requested IF bandwidth
+	for(uint8_t i=0;i<sizeof(FixedSamples)/sizeof(FixedSamples[0]);i++) {
+		if(FixedSamples[i] >= samples) {
+			return (FPGA::Samples) (i + (int) FPGA::Samples::S128);
+		}
+	}
+	return FPGA::Samples::S91392;
+}
+
+// Number of samples the FPGA accumulates for a point
+static uint32_t PointSampleCount(PointCursor &c, uint16_t point) {
+	auto &segment = Seek(c, point);
+	auto samples = PointSamples(SamplesPerPoint(segment.if_bandwidth), c.table->samplesPerPoint);
+	if(samples == FPGA::Samples::SPPRegister) {
+		return c.table->samplesPerPoint;
+	}
+	return FixedSamples[(int) samples - (int) FPGA::Samples::S128];
+}
+
+// Precalculated configuration of a lowband point, nullptr if the table has no entry for it
+static const LowbandTableEntry* FindLowbandEntry(uint16_t point) {
+	if (point == 0) {
+		// sweep started again
+		LowbandTableIndexCnt = 0;
+	}
+	while (LowbandTableIndexCnt < LowbandTableEntries && LowbandTable[LowbandTableIndexCnt].pointCnt < point) {
+		LowbandTableIndexCnt++;
+	}
+	if (LowbandTableIndexCnt < LowbandTableEntries && LowbandTable[LowbandTableIndexCnt].pointCnt == point) {
+		return &LowbandTable[LowbandTableIndexCnt];
+	}
+	return nullptr;
+}
+
+static void ResumeSweep() {
+	Timing::Since(Timing::Stage::Halt, haltStart);
+	FPGA::ResumeHaltedSweep();
+	acquisitionStart = Timing::Now();
+}
+
+// The transfers of a halt complete in different interrupts, the last one resumes the sweep
+static void FinishHaltTransfer(bool success) {
+	if (!success) {
+		LOG_ERR("Failed to configure lowband source");
+	}
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool done = false;
+	if (haltTransfers) {
+		done = --haltTransfers == 0;
+	}
+	__set_PRIMASK(primask);
+	if (done) {
+		lowbandTransfer = false;
+		ResumeSweep();
+	}
+}
+
+static void LowbandOutputSwitched(bool success) {
+	if (!success || !lowbandConfig) {
+		FinishHaltTransfer(success);
+		return;
+	}
+	if (!Si5351.WriteRawCLKConfigDMA(SiChannel::LowbandSource, lowbandConfig, FinishHaltTransfer)) {
+		FinishHaltTransfer(false);
+	}
+}
+
+// After aborting the sweep, the halt interrupt may still wait for the lowband source registers. The I2C bus is busy
+// until then and the completion resumes the (already aborted) sweep. A transfer that does not complete is aborted,
+// the register content of the lowband source is unknown afterwards and rewritten on the next SetCLK.
+static void WaitForLowbandTransfer() {
+	constexpr uint32_t timeout = 10;
+	uint32_t start = HAL_GetTick();
+	while (lowbandTransfer) {
+		if (HAL_GetTick() - start > timeout) {
+			LOG_ERR("Lowband source transfer timed out");
+			Si5351.AbortTransfer();
+			haltTransfers = 0;
+			lowbandTransfer = false;
+			break;
+		}
+	}
+}
+
+// Sets the source outputs for the first point of the active sweep, the halt interrupt switches them during the sweep
+static void SetStartOutput() {
+	PointCursor c = {active, 0, 0};
+	lowbandOutput = active->points && PointFrequency(c, 0) < BandSwitchFrequency;
+	if (lowbandOutput) {
+		Si5351.Enable(SiChannel::LowbandSource);
+	} else {
+		Si5351.Disable(SiChannel::LowbandSource);
+	}
+	FPGA::Enable(FPGA::Periphery::SourceRF, !lowbandOutput);
+}
+
+static void StartSweep() {
+	// the FPGA writes the PLL registers during the sweep, the drivers no longer know their content
+	Source.InvalidateRegisters();
+	LO1.InvalidateRegisters();
+	FPGA::StartSweep();
+}
+
 static void HaltedCallback() {
+	haltStart = Timing::Now();
 	LOG_DEBUG("Halted before point %d", pointCnt);
 	// Check if IF table has entry at this point
 //	if (IFTable[IFTableIndexCnt].pointCnt == pointCnt) {
@@ -53,59 +256,115 @@ static void HaltedCallback() {
 //		Si5351.ResetPLL(Si5351C::PLL::B);
 //		IFTableIndexCnt++;
 //	}
-	uint64_t frequency = settings.f_start
-			+ (settings.f_stop - settings.f_start) * pointCnt
-					/ (settings.points - 1);
-	if (frequency < BandSwitchFrequency) {
+	uint64_t frequency = PointFrequency(haltCursor, pointCnt);
+	bool lowband = frequency < BandSwitchFrequency;
+	const uint8_t *config = nullptr;
+	if (lowband) {
 		// need the Si5351 as Source
-		Si5351.SetCLK(SiChannel::LowbandSource, frequency, Si5351C::PLL::B,
-				Si5351C::DriveStrength::mA2);
-		if (pointCnt == 0) {
-			// First point in sweep, enable CLK
-			Si5351.Enable(SiChannel::LowbandSource);
-			FPGA::Disable(FPGA::Periphery::SourceRF);
+		auto entry = FindLowbandEntry(pointCnt);
+		if (entry) {
+			config = entry->clkconfig;
+		} else if (Si5351.CalculateRawCLKConfig(SiChannel::LowbandSource, frequency, Si5351C::PLL::B,
+				overflowConfig)) {
+			// lowband table is full, calculate configuration now
+			config = overflowConfig;
+		} else {
+			LOG_ERR("Unable to configure lowband source for %lu", (uint32_t) frequency);
 		}
-	} else {
-		// first sweep point in highband is also halted, disable lowband source
-		Si5351.Disable(SiChannel::LowbandSource);
-		FPGA::Enable(FPGA::Periphery::SourceRF);
 	}
-
-	FPGA::ResumeHaltedSweep();
+	// first point of a band is also halted, switch between lowband and highband source
+	bool switchOutput = lowband != lowbandOutput;
+	if (!config && !switchOutput) {
+		ResumeSweep();
+		return;
+	}
+	// Only DMA transfers here, the sweep is resumed when the last one has completed. The halt holds one reference
+	// itself so that a transfer completing early can not resume the sweep before all of them have been started
+	lowbandTransfer = true;
+	haltTransfers = switchOutput ? 3 : 2;
+	if (switchOutput) {
+		lowbandOutput = lowband;
+		if (!FPGA::EnableDMA(FPGA::Periphery::SourceRF, !lowband, FinishHaltTransfer)) {
+			FinishHaltTransfer(false);
+		}
+		// the multisynth configuration follows once the output is switched
+		lowbandConfig = config;
+		if (!Si5351.SetOutputDMA(SiChannel::LowbandSource, lowband, LowbandOutputSwitched)) {
+			FinishHaltTransfer(false);
+		}
+	} else if (!Si5351.WriteRawCLKConfigDMA(SiChannel::LowbandSource, config, FinishHaltTransfer)) {
+		FinishHaltTransfer(false);
+	}
+	FinishHaltTransfer(true);
 }
 
 static void ReadComplete(FPGA::SamplingResult result) {
 	if(!manualMode) {
 		// normal sweep mode
-		auto port1_raw = std::complex<float>(result.P1I, result.P1Q);
-		auto port2_raw = std::complex<float>(result.P2I, result.P2Q);
-		auto ref = std::complex<float>(result.RefI, result.RefQ);
-		auto port1 = port1_raw / ref;
-		auto port2 = port2_raw / ref;
-		if(excitingPort1) {
-			data.pointNum = pointCnt;
-			data.frequency = settings.f_start + (settings.f_stop - settings.f_start) * pointCnt / (settings.points - 1);
-			data.real_S11 = port1.real();
-			data.imag_S11 = port1.imag();
-			data.real_S21 = port2.real();
-			data.imag_S21 = port2.imag();
+		uint32_t start = Timing::Now();
+		Timing::Record(Timing::Stage::Readout, start - readStart);
+		bool pointComplete = !excitingPort1 || !excitePort2;
+		if(rawCallback) {
+			// the host calculates the S-parameters, pass on the accumulators unchanged
+			Protocol::RawMeasurement m;
+			m.P1I = result.P1I;
+			m.P1Q = result.P1Q;
+			m.P2I = result.P2I;
+			m.P2Q = result.P2Q;
+			m.RefI = result.RefI;
+			m.RefQ = result.RefQ;
+			m.samples = PointSampleCount(readCursor, pointCnt);
+			m.pointNum = pointCnt;
+			m.port = excitingPort1 ? 1 : 2;
+			m.last = pointComplete;
+			rawCallback(m);
 		} else {
-			data.real_S12 = port1.real();
-			data.imag_S12 = port1.imag();
-			data.real_S22 = port2.real();
-			data.imag_S22 = port2.imag();
-			if (sweepCallback) {
-				sweepCallback(data);
+			auto port1_raw = std::complex<float>(result.P1I, result.P1Q);
+			auto port2_raw = std::complex<float>(result.P2I, result.P2Q);
+			auto ref = std::complex<float>(result.RefI, result.RefQ);
+			auto port1 = port1_raw / ref;
+			auto port2 = port2_raw / ref;
+			if(excitingPort1) {
+				data.real_S11 = port1.real();
+				data.imag_S11 = port1.imag();
+				data.real_S21 = port2.real();
+				data.imag_S21 = port2.imag();
+			} else {
+				data.real_S12 = port1.real();
+				data.imag_S12 = port1.imag();
+				data.real_S22 = port2.real();
+				data.imag_S22 = port2.imag();
 			}
+		}
+		if(pointComplete) {
+			// all measurements of this point are done
+			if(!rawCallback) {
+				data.pointNum = pointCnt;
+				data.frequency = PointFrequency(readCursor, pointCnt);
+				if (sweepCallback) {
+					sweepCallback(data);
+				}
+			}
+			uint32_t now = Timing::Now();
+			uint32_t pointCycles = now - lastPointTime;
+			lastPointTime = now;
+			Timing::Record(Timing::Stage::Point, pointCycles);
+			sweepCycles += pointCycles;
 			pointCnt++;
-			if (pointCnt >= settings.points) {
+			if (pointCnt >= active->points) {
 				// reached end of sweep, start again
 				pointCnt = 0;
 				IFTableIndexCnt = 0;
+				Timing::RecordLong(Timing::Stage::Sweep, sweepCycles);
+				sweepCycles = 0;
 	//			FPGA::StartSweep();
 			}
 		}
-		excitingPort1 = !excitingPort1;
+		if(excitePort1 && excitePort2) {
+			excitingPort1 = !excitingPort1;
+		}
+		Timing::Since(Timing::Stage::Processing, start);
+		acquisitionStart = Timing::Now();
 	} else {
 		// Manual control mode, simply pass on raw result
 		if(statusCallback) {
@@ -115,22 +374,23 @@ static void ReadComplete(FPGA::SamplingResult result) {
 }
 
 static void FPGA_Interrupt(void*) {
-	FPGA::InitiateSampleRead(ReadComplete);
+	uint32_t now = Timing::Now();
+	uint32_t acquisition = now - acquisitionStart;
+	readStart = now;
+	if(FPGA::InitiateSampleRead(ReadComplete) && !manualMode) {
+		Timing::Record(Timing::Stage::Acquisition, acquisition);
+	}
 }
 
-bool VNA::Init() {
-	LOG_DEBUG("Initializing...");
-
-	manualMode = false;
+// set by InitClocks, the PLLs only have to lock during the next Init
+static bool clocksStarted = false;
 
+void VNA::InitClocks() {
 	Si5351.Init();
 
 	// Use Si5351 to generate reference frequencies for other PLLs and ADC
 	Si5351.SetPLL(Si5351C::PLL::A, 800000000, Si5351C::PLLSource::XTAL);
-	while(!Si5351.Locked(Si5351C::PLL::A));
-
 	Si5351.SetPLL(Si5351C::PLL::B, 800000000, Si5351C::PLLSource::XTAL);
-	while(!Si5351.Locked(Si5351C::PLL::B));
 
 	extRefInUse = 0;
 	extOutFreq = 0;
@@ -155,6 +415,108 @@ bool VNA::Init() {
 
 	// PLL reset appears to realign phases of clock signals
 	Si5351.ResetPLL(Si5351C::PLL::B);
+	clocksStarted = true;
+}
+
+// Steps of the VCO frequency up to this size (without changing the VCO or divider) are fine steps
+static constexpr uint32_t FineStepVCO = 5000000;
+
+static VNA::Transition Classify(const MAX2871 &synth, uint64_t from, uint64_t to) {
+	auto a = synth.GetBand(from);
+	auto b = synth.GetBand(to);
+	if(a.divider != b.divider) {
+		return VNA::Transition::DividerChange;
+	} else if(a.vco != b.vco) {
+		return VNA::Transition::VCOChange;
+	}
+	uint64_t step = a.f_vco > b.f_vco ? a.f_vco - b.f_vco : b.f_vco - a.f_vco;
+	return step > FineStepVCO ? VNA::Transition::CoarseStep : VNA::Transition::FineStep;
+}
+
+// Transition from the previous point of the sweep (0 for the first point)
+static VNA::Transition PointTransition(uint64_t previous, uint64_t freq) {
+	if(previous < BandSwitchFrequency || freq < BandSwitchFrequency) {
+		return VNA::Transition::BandSwitch;
+	}
+	auto source = Classify(Source, previous, freq);
+	auto LO = Classify(LO1, previous + IF1, freq + IF1);
+	return source > LO ? source : LO;
+}
+
+// Steps measured by the settling calibration, upwards and back from each base frequency. They cover all
+// transitions apart from band switches, the slowest step of each transition determines its settling time
+static constexpr uint64_t CalibrationBase[] = {100000000, 400000000, 1000000000, 1450000000, 2950000000, 5000000000};
+static constexpr uint32_t CalibrationStep[] = {100000, 2000000, 20000000, 100000000};
+static constexpr uint32_t CalibrationTimeout = 2000;
+// The lock detect asserts before the phase has settled completely
+static constexpr uint8_t SettlingMargin = 2;
+
+// Measures the lock times of the currently selected synthesizer via its MUX output, keeps the slowest one per
+// transition in lock_us. Returns false if the synthesizer does not lock
+static bool MeasureLockTimes(MAX2871 &synth, uint32_t *lock_us) {
+	for(auto base : CalibrationBase) {
+		for(auto step : CalibrationStep) {
+			uint64_t from = base;
+			uint64_t to = base + step;
+			uint32_t t;
+			synth.SetFrequency(from);
+			if(!synth.MeasureLockTime(CalibrationTimeout, t)) {
+				return false;
+			}
+			for(uint8_t i=0;i<2;i++) {
+				auto transition = (uint8_t) Classify(synth, from, to);
+				synth.SetFrequency(to);
+				if(!synth.MeasureLockTime(CalibrationTimeout, t)) {
+					return false;
+				}
+				if(lock_us[transition] == UINT32_MAX || t > lock_us[transition]) {
+					lock_us[transition] = t;
+				}
+				// and back again
+				std::swap(from, to);
+			}
+		}
+	}
+	return true;
+}
+
+static void ApplySettlingCalibration(const uint32_t *lock_us) {
+	constexpr uint8_t calibrated = (uint8_t) VNA::Transition::BandSwitch;
+	settlingTable[calibrated] = MaxSettling;
+	// a transition that did not occur during the calibration uses the settling time of the next larger one
+	for(int8_t i=calibrated-1;i>=0;i--) {
+		uint32_t settling = lock_us[i] == UINT32_MAX ? settlingTable[i + 1] : lock_us[i] * SettlingMargin;
+		if(settling > MaxSettling) {
+			LOG_WARN("Lock time of transition %u exceeds the maximum settling time: %luus", i, lock_us[i]);
+			settling = MaxSettling;
+		}
+		settlingTable[i] = settling;
+	}
+	// larger steps never settle faster
+	for(uint8_t i=1;i<calibrated;i++) {
+		if(settlingTable[i] < settlingTable[i - 1]) {
+			settlingTable[i] = settlingTable[i - 1];
+		}
+	}
+	settlingCalibrated = true;
+	LOG_INFO("Settling times (fine/coarse/VCO/divider): %u/%u/%u/%uus", settlingTable[0], settlingTable[1],
+			settlingTable[2], settlingTable[3]);
+}
+
+bool VNA::Init() {
+	LOG_DEBUG("Initializing...");
+
+	manualMode = false;
+	// FPGA gets reset, the sweep table has to be uploaded again
+	sweepUploaded = false;
+
+	if(!clocksStarted) {
+		InitClocks();
+	}
+	// any further initialization programs the clocks again
+	clocksStarted = false;
+	while(!Si5351.Locked(Si5351C::PLL::A));
+	while(!Si5351.Locked(Si5351C::PLL::B));
 
 	LOG_DEBUG("Si5351 locked");
 
@@ -178,11 +540,23 @@ bool VNA::Init() {
 	Source.SetPowerOutA(MAX2871::Power::n4dbm);
 	// output B is not used
 	Source.SetPowerOutB(MAX2871::Power::n4dbm, false);
-	if(!Source.BuildVCOMap()) {
+	if(Source.HasVCOMap()) {
+		LOG_INFO("Reusing source VCO map");
+	} else if(!Source.BuildVCOMap()) {
 		LOG_WARN("Source VCO map failed");
 	} else {
 		LOG_INFO("Source VCO map complete");
 	}
+	// the settling times are calibrated along with the VCO maps
+	uint32_t lockTimes[Transitions];
+	for(auto &t : lockTimes) {
+		t = UINT32_MAX;
+	}
+	bool calibrate = !settlingCalibrated && Source.HasVCOMap();
+	if(calibrate && !MeasureLockTimes(Source, lockTimes)) {
+		LOG_WARN("Source settling calibration failed");
+		calibrate = false;
+	}
 	Source.SetFrequency(1000000000);
 	Source.UpdateFrequency();
 	LOG_DEBUG("Source temp: %u", Source.GetTemp());
@@ -194,11 +568,21 @@ bool VNA::Init() {
 	LO1.Init(100000000, false, 1, false);
 	LO1.SetPowerOutA(MAX2871::Power::n4dbm);
 	LO1.SetPowerOutB(MAX2871::Power::n4dbm);
-	if(!LO1.BuildVCOMap()) {
+	if(LO1.HasVCOMap()) {
+		LOG_INFO("Reusing LO1 VCO map");
+	} else if(!LO1.BuildVCOMap()) {
 		LOG_WARN("LO1 VCO map failed");
 	} else {
 		LOG_INFO("LO1 VCO map complete");
 	}
+	calibrate = calibrate && LO1.HasVCOMap();
+	if(calibrate && !MeasureLockTimes(LO1, lockTimes)) {
+		LOG_WARN("LO1 settling calibration failed");
+		calibrate = false;
+	}
+	if(calibrate) {
+		ApplySettlingCalibration(lockTimes);
+	}
 	LO1.SetFrequency(1000000000 + IF1);
 	LO1.UpdateFrequency();
 	LOG_DEBUG("LO temp: %u", LO1.GetTemp());
@@ -213,42 +597,135 @@ bool VNA::Init() {
 	return true;
 }
 
-bool VNA::ConfigureSweep(Protocol::SweepSettings s, SweepCallback cb) {
+static FPGA::SettlingTime PointSettling(uint16_t settling_us) {
+	if(settling_us <= 20) {
+		return FPGA::SettlingTime::us20;
+	} else if(settling_us <= 60) {
+		return FPGA::SettlingTime::us60;
+	} else if(settling_us <= 180) {
+		return FPGA::SettlingTime::us180;
+	} else {
+		return FPGA::SettlingTime::us540;
+	}
+}
+
+static uint8_t ExcitationAttenuator(int16_t cdbm_excitation) {
+	if(cdbm_excitation >= -1000) {
+		return 0;
+	} else if (cdbm_excitation <= -4175){
+		return 127;
+	} else {
+		return (-1000 - cdbm_excitation) / 25;
+	}
+}
+
+// Everything that ends up in the sweep config of a point, apart from the halt flag
+using PointConfig = struct _pointConfig {
+	uint64_t frequency;
+	uint8_t attenuator;
+	FPGA::SettlingTime settling;
+	FPGA::Samples samples;
+};
+
+// The settling time depends on the frequency of the previous point (0 for the first point)
+static PointConfig GetPointConfig(PointCursor &c, uint16_t point, uint64_t previous) {
+	auto &segment = Seek(c, point);
+	PointConfig p;
+	p.frequency = Protocol::PointFrequency(segment, point - c.firstPoint);
+	p.attenuator = ExcitationAttenuator(segment.cdbm_excitation);
+	uint16_t settling = settlingTable[(int) PointTransition(previous, p.frequency)];
+	p.settling = PointSettling(settling > segment.settling_us ? settling : segment.settling_us);
+	p.samples = PointSamples(SamplesPerPoint(segment.if_bandwidth), c.table->samplesPerPoint);
+	return p;
+}
+
+static bool ValidSegment(const Protocol::SweepSegment &s) {
+	return s.points > 0 && s.if_bandwidth > 0;
+}
+
+// Calculates the number of points and the SamplesPerPoint register of a complete table
+static bool PrepareTable(SweepTable *t) {
+	if(t->count == 0) {
+		return false;
+	}
+	uint32_t points = 0;
+	uint8_t largest = 0;
+	for(uint8_t i=0;i<t->count;i++) {
+		if(!ValidSegment(t->segments[i])) {
+			LOG_ERR("Invalid sweep segment %u", i);
+			return false;
+		}
+		points += t->segments[i].points;
+		if(t->segments[i].points > t->segments[largest].points) {
+			largest = i;
+		}
+	}
+	if(points > FPGA::MaxPoints) {
+		LOG_WARN("Sweep has %lu points, limiting to %u", points, FPGA::MaxPoints);
+		points = FPGA::MaxPoints;
+	}
+	t->points = points;
+	// most points can use the register, only the other segments are limited to the fixed sample counts
+	t->samplesPerPoint = SamplesPerPoint(t->segments[largest].if_bandwidth);
+	return true;
+}
+
+// Writes the prepared sweep table (see PrepareTable) to the FPGA and starts the sweep. Unless forceUpload is set,
+// only the points that differ from the active table are written. The table becomes the active table.
+static bool UploadSweep(SweepTable *table, bool forceUpload, VNA::PrepareCallback prepare = nullptr) {
 	if (manualMode) {
 		// was used in manual mode last, do full initialization before starting sweep
 		VNA::Init();
 	}
-	sweepCallback = cb;
-	settings = s;
 	// Abort possible active sweep first
 	FPGA::AbortSweep();
-	uint16_t points = settings.points <= FPGA::MaxPoints ? settings.points : FPGA::MaxPoints;
-	// Configure sweep
-	FPGA::SetNumberOfPoints(points);
-	uint32_t samplesPerPoint = (1000000 / s.if_bandwidth);
-	// round up to next multiple of 128 (128 samples are spread across 35 IF2 periods)
-	samplesPerPoint = ((uint32_t) ((samplesPerPoint + 127) / 128)) * 128;
-	// has to be one less than actual number of samples
-	FPGA::SetSamplesPerPoint(samplesPerPoint);
+	WaitForLowbandTransfer();
+	if(prepare) {
+		prepare();
+	}
 
-	uint8_t attenuator;
-	if(s.cdbm_excitation >= -1000) {
-		attenuator = 0;
-	} else if (s.cdbm_excitation <= -4175){
-		attenuator = 127;
-	} else {
-		attenuator = (-1000 - s.cdbm_excitation) / 25;
+	bool fullUpload = forceUpload || !sweepUploaded || table == active;
+	uint16_t uploadedPoints = fullUpload ? 0 : active->points;
+	FPGA::BeginBatch();
+	if(fullUpload || table->points != uploadedPoints) {
+		FPGA::SetNumberOfPoints(table->points);
 	}
+	if(fullUpload || table->samplesPerPoint != active->samplesPerPoint) {
+		FPGA::SetSamplesPerPoint(table->samplesPerPoint);
+	}
+	FPGA::EndBatch();
 
 	uint32_t last_IF1 = IF1;
 
 	IFTableIndexCnt = 0;
+	LowbandTableEntries = 0;
+	uint16_t lowbandPoints = 0;
 
-	bool last_lowband = false;
+	// table is inconsistent until the loop completes
+	sweepUploaded = false;
+	uint16_t updated = 0;
+	PointCursor cursor = {table, 0, 0};
+	PointCursor uploadedCursor = {active, 0, 0};
+	// The sweep wraps around, the first point is halted to switch sources if the last one is in the other band
+	bool last_lowband = table->points && PointFrequency(cursor, table->points - 1) < BandSwitchFrequency;
+	bool uploaded_last_lowband = uploadedPoints
+			&& PointFrequency(uploadedCursor, uploadedPoints - 1) < BandSwitchFrequency;
+	bool last_changed = last_lowband != uploaded_last_lowband;
+	uint64_t last_freq = 0;
+	uint64_t last_uploaded_freq = 0;
 
 	// Transfer PLL configuration to FPGA
-	for (uint16_t i = 0; i < points; i++) {
-		uint64_t freq = s.f_start + (s.f_stop - s.f_start) * i / (s.points - 1);
+	for (uint16_t i = 0; i < table->points; i++) {
+		auto point = GetPointConfig(cursor, i, last_freq);
+		uint64_t freq = point.frequency;
+		last_freq = freq;
+		bool changed = true;
+		if(i < uploadedPoints) {
+			auto uploaded = GetPointConfig(uploadedCursor, i, last_uploaded_freq);
+			last_uploaded_freq = uploaded.frequency;
+			changed = freq != uploaded.frequency || point.attenuator != uploaded.attenuator
+					|| point.settling != uploaded.settling || point.samples != uploaded.samples;
+		}
 		// SetFrequency only manipulates the register content in RAM, no SPI communication is done.
 		// No mode-switch of FPGA necessary here.
 
@@ -307,45 +784,168 @@ bool VNA::ConfigureSweep(Protocol::SweepSettings s, SweepCallback cb) {
 		if (freq < BandSwitchFrequency) {
 			needs_halt = true;
 			lowband = true;
-		} else {
-			Source.SetFrequency(freq);
+			if (lowbandPoints == 0) {
+				// Configures the output of the lowband source, the sweep points only change the multisynth
+				Si5351.SetCLK(SiChannel::LowbandSource, freq, Si5351C::PLL::B, Si5351C::DriveStrength::mA2);
+			}
+			lowbandPoints++;
+			if (LowbandTableEntries < LowbandTableNumEntries) {
+				auto &e = LowbandTable[LowbandTableEntries];
+				if (Si5351.CalculateRawCLKConfig(SiChannel::LowbandSource, freq, Si5351C::PLL::B, e.clkconfig)) {
+					e.pointCnt = i;
+					LowbandTableEntries++;
+				}
+			}
 		}
 		if (last_lowband && !lowband) {
 			// additional halt before first highband point to enable highband source
 			needs_halt = true;
 		}
+		// The halt flag depends on the band of the previous point as well, rewrite the point if
+		// either of them moved
+		if (!changed && !last_changed) {
+			// point is still valid in the FPGA, skip the expensive PLL calculation
+			last_lowband = lowband;
+			continue;
+		}
+		last_changed = changed;
+		if (!lowband) {
+			Source.SetFrequency(freq);
+		}
 		LO1.SetFrequency(freq + used_IF);
 		FPGA::WriteSweepConfig(i, lowband, Source.GetRegisters(),
-				LO1.GetRegisters(), attenuator, freq, FPGA::SettlingTime::us540,
-				FPGA::Samples::SPPRegister, needs_halt);
+				LO1.GetRegisters(), point.attenuator, freq, point.settling,
+				point.samples, needs_halt);
 		last_lowband = lowband;
+		updated++;
+	}
+	if (lowbandPoints > LowbandTableEntries) {
+		LOG_WARN("Lowband table full, %u of %u lowband points are calculated during the sweep",
+				lowbandPoints - LowbandTableEntries, lowbandPoints);
 	}
+	// the last block of points is still transmitted while the rest of the sweep is prepared
+	LOG_INFO("Updated %u of %u sweep points", updated, table->points);
+	if(table != active) {
+		// the previous table is no longer needed, it receives the next definition
+		pending = active;
+		pending->count = 0;
+		active = table;
+	}
+	sweepUploaded = true;
 //	// revert clk configuration to previous value (might have been changed in sweep calculation)
 //	Si5351.SetCLK(1, IF1 + IF2, Si5351C::PLL::B, Si5351C::DriveStrength::mA2);
 //	Si5351.ResetPLL(Si5351C::PLL::B);
 	// Enable mixers/amplifier/PLLs
+	FPGA::BeginBatch();
 	FPGA::Enable(FPGA::Periphery::Port1Mixer);
 	FPGA::Enable(FPGA::Periphery::Port2Mixer);
 	FPGA::Enable(FPGA::Periphery::RefMixer);
 	FPGA::Enable(FPGA::Periphery::Amplifier);
 	FPGA::Enable(FPGA::Periphery::SourceChip);
-	FPGA::Enable(FPGA::Periphery::SourceRF);
+	SetStartOutput();
 	FPGA::Enable(FPGA::Periphery::LO1Chip);
 	FPGA::Enable(FPGA::Periphery::LO1RF);
-	FPGA::Enable(FPGA::Periphery::ExcitePort1);
-	FPGA::Enable(FPGA::Periphery::ExcitePort2);
+	uint8_t parameters = table->parameters ? table->parameters : Protocol::ParameterAll;
+	excitePort1 = parameters & Protocol::ParameterForward;
+	excitePort2 = parameters & Protocol::ParameterReverse;
+	FPGA::Enable(FPGA::Periphery::ExcitePort1, excitePort1);
+	FPGA::Enable(FPGA::Periphery::ExcitePort2, excitePort2);
+	FPGA::EndBatch();
+	// S-parameters that are not measured stay at zero
+	data = {};
+	data.valid = (excitePort1 ? Protocol::ParameterForward : 0) | (excitePort2 ? Protocol::ParameterReverse : 0);
 	pointCnt = 0;
-	excitingPort1 = true;
+	excitingPort1 = excitePort1;
 	IFTableIndexCnt = 0;
+	LowbandTableIndexCnt = 0;
+	haltCursor = {active, 0, 0};
+	readCursor = {active, 0, 0};
+	acquisitionStart = lastPointTime = Timing::Now();
+	sweepCycles = 0;
 	// Start the sweep
-	FPGA::StartSweep();
+	StartSweep();
 	return true;
 }
 
+bool VNA::ConfigureSweep(Protocol::SweepSettings s, SweepCallback cb, RawCallback raw, PrepareCallback prepare) {
+	// a linear sweep is a single segment, the pending table is not in use
+	auto &segment = pending->segments[0];
+	segment.f_start = s.f_start;
+	segment.f_stop = s.f_stop;
+	segment.points = s.points;
+	segment.if_bandwidth = s.if_bandwidth;
+	segment.cdbm_excitation = s.cdbm_excitation;
+	// settling time only depends on the synthesizer steps
+	segment.settling_us = 0;
+	pending->count = 1;
+	pending->parameters = s.parameters;
+	if(!PrepareTable(pending)) {
+		return false;
+	}
+	sweepCallback = cb;
+	rawCallback = raw;
+	return UploadSweep(pending, false, prepare);
+}
+
+bool VNA::AddSweepSegments(const Protocol::SegmentedSweep &s) {
+	if(s.startIndex == 0) {
+		// start of a new definition
+		pending->count = 0;
+		pending->parameters = s.parameters;
+	}
+	if(s.startIndex != pending->count || s.totalSegments > Protocol::MaxSweepSegments
+			|| s.startIndex + s.count > s.totalSegments) {
+		LOG_WARN("Unexpected sweep segments %u-%u (of %u)", s.startIndex, s.startIndex + s.count, s.totalSegments);
+		return false;
+	}
+	for(uint8_t i=0;i<s.count;i++) {
+		if(!ValidSegment(s.segments[i])) {
+			LOG_WARN("Invalid sweep segment %u", s.startIndex + i);
+			return false;
+		}
+		pending->segments[pending->count++] = s.segments[i];
+	}
+	return true;
+}
+
+bool VNA::ConfigureSegmentedSweep(SweepCallback cb, RawCallback raw, PrepareCallback prepare) {
+	if(!PrepareTable(pending)) {
+		return false;
+	}
+	sweepCallback = cb;
+	rawCallback = raw;
+	return UploadSweep(pending, false, prepare);
+}
+
+bool VNA::ReloadSweep() {
+	// prepared when it was configured
+	return UploadSweep(active, true);
+}
+
+uint16_t VNA::GetSweepPoints() {
+	return active->points;
+}
+
+void VNA::RestartSweep() {
+	FPGA::AbortSweep();
+	WaitForLowbandTransfer();
+	SetStartOutput();
+	pointCnt = 0;
+	excitingPort1 = excitePort1;
+	IFTableIndexCnt = 0;
+	LowbandTableIndexCnt = 0;
+	haltCursor = {active, 0, 0};
+	readCursor = {active, 0, 0};
+	acquisitionStart = lastPointTime = Timing::Now();
+	sweepCycles = 0;
+	StartSweep();
+}
+
 bool VNA::ConfigureManual(Protocol::ManualControl m, StatusCallback cb) {
 	manualMode = true;
 	statusCallback = cb;
 	FPGA::AbortSweep();
+	WaitForLowbandTransfer();
 	// Configure lowband source
 	if (m.SourceLowEN) {
 		Si5351.SetCLK(SiChannel::LowbandSource, m.SourceLowFrequency, Si5351C::PLL::B,
@@ -379,6 +979,7 @@ bool VNA::ConfigureManual(Protocol::ManualControl m, StatusCallback cb) {
 		Si5351.Disable(SiChannel::RefLO2);
 	}
 
+	FPGA::BeginBatch();
 	FPGA::WriteMAX2871Default(Source.GetRegisters());
 
 	FPGA::SetNumberOfPoints(1);
@@ -401,8 +1002,9 @@ bool VNA::ConfigureManual(Protocol::ManualControl m, StatusCallback cb) {
 	FPGA::Enable(FPGA::Periphery::RefMixer, m.RefEN);
 	FPGA::Enable(FPGA::Periphery::ExcitePort1, m.PortSwitch == 0);
 	FPGA::Enable(FPGA::Periphery::ExcitePort2, m.PortSwitch == 1);
+	FPGA::EndBatch();
 
-	FPGA::StartSweep();
+	StartSweep();
 	return true;
 }
 
@@ -437,6 +1039,11 @@ void VNA::fillDeviceInfo(Protocol::DeviceInfo *info) {
 	auto status = FPGA::GetStatus();
 	info->LO1_locked = (status & (int) FPGA::Interrupt::LO1Unlock) ? 0 : 1;
 	info->source_locked = (status & (int) FPGA::Interrupt::SourceUnlock) ? 0 : 1;
+	if(externalVCOMaps && (!info->LO1_locked || !info->source_locked)) {
+		// stored VCO maps might not match this hardware (anymore)
+		LOG_WARN("PLL unlocked with stored VCO maps, rebuilding them at next initialization");
+		VNA::ClearVCOMaps();
+	}
 	info->extRefAvailable = Ref::available();
 	info->extRefInUse = extRefInUse;
 	info->temperatures.LO1 = tempLO;
@@ -445,6 +1052,35 @@ void VNA::fillDeviceInfo(Protocol::DeviceInfo *info) {
 	FPGA::ResetADCLimits();
 }
 
+bool VNA::GetVCOMaps(VCOMaps *maps) {
+	if(!Source.HasVCOMap() || !LO1.HasVCOMap()) {
+		return false;
+	}
+	memcpy(maps->source, Source.GetVCOMap(), sizeof(maps->source));
+	memcpy(maps->LO1, LO1.GetVCOMap(), sizeof(maps->LO1));
+	memcpy(maps->settling_us, settlingTable, sizeof(maps->settling_us));
+	return true;
+}
+
+void VNA::SetVCOMaps(const VCOMaps &maps) {
+	Source.SetVCOMap(maps.source);
+	LO1.SetVCOMap(maps.LO1);
+	memcpy(settlingTable, maps.settling_us, sizeof(settlingTable));
+	settlingCalibrated = true;
+	externalVCOMaps = true;
+}
+
+void VNA::ClearVCOMaps() {
+	Source.ClearVCOMap();
+	LO1.ClearVCOMap();
+	// calibrated again with the new maps, the longest settling time applies until then
+	for(auto &s : settlingTable) {
+		s = MaxSettling;
+	}
+	settlingCalibrated = false;
+	externalVCOMaps = false;
+}
+
 bool VNA::Ref::available() {
 	return Si5351.ExtCLKAvailable();
 }
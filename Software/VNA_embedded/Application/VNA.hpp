@@ -3,17 +3,64 @@
 #include <cstdint>
 #include "Protocol.hpp"
 #include "FPGA/FPGA.hpp"
+#include "max2871.hpp"
 
 namespace VNA {
 
 using SweepCallback = void(*)(Protocol::Datapoint);
 using StatusCallback = void(*)(FPGA::SamplingResult);
+// Receives the unprocessed accumulators of every port measurement instead of datapoints
+using RawCallback = void(*)(const Protocol::RawMeasurement&);
+// Called once a new sweep has been validated and the previous one has stopped, before the new one starts
+using PrepareCallback = void(*)();
 
+// Programs the Si5351 without waiting for its PLLs. Called by Init if necessary, calling it earlier lets the
+// PLLs lock while the FPGA is configured
+void InitClocks();
 bool Init();
-bool ConfigureSweep(Protocol::SweepSettings s, SweepCallback cb);
+// Only the points of the sweep that differ from the previous configuration are written to the FPGA.
+// If raw is set, the S-parameters are not calculated and the measurements are passed to raw instead of cb.
+// An invalid sweep is rejected without affecting the running one
+bool ConfigureSweep(Protocol::SweepSettings s, SweepCallback cb, RawCallback raw = nullptr,
+		PrepareCallback prepare = nullptr);
+// Collects the chunks of a segmented sweep, returns false if the chunk does not continue the previous one
+bool AddSweepSegments(const Protocol::SegmentedSweep &s);
+// Starts the sweep once all segments have been added
+bool ConfigureSegmentedSweep(SweepCallback cb, RawCallback raw = nullptr, PrepareCallback prepare = nullptr);
+// Writes the complete current sweep to the FPGA again and restarts it
+bool ReloadSweep();
+// Number of points in the current sweep (across all segments)
+uint16_t GetSweepPoints();
+// Restarts the configured sweep from the first point without uploading the sweep again
+void RestartSweep();
 bool ConfigureManual(Protocol::ManualControl m, StatusCallback cb);
 bool ConfigureGenerator(Protocol::GeneratorSettings g);
 
+// How far the synthesizers move between consecutive sweep points, ordered by the required settling time.
+// The settling time of each class is calibrated with the VCO maps, band switches always use the longest one
+enum class Transition : uint8_t {
+	FineStep = 0, // same VCO and divider, small frequency step
+	CoarseStep = 1, // same VCO and divider
+	VCOChange = 2,
+	DividerChange = 3,
+	BandSwitch = 4, // first point of the sweep, lowband source involved
+};
+static constexpr uint8_t Transitions = 5;
+
+// Building the VCO maps of the synthesizers takes several seconds. They can be stored externally and
+// handed back before the next Init()
+using VCOMaps = struct _vcomaps {
+	uint16_t source[MAX2871::VCOMapEntries];
+	uint16_t LO1[MAX2871::VCOMapEntries];
+	// calibrated settling time of each Transition
+	uint16_t settling_us[Transitions];
+};
+// Returns false if the VCO maps have not been built yet
+bool GetVCOMaps(VCOMaps *maps);
+void SetVCOMaps(const VCOMaps &maps);
+// Discards the VCO maps, they are built again during the next Init()
+void ClearVCOMaps();
+
 // Only call the following function when the sweep is inactive
 bool GetTemps(uint8_t *source, uint8_t *lo);
 void fillDeviceInfo(Protocol::DeviceInfo *info);
@@ -0,0 +1,10 @@
+# Host test and benchmark of the CRC32 implementations used for the protocol framing
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../../Application/Communication
+
+SOURCES += \
+    ../../Application/Communication/Protocol.cpp \
+    main.cpp
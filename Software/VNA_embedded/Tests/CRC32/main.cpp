@@ -0,0 +1,179 @@
+#include "Protocol.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/*
+ * Compares the CRC32 implementations used for the protocol frames against the original bit-at-a-time loop:
+ * - Protocol::CRC32Software (slicing-by-8, used by the host)
+ * - a model of the STM32L4 CRC peripheral, fed the same way as HWCRC::CRC32 on the device
+ * and measures their throughput on the host. Returns 1 if any result differs.
+ */
+
+#define CRC32_POLYGON 0xEDB88320
+
+// the implementation before the table-driven one
+static uint32_t CRC32Bitwise(uint32_t crc, const void *data, uint32_t len) {
+	uint8_t *u8buf = (uint8_t*) data;
+	int k;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *u8buf++;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYGON : crc >> 1;
+	}
+	return ~crc;
+}
+
+static uint32_t ReverseBits(uint32_t v, uint8_t bits) {
+	uint32_t r = 0;
+	for(uint8_t i=0;i<bits;i++) {
+		r = (r << 1) | ((v >> i) & 1);
+	}
+	return r;
+}
+
+// Register level model of the CRC peripheral with CR = REV_IN_0 (bytes reversed) | REV_OUT
+class CRCPeripheral {
+public:
+	static constexpr uint32_t POL = 0x04C11DB7;
+	void reset(uint32_t init) {
+		crc = init;
+	}
+	void write32(uint32_t data) {
+		// bit reversal within each byte
+		uint32_t reversed = 0;
+		for(uint8_t i=0;i<4;i++) {
+			reversed |= ReverseBits((data >> (8 * i)) & 0xFF, 8) << (8 * i);
+		}
+		shift(reversed, 32);
+	}
+	void write8(uint8_t data) {
+		shift((uint32_t) ReverseBits(data, 8) << 24, 8);
+	}
+	uint32_t read() const {
+		return ReverseBits(crc, 32);
+	}
+private:
+	void shift(uint32_t data, uint8_t bits) {
+		crc ^= data;
+		for(uint8_t i=0;i<bits;i++) {
+			crc = crc & 0x80000000 ? (crc << 1) ^ POL : crc << 1;
+		}
+	}
+	uint32_t crc;
+};
+
+// Same sequence of register accesses as HWCRC::CRC32
+static uint32_t CRC32HWModel(uint32_t crc, const void *data, uint32_t len) {
+	auto u8buf = (const uint8_t*) data;
+	CRCPeripheral p;
+	p.reset(ReverseBits(~crc, 32));
+	while (len >= 4) {
+		// peripheral expects the first byte in the MSB (__REV on the little endian MCU)
+		p.write32((uint32_t) u8buf[0] << 24 | (uint32_t) u8buf[1] << 16 | (uint32_t) u8buf[2] << 8 | u8buf[3]);
+		u8buf += 4;
+		len -= 4;
+	}
+	while (len--) {
+		p.write8(*u8buf++);
+	}
+	return ~p.read();
+}
+
+using Implementation = struct {
+	const char *name;
+	uint32_t (*crc)(uint32_t, const void*, uint32_t);
+};
+static const Implementation implementations[] = {
+	{"bitwise", CRC32Bitwise},
+	{"slicing-by-8", Protocol::CRC32Software},
+	{"peripheral model", CRC32HWModel},
+	{"Protocol::CRC32", Protocol::CRC32},
+};
+
+static bool Check() {
+	bool ok = true;
+	const char check[] = "123456789";
+	for(auto &i : implementations) {
+		auto crc = i.crc(0, check, 9);
+		if(crc != 0xCBF43926) {
+			printf("%s: check value 0x%08x instead of 0xCBF43926\n", i.name, crc);
+			ok = false;
+		}
+	}
+	std::mt19937 rng(1);
+	std::vector<uint8_t> buf(1100);
+	for(unsigned int run=0;run<20000;run++) {
+		uint32_t len = rng() % buf.size();
+		// misaligned start as well
+		uint32_t offset = len ? rng() % 4 : 0;
+		if(offset > len) {
+			offset = len;
+		}
+		for(auto &b : buf) {
+			b = rng();
+		}
+		uint32_t seed = run % 2 ? rng() : 0;
+		uint32_t expected = CRC32Bitwise(seed, buf.data() + offset, len - offset);
+		for(auto &i : implementations) {
+			// in one go and continued across a split
+			uint32_t split = len - offset ? rng() % (len - offset) : 0;
+			uint32_t once = i.crc(seed, buf.data() + offset, len - offset);
+			uint32_t continued = i.crc(i.crc(seed, buf.data() + offset, split), buf.data() + offset + split,
+					len - offset - split);
+			if(once != expected || continued != expected) {
+				printf("%s: mismatch at length %u (seed 0x%08x, split %u)\n", i.name, len - offset, seed, split);
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+static void Benchmark() {
+	// typical frame sizes: responses, datapoint batches, firmware chunks
+	const uint32_t sizes[] = {8, 64, 262, 1024};
+	constexpr uint32_t total = 1 << 26;
+	std::vector<uint8_t> buf(1024);
+	std::mt19937 rng(2);
+	for(auto &b : buf) {
+		b = rng();
+	}
+	printf("%-18s", "bytes/frame");
+	for(auto s : sizes) {
+		printf("%10u", s);
+	}
+	printf("   (MB/s)\n");
+	for(auto &i : implementations) {
+		printf("%-18s", i.name);
+		for(auto s : sizes) {
+			uint32_t frames = total / s;
+			if(i.crc == CRC32HWModel) {
+				// models the peripheral bit by bit, only checks that the access pattern is correct
+				frames /= 32;
+			}
+			volatile uint32_t sink = 0;
+			auto start = std::chrono::steady_clock::now();
+			for(uint32_t f=0;f<frames;f++) {
+				sink = sink + i.crc(0, buf.data(), s);
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			printf("%10.1f", (double) frames * s / elapsed.count() / 1e6);
+		}
+		printf("\n");
+	}
+}
+
+int main() {
+	if(!Check()) {
+		printf("CRC32 implementations differ\n");
+		return 1;
+	}
+	printf("All CRC32 implementations match\n");
+	Benchmark();
+	return 0;
+}
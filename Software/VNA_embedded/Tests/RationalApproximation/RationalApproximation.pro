@@ -0,0 +1,10 @@
+# Host test and benchmark of the fractional divider calculation used by the MAX2871 and Si5351C drivers
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../../Application/Drivers
+
+SOURCES += \
+    ../../Application/Drivers/algorithm.cpp \
+    main.cpp
@@ -0,0 +1,309 @@
+#include "algorithm.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+/*
+ * Checks the integer fraction solver used for the PLL dividers:
+ * - Algorithm::BestRationalApproximation against an exhaustive search over all allowed denominators
+ * - Algorithm::BestFractionalDivider as used by the MAX2871 (F/M) and the Si5351C (a + b/c) against the
+ *   float/brute force implementations it replaced, including the carry of 1/1 into the integer part and the
+ *   minimum modulus of the MAX2871
+ * and measures the time per call. Returns 1 if any result is not optimal, invalid or worse than before.
+ */
+
+using Algorithm::RationalApproximation;
+using Algorithm::FractionalDivider;
+
+static unsigned failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+// the float Stern-Brocot search before the continued fraction solver
+static RationalApproximation BestRationalApproximationFloat(float ratio, uint32_t max_denom) {
+	RationalApproximation result;
+	uint32_t a = 0, b = 1, c = 1, d = 1;
+	while (b + d <= max_denom) {
+		auto mediant = (float) (a + c) / (b + d);
+		if (ratio == mediant) {
+			if (b + d <= max_denom) {
+				result.num = a + c;
+				result.denom = b + d;
+				return result;
+			} else if (d > b) {
+				result.num = c;
+				result.denom = d;
+				return result;
+			} else {
+				result.num = a;
+				result.denom = b;
+				return result;
+			}
+		} else if (ratio > mediant) {
+			a = a + c;
+			b = b + d;
+		} else {
+			c = a + c;
+			d = b + d;
+		}
+	}
+	// check which of the two is the better solution
+	float dev_ab = (float) a / b - ratio;
+	float dev_cd = (float) c / d - ratio;
+	if(fabs(dev_cd) < fabs(dev_ab)) {
+		result.num = c;
+		result.denom = d;
+	} else {
+		result.num = a;
+		result.denom = b;
+	}
+	return result;
+}
+
+// the MAX2871 F/M calculation before the continued fraction solver (no carry, no minimum modulus)
+static FractionalDivider MAX2871Old(uint64_t f_vco, uint32_t f_PFD) {
+	FractionalDivider result;
+	result.integer = f_vco / f_PFD;
+	uint32_t rem_f = f_vco - (uint64_t) result.integer * f_PFD;
+	auto approx = BestRationalApproximationFloat((float) rem_f / f_PFD, 4095);
+	result.num = approx.num;
+	result.denom = approx.denom;
+	return result;
+}
+
+static FractionalDivider MAX2871New(uint64_t f_vco, uint32_t f_PFD) {
+	return Algorithm::BestFractionalDivider(f_vco, f_PFD, 4095, 2);
+}
+
+// the Si5351C::FindOptimalDivider search before the continued fraction solver
+static FractionalDivider Si5351Old(uint32_t f_pll, uint32_t f) {
+	FractionalDivider result;
+	uint32_t a = f_pll / f;
+	int32_t f_rem = f_pll - f * a;
+	uint32_t best_b = 0, best_c = 1;
+	uint32_t best_deviation = UINT32_MAX;
+	for (uint32_t c = (1UL << 20) - 1; c >= (1UL << 19); c--) {
+		uint32_t guess_b = (uint64_t) f_rem * c / f;
+		for (uint32_t b = guess_b; b <= guess_b + 1; b++) {
+			int32_t f_div = (uint64_t) f * b / c;
+			uint32_t deviation = abs(f_rem - f_div);
+			if (deviation < best_deviation) {
+				best_b = b;
+				best_c = c;
+				best_deviation = deviation;
+				if (deviation == 0) {
+					break;
+				}
+			}
+		}
+		if (best_deviation == 0) {
+			break;
+		}
+	}
+	result.integer = a;
+	result.num = best_b;
+	result.denom = best_c;
+	return result;
+}
+
+static FractionalDivider Si5351New(uint32_t f_pll, uint32_t f) {
+	return Algorithm::BestFractionalDivider(f_pll, f, (1UL << 20) - 1);
+}
+
+// Exact error of integer + num/denom against target/ref, scaled by denom * ref: |(integer * denom + num) * ref - target * denom|
+static unsigned __int128 ScaledError(const FractionalDivider &d, uint64_t target, uint32_t ref) {
+	unsigned __int128 set = ((unsigned __int128) d.integer * d.denom + d.num) * ref;
+	unsigned __int128 want = (unsigned __int128) target * d.denom;
+	return set > want ? set - want : want - set;
+}
+
+// compares the errors of two dividers without division, returns <0 if a is closer, >0 if b is closer
+static int CompareError(const FractionalDivider &a, const FractionalDivider &b, uint64_t target, uint32_t ref) {
+	auto ea = ScaledError(a, target, ref) * b.denom;
+	auto eb = ScaledError(b, target, ref) * a.denom;
+	return ea < eb ? -1 : (ea > eb ? 1 : 0);
+}
+
+static double ErrorHz(const FractionalDivider &d, uint64_t target, uint32_t ref) {
+	return (double) ScaledError(d, target, ref) / d.denom;
+}
+
+// checks the solver against all denominators up to max_denom
+static void CheckExhaustive(uint32_t num, uint32_t denom, uint32_t max_denom) {
+	auto approx = Algorithm::BestRationalApproximation(num, denom, max_denom);
+	CHECK(approx.denom >= 1 && approx.denom <= max_denom, "%u/%u (max %u): denominator %u out of range", num, denom,
+			max_denom, approx.denom);
+	FractionalDivider found = {0, approx.num, approx.denom};
+	for (uint32_t q = 1; q <= max_denom; q++) {
+		// only the two numerators next to num/denom * q can be closest
+		uint32_t p = (uint64_t) num * q / denom;
+		for (uint32_t pp = p; pp <= p + 1; pp++) {
+			FractionalDivider candidate = {0, pp, q};
+			if (CompareError(candidate, found, num, denom) < 0) {
+				CHECK(false, "%u/%u (max %u): got %u/%u, %u/%u is closer", num, denom, max_denom, approx.num,
+						approx.denom, pp, q);
+				return;
+			}
+		}
+	}
+}
+
+static void CheckMAX2871(uint64_t f_vco, uint32_t f_PFD, unsigned &better, unsigned &invalidBefore) {
+	auto n = MAX2871New(f_vco, f_PFD);
+	auto o = MAX2871Old(f_vco, f_PFD);
+	CHECK(n.denom >= 2 && n.denom <= 4095 && n.num < n.denom,
+			"MAX2871 %llu: invalid F=%u/M=%u", (unsigned long long) f_vco, n.num, n.denom);
+	bool oldValid = o.denom >= 2 && o.num < o.denom;
+	if (!oldValid) {
+		invalidBefore++;
+		return;
+	}
+	int cmp = CompareError(n, o, f_vco, f_PFD);
+	CHECK(cmp <= 0, "MAX2871 %llu: N=%u F=%u/M=%u (%.3fHz) worse than N=%u F=%u/M=%u (%.3fHz)",
+			(unsigned long long) f_vco, n.integer, n.num, n.denom, ErrorHz(n, f_vco, f_PFD), o.integer, o.num,
+			o.denom, ErrorHz(o, f_vco, f_PFD));
+	if (cmp < 0) {
+		better++;
+	}
+}
+
+static void CheckSi5351(uint32_t f_pll, uint32_t f, double &maxOld, double &maxNew) {
+	auto n = Si5351New(f_pll, f);
+	auto o = Si5351Old(f_pll, f);
+	CHECK(n.denom >= 1 && n.denom < (1UL << 20) && n.num < n.denom, "Si5351 %u/%u: invalid b/c=%u/%u", f_pll, f,
+			n.num, n.denom);
+	CHECK(CompareError(n, o, f_pll, f) <= 0, "Si5351 %u/%u: a=%u b/c=%u/%u (%.4fHz) worse than a=%u b/c=%u/%u (%.4fHz)",
+			f_pll, f, n.integer, n.num, n.denom, ErrorHz(n, f_pll, f), o.integer, o.num, o.denom,
+			ErrorHz(o, f_pll, f));
+	// error of the output frequency f_pll / (a + b/c)
+	auto outputError = [&](const FractionalDivider &d) {
+		double divider = d.integer + (double) d.num / d.denom;
+		return fabs(f_pll / divider - f);
+	};
+	maxOld = std::max(maxOld, outputError(o));
+	maxNew = std::max(maxNew, outputError(n));
+}
+
+template<typename F>
+static double NanosecondsPerCall(unsigned calls, F f) {
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < calls; i++) {
+		f(i);
+	}
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / calls;
+}
+
+int main() {
+	std::mt19937 rng(1);
+	constexpr uint32_t f_PFD = 100000000;
+
+	// solver against exhaustive search
+	for (unsigned i = 0; i < 2000; i++) {
+		uint32_t denom = rng() % 1000000000 + 1;
+		CheckExhaustive(rng() % denom, denom, 4095);
+	}
+	for (unsigned i = 0; i < 20000; i++) {
+		uint32_t denom = rng() % 100000 + 1;
+		uint32_t max_denom = rng() % 200 + 1;
+		CheckExhaustive(rng() % denom, denom, max_denom);
+	}
+	CheckExhaustive(0, 1, 1);
+	CheckExhaustive(1, 1, 1);
+	CheckExhaustive(UINT32_MAX - 1, UINT32_MAX, 4095);
+	CheckExhaustive(1, UINT32_MAX, 4095);
+	printf("Exhaustive check done\n");
+
+	// MAX2871 edge cases: remainders rounding to 0 or 1 and exactly representable fractions
+	{
+		const uint64_t base = 35ULL * f_PFD;
+		struct {
+			uint32_t rem;
+			uint32_t N, F, M;
+		} edge[] = {
+			{0, 35, 0, 2},
+			{1, 35, 0, 2},
+			{f_PFD / 8192, 35, 0, 2},
+			{f_PFD - 1, 36, 0, 2},
+			{f_PFD - f_PFD / 8192, 36, 0, 2},
+			{f_PFD / 2, 35, 1, 2},
+			{f_PFD / 4095, 35, 1, 4095},
+			{f_PFD - f_PFD / 4095, 35, 4094, 4095},
+		};
+		for (auto &e : edge) {
+			auto d = MAX2871New(base + e.rem, f_PFD);
+			CHECK(d.integer == e.N && d.num == e.F && d.denom == e.M,
+					"MAX2871 remainder %u: expected N=%u F=%u/M=%u, got N=%u F=%u/M=%u", e.rem, e.N, e.F, e.M,
+					d.integer, d.num, d.denom);
+		}
+		// the old calculation produced unusable settings for these
+		auto o = MAX2871Old(base + f_PFD - 1, f_PFD);
+		printf("MAX2871 1Hz below integer: old N=%u F=%u/M=%u, new carries into N\n", o.integer, o.num, o.denom);
+		o = MAX2871Old(base + 1, f_PFD);
+		printf("MAX2871 1Hz above integer: old N=%u F=%u/M=%u, new uses M=2\n", o.integer, o.num, o.denom);
+	}
+
+	// MAX2871 old vs new over the VCO range
+	{
+		unsigned better = 0, invalidBefore = 0;
+		constexpr unsigned cases = 20000;
+		for (unsigned i = 0; i < cases; i++) {
+			uint64_t f_vco = 3000000000ULL + (uint64_t) rng() % 3000000001ULL;
+			CheckMAX2871(f_vco, f_PFD, better, invalidBefore);
+		}
+		printf("MAX2871: %u cases, new closer in %u, old result invalid in %u\n", cases, better, invalidBefore);
+	}
+
+	// Si5351C old vs new for the fixed outputs and random lowband frequencies
+	{
+		constexpr uint32_t f_pll = 800000000;
+		double maxOld = 0, maxNew = 0;
+		const uint32_t fixed[] = {100000000, 16000000, 59850000, 62000000, 1000000, 10000000};
+		for (auto f : fixed) {
+			CheckSi5351(f_pll, f, maxOld, maxNew);
+		}
+		// the fractional multisynth divider must be at least 8
+		for (unsigned i = 0; i < 2000; i++) {
+			uint32_t f = rng() % 25000000 + 100000;
+			CheckSi5351(f_pll, f, maxOld, maxNew);
+		}
+		// divider just below an integer, rounds up to a + 1 with b = 0
+		{
+			auto d = Si5351New(f_pll, 100000001);
+			CHECK(d.integer == 8 && d.num == 0, "Si5351 800MHz/100.000001MHz: expected a=8 b=0, got a=%u b/c=%u/%u",
+					d.integer, d.num, d.denom);
+			// 8 is exact but 1Hz off, keep it out of the statistic
+			double ignoreOld = 0, ignoreNew = 0;
+			CheckSi5351(f_pll, 100000001, ignoreOld, ignoreNew);
+		}
+		printf("Si5351C: worst case output error old %.4fHz, new %.4fHz\n", maxOld, maxNew);
+	}
+
+	// timing
+	{
+		volatile uint32_t sink = 0;
+		auto tOld = NanosecondsPerCall(100000, [&](unsigned i) {
+			sink += MAX2871Old(3000000000ULL + i * 29989ULL, f_PFD).num;
+		});
+		auto tNew = NanosecondsPerCall(100000, [&](unsigned i) {
+			sink += MAX2871New(3000000000ULL + i * 29989ULL, f_PFD).num;
+		});
+		printf("MAX2871 F/M: old %.0fns, new %.0fns per call\n", tOld, tNew);
+		tOld = NanosecondsPerCall(50, [&](unsigned i) {
+			sink += Si5351Old(800000000, 1000000 + i * 499979).num;
+		});
+		tNew = NanosecondsPerCall(100000, [&](unsigned i) {
+			sink += Si5351New(800000000, 1000000 + (i % 50) * 499979).num;
+		});
+		printf("Si5351C divider: old %.0fns, new %.0fns per call\n", tOld, tNew);
+	}
+
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}